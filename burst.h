@@ -0,0 +1,244 @@
+#ifndef BURST_H
+#define BURST_H
+
+#include <pico/stdlib.h>
+#include <hardware/pio.h>
+#include <hardware/dma.h>
+#include <hardware/clocks.h>
+#include <hardware/gpio.h>
+#include "transmitter.h"
+#include "synth.h"
+#include "log.h"
+
+// Burst (BPS) mode of pot control: the pulse train of the pot setting is
+// gated on for a burst length and off for the rest of a slower burst
+// period. One burst period is written out as tc_pulse requests, and every
+// output's DMA channel plays it into its state machine over and over. A
+// second DMA channel per output rewinds the first when it finishes, so once
+// started no CPU is involved at all.
+#define BURST_MAX_PULSES 127 // Pulses in one burst
+#define BURST_MIN_MS 2       // Burst length range of the duty pot
+#define BURST_MAX_MS 100
+#define BURST_MIN_HZ 1       // Burst rate range of the frequency pot
+#define BURST_MAX_HZ 25
+#define BURST_MIN_GAP_MS 5   // Off time every burst keeps at least
+
+// Every pattern has the same number of words, so the DMA transfer count
+// never changes. Unused requests are (0, 0), which only take
+// TC_PULSE_RISE cycles.
+#define BURST_WORDS ((BURST_MAX_PULSES + 1) * 2)
+
+static_assert((BURST_MIN_GAP_MS * 1000 << SYNTH_FRAC_BITS) > (BURST_MAX_PULSES + 1) * TC_PULSE_RISE,
+              "Burst gap holds the padding requests");
+
+uint32_t burst_patterns[2][BURST_WORDS];
+uint32_t *volatile burst_address = burst_patterns[0]; // Read by the rewind channels
+uint8_t burst_current = 0;
+
+int burst_rewind[TX_OUTPUTS]; // Rewind channel of every output
+bool burst_running = false;
+
+uint8_t burst_frequency_index;
+uint16_t burst_width_us;
+uint16_t burst_length_ms = 0;
+uint16_t burst_rate_hz = 0;
+uint32_t burst_period_us = 0; // Of the pattern playing
+uint64_t burst_swapped = 0; // Last pattern change, us
+uint32_t burst_hold_us = 0; // Until every channel has left the pattern before it
+
+void burst_init();
+uint16_t burst_build(uint32_t *, uint8_t, uint16_t, uint16_t, uint16_t, uint32_t *);
+void burst_start(uint8_t, uint16_t, uint16_t, uint16_t);
+void burst_set(uint16_t, uint16_t);
+void burst_stop();
+
+void burst_init()
+{
+    for (int i = 0; i < TX_OUTPUTS; i++)
+        burst_rewind[i] = dma_claim_unused_channel(true);
+}
+
+// Writes one burst period into pattern: pulses of width_us at
+// frequency_table[frequency_index] for length_ms, the rest of 1 / rate_hz
+// off. The number of pulses is also held under the long governor window's
+// duty. A burst period too short for even one pulse period and the gap
+// (slow pulses at a high rate) is stretched to fit them. Returns the pulses
+// per burst, the burst period in us goes to period_us.
+uint16_t burst_build(uint32_t *pattern, uint8_t frequency_index, uint16_t width_us, uint16_t length_ms, uint16_t rate_hz,
+                     uint32_t *period_us)
+{
+    // In state machine cycles, see tc_pulse.pio
+    uint32_t period = SYNTH_SM_HZ / frequency_table[frequency_index];
+    uint32_t burst_period = SYNTH_SM_HZ / rate_hz;
+    uint32_t on = ((width_us << SYNTH_FRAC_BITS) - TC_PULSE_HIGH) / 2;
+
+    uint32_t pulses = (uint32_t)length_ms * frequency_table[frequency_index] / 1000;
+    uint32_t duty_pulses = (uint32_t)GOVERNOR_LONG_PERMILLE * 1000 / ((uint32_t)width_us * rate_hz);
+    uint32_t min_gap = ((uint32_t)BURST_MIN_GAP_MS * 1000) << SYNTH_FRAC_BITS;
+
+    if (burst_period < period + min_gap)
+        burst_period = period + min_gap;
+
+    uint32_t fit_pulses = (burst_period - min_gap) / period;
+
+    if (pulses > duty_pulses)
+        pulses = duty_pulses;
+    if (pulses > fit_pulses)
+        pulses = fit_pulses;
+    if (pulses > BURST_MAX_PULSES)
+        pulses = BURST_MAX_PULSES;
+    if (pulses < 1)
+        pulses = 1;
+
+    *period_us = burst_period >> SYNTH_FRAC_BITS;
+
+    uint16_t count = 0;
+
+    // Every pulse request lasts exactly one period
+    for (uint32_t i = 0; i < pulses; i++)
+    {
+        pattern[count++] = period - 2 * on - TC_PULSE_HIGH - TC_PULSE_RISE - 1;
+        pattern[count++] = on;
+    }
+
+    // Padding, then the wait that completes the burst period. The gap
+    // after the last pulse covers what the padding requests take.
+    uint32_t padding = BURST_MAX_PULSES - pulses;
+    for (uint32_t i = 0; i < padding; i++)
+    {
+        pattern[count++] = 0;
+        pattern[count++] = 0;
+    }
+
+    pattern[count++] = burst_period - pulses * period - (padding + 1) * TC_PULSE_RISE;
+    pattern[count++] = 0;
+
+    return pulses;
+}
+
+// Hands the pins of every output from their PWM slice to burst playback,
+// frequency and pulse width stay at the pot setting of normal mode
+void burst_start(uint8_t frequency_index, uint16_t width_us, uint16_t length_pot, uint16_t rate_pot)
+{
+    if (burst_running)
+        return;
+
+    // PWM levels go to 0, so the pins are quiet once handed back
+    transmitt_off();
+
+    burst_frequency_index = frequency_index;
+    burst_width_us = width_us;
+    burst_length_ms = map(length_pot, 0, 4095, BURST_MIN_MS, BURST_MAX_MS);
+    burst_rate_hz = map(rate_pot, 0, 4095, BURST_MIN_HZ, BURST_MAX_HZ);
+
+    burst_current = 0;
+    burst_build(burst_patterns[0], frequency_index, width_us, burst_length_ms, burst_rate_hz, &burst_period_us);
+    burst_address = burst_patterns[0];
+    burst_swapped = time_us_64();
+    burst_hold_us = 0;
+
+    float clkdiv = (float)clock_get_hz(clk_sys) / SYNTH_SM_HZ;
+
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        SynthOutput *output = &synth_outputs[i];
+
+        tc_pulse_program_init(synth_pio, output->sm, synth_offset, output->tx->pin, clkdiv, SYNTH_ON_CEILING);
+
+        // Pattern into the FIFO, then the rewind channel starts it again
+        dma_channel_config config = dma_channel_get_default_config(output->dma);
+        channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+        channel_config_set_read_increment(&config, true);
+        channel_config_set_write_increment(&config, false);
+        channel_config_set_dreq(&config, pio_get_dreq(synth_pio, output->sm, true));
+        channel_config_set_chain_to(&config, burst_rewind[i]);
+        dma_channel_configure(output->dma, &config, &synth_pio->txf[output->sm], burst_address, BURST_WORDS, false);
+
+        // Writing the read address with the trigger alias restarts it
+        dma_channel_config rewind = dma_channel_get_default_config(burst_rewind[i]);
+        channel_config_set_transfer_data_size(&rewind, DMA_SIZE_32);
+        channel_config_set_read_increment(&rewind, false);
+        channel_config_set_write_increment(&rewind, false);
+        dma_channel_configure(burst_rewind[i], &rewind, &dma_hw->ch[output->dma].al3_read_addr_trig,
+                              &burst_address, 1, false);
+    }
+
+    burst_running = true;
+
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        dma_channel_start(synth_outputs[i].dma);
+        pio_sm_set_enabled(synth_pio, synth_outputs[i].sm, true);
+    }
+}
+
+// Pots in burst mode: duty pot is the burst length, frequency pot the burst
+// rate. A new pattern is built into the buffer not in use and takes over at
+// the next rewind, so the running burst is never cut.
+void burst_set(uint16_t length_pot, uint16_t rate_pot)
+{
+    if (!burst_running)
+        return;
+
+    uint16_t length_ms = map(length_pot, 0, 4095, BURST_MIN_MS, BURST_MAX_MS);
+    uint16_t rate_hz = map(rate_pot, 0, 4095, BURST_MIN_HZ, BURST_MAX_HZ);
+    if (length_ms == burst_length_ms && rate_hz == burst_rate_hz)
+        return;
+
+    // The other buffer may only be written once every channel has moved on
+    // to the current one, at most one burst period of the pattern before
+    uint64_t now = time_us_64();
+    if (now - burst_swapped < burst_hold_us)
+        return;
+
+    uint8_t next = burst_current ^ 1;
+    uint32_t period_us;
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+    uint16_t pulses =
+#endif
+        burst_build(burst_patterns[next], burst_frequency_index, burst_width_us, length_ms, rate_hz, &period_us);
+
+    __dmb();
+    burst_address = burst_patterns[next];
+    burst_current = next;
+    burst_swapped = now;
+    burst_hold_us = burst_period_us + 1000;
+    burst_period_us = period_us;
+    burst_length_ms = length_ms;
+    burst_rate_hz = rate_hz;
+
+    LOG_INFO("Burst %u ms every %u us, %u pulses\n", length_ms, period_us, pulses);
+}
+
+// Back to normal pot control, the pins return to their PWM slices
+void burst_stop()
+{
+    if (!burst_running)
+        return;
+
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        SynthOutput *output = &synth_outputs[i];
+
+        // Unchain first so that aborting the data channel cannot start the
+        // rewind channel again
+        dma_channel_config config = dma_get_channel_config(output->dma);
+        channel_config_set_chain_to(&config, output->dma);
+        dma_channel_set_config(output->dma, &config, false);
+
+        dma_channel_abort(burst_rewind[i]);
+        dma_channel_abort(output->dma);
+        dma_channel_acknowledge_irq1(output->dma);
+
+        pio_sm_set_enabled(synth_pio, output->sm, false);
+        pio_sm_exec(synth_pio, output->sm, pio_encode_set(pio_pins, 0));
+        pio_sm_clear_fifos(synth_pio, output->sm);
+
+        gpio_set_function(output->tx->pin, GPIO_FUNC_PWM);
+        gpio_set_function(output->tx->led, GPIO_FUNC_PWM);
+    }
+
+    burst_running = false;
+}
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef ENVELOPE_H
+#define ENVELOPE_H
+
+#include <stdint.h>
+#include <array>
+
+// Attack/decay/sustain/release envelopes for the pulse width of a note. The
+// curve shapes are constexpr tables and every profile carries its table
+// steps per us, so the level at any moment is a subtraction, a multiply and
+// a lookup. Levels go from 0 to ENVELOPE_FULL, a note's pulse width is
+// scaled by it.
+#define ENVELOPE_STEPS 64
+#define ENVELOPE_FULL 255
+#define ENVELOPE_RATE_BITS 24 // Fraction bits of the rates, elapsed * rate stays below 2^30
+
+#define ENVELOPE_BY_PROGRAM -1 // Channels pick their profile with program changes
+
+#define MIDI_PROGRAM_CHANGE 0xC0
+
+typedef enum
+{
+    ENVELOPE_FLAT, // Full width from note on to note off
+    ENVELOPE_ORGAN,
+    ENVELOPE_PIANO,
+    ENVELOPE_PLUCK,
+    ENVELOPE_BELL,
+    ENVELOPE_BRASS,
+    ENVELOPE_PAD,
+    ENVELOPE_COUNT
+} EnvelopeType;
+
+typedef struct
+{
+    uint32_t attack_us;
+    uint32_t decay_us;
+    uint8_t sustain;
+    uint32_t release_us;
+    uint32_t attack_rate; // Table steps per us, 8.24
+    uint32_t decay_rate;
+    uint32_t release_rate;
+} EnvelopeProfile;
+
+typedef struct
+{
+    uint8_t profile;
+    bool released;
+    uint8_t release_from; // Level at the note off
+    uint32_t start;       // Note on, or note off once released, us
+} Envelope;
+
+constexpr uint32_t envelope_rate(uint32_t us)
+{
+    // Rounded down so that the step index stays below ENVELOPE_STEPS. It
+    // loses at most us / 2^24 of a step by the end of a phase, so even the
+    // longest phases get through the whole table.
+    return us == 0 ? 0 : (((uint32_t)ENVELOPE_STEPS << ENVELOPE_RATE_BITS) - 1) / us;
+}
+
+constexpr EnvelopeProfile envelope_profile(uint32_t attack_ms, uint32_t decay_ms, uint8_t sustain, uint32_t release_ms)
+{
+    return EnvelopeProfile{attack_ms * 1000, decay_ms * 1000, sustain, release_ms * 1000,
+                           envelope_rate(attack_ms * 1000), envelope_rate(decay_ms * 1000),
+                           envelope_rate(release_ms * 1000)};
+}
+
+// e^x for the table shapes, x between -4 and 0
+constexpr double envelope_exp(double x)
+{
+    double small = x / 16.0;
+    double result = 1.0 + small + small * small / 2.0 + small * small * small / 6.0 +
+                    small * small * small * small / 24.0;
+    for (int i = 0; i < 4; i++)
+        result *= result;
+    return result;
+}
+
+// Attack rises fast then levels off, decay and release fall away
+// exponentially. Both end exactly at their final level.
+constexpr std::array<uint8_t, ENVELOPE_STEPS> make_envelope_rise()
+{
+    std::array<uint8_t, ENVELOPE_STEPS> table{};
+    for (int i = 0; i < ENVELOPE_STEPS; i++)
+    {
+        double x = (double)i / (ENVELOPE_STEPS - 1);
+        table[i] = (uint8_t)(ENVELOPE_FULL * (1.0 - envelope_exp(-3.0 * x)) / (1.0 - envelope_exp(-3.0)) + 0.5);
+    }
+    return table;
+}
+
+constexpr std::array<uint8_t, ENVELOPE_STEPS> make_envelope_fall()
+{
+    std::array<uint8_t, ENVELOPE_STEPS> table{};
+    for (int i = 0; i < ENVELOPE_STEPS; i++)
+    {
+        double x = (double)i / (ENVELOPE_STEPS - 1);
+        table[i] = (uint8_t)(ENVELOPE_FULL * (envelope_exp(-4.0 * x) - envelope_exp(-4.0)) / (1.0 - envelope_exp(-4.0)) + 0.5);
+    }
+    return table;
+}
+
+constexpr std::array<uint8_t, ENVELOPE_STEPS> envelope_rise = make_envelope_rise();
+constexpr std::array<uint8_t, ENVELOPE_STEPS> envelope_fall = make_envelope_fall();
+
+static_assert(envelope_rise[0] == 0 && envelope_rise[ENVELOPE_STEPS - 1] == ENVELOPE_FULL, "Attack curve end points");
+static_assert(envelope_fall[0] == ENVELOPE_FULL && envelope_fall[ENVELOPE_STEPS - 1] == 0, "Decay curve end points");
+
+// Attack ms, decay ms, sustain level, release ms
+constexpr EnvelopeProfile envelope_profiles[ENVELOPE_COUNT] = {
+    envelope_profile(0, 0, ENVELOPE_FULL, 0),  // ENVELOPE_FLAT
+    envelope_profile(5, 0, ENVELOPE_FULL, 20), // ENVELOPE_ORGAN
+    envelope_profile(2, 800, 90, 150),        // ENVELOPE_PIANO
+    envelope_profile(2, 300, 60, 80),         // ENVELOPE_PLUCK
+    envelope_profile(1, 1500, 0, 400),        // ENVELOPE_BELL
+    envelope_profile(40, 120, 200, 80),       // ENVELOPE_BRASS
+    envelope_profile(250, 300, 200, 400),     // ENVELOPE_PAD
+};
+
+// Last step of the slowest phase is reached
+static_assert((envelope_profiles[ENVELOPE_BELL].decay_us - 1) * envelope_profiles[ENVELOPE_BELL].decay_rate >> ENVELOPE_RATE_BITS ==
+                  ENVELOPE_STEPS - 1,
+              "Envelope rate precision");
+
+// Profile for each General MIDI program family (program / 8)
+const uint8_t envelope_program_families[16] = {
+    ENVELOPE_PIANO, ENVELOPE_BELL, ENVELOPE_ORGAN, ENVELOPE_PLUCK, // Piano, chromatic percussion, organ, guitar
+    ENVELOPE_PLUCK, ENVELOPE_PAD, ENVELOPE_PAD, ENVELOPE_BRASS,    // Bass, strings, ensemble, brass
+    ENVELOPE_BRASS, ENVELOPE_BRASS, ENVELOPE_FLAT, ENVELOPE_PAD,   // Reed, pipe, synth lead, synth pad
+    ENVELOPE_PAD, ENVELOPE_PLUCK, ENVELOPE_BELL, ENVELOPE_FLAT};   // Synth effects, ethnic, percussive, sound effects
+
+// Profile of every MIDI channel for the song that is playing
+uint8_t envelope_channels[16];
+bool envelope_follow_programs = true;
+
+void envelope_reset(int8_t);
+void envelope_program(uint8_t, uint8_t);
+uint8_t envelope_for_channel(uint8_t);
+void envelope_start(Envelope *, uint8_t, uint32_t);
+void envelope_release(Envelope *, uint32_t);
+uint8_t envelope_level(const Envelope *, uint32_t);
+bool envelope_done(const Envelope *, uint32_t);
+
+// Start of a song: one profile for every channel, or ENVELOPE_BY_PROGRAM to
+// start flat and follow the program changes of the song
+void envelope_reset(int8_t song_profile)
+{
+    uint8_t profile = song_profile >= 0 && song_profile < ENVELOPE_COUNT ? song_profile : (uint8_t)ENVELOPE_FLAT;
+
+    for (int i = 0; i < 16; i++)
+        envelope_channels[i] = profile;
+
+    envelope_follow_programs = song_profile == ENVELOPE_BY_PROGRAM;
+}
+
+// Program change, only followed when the song has no fixed profile
+void envelope_program(uint8_t channel, uint8_t program)
+{
+    if (envelope_follow_programs)
+        envelope_channels[channel & 0x0F] = envelope_program_families[(program >> 3) & 0x0F];
+}
+
+uint8_t envelope_for_channel(uint8_t channel)
+{
+    return envelope_channels[channel & 0x0F];
+}
+
+void envelope_start(Envelope *envelope, uint8_t profile, uint32_t now)
+{
+    envelope->profile = profile < ENVELOPE_COUNT ? profile : (uint8_t)ENVELOPE_FLAT;
+    envelope->released = false;
+    envelope->start = now;
+}
+
+void envelope_release(Envelope *envelope, uint32_t now)
+{
+    if (envelope->released)
+        return;
+
+    envelope->release_from = envelope_level(envelope, now);
+    envelope->released = true;
+    envelope->start = now;
+}
+
+uint8_t envelope_level(const Envelope *envelope, uint32_t now)
+{
+    const EnvelopeProfile *profile = &envelope_profiles[envelope->profile];
+    uint32_t elapsed = now - envelope->start;
+
+    if (envelope->released)
+    {
+        if (elapsed >= profile->release_us)
+            return 0;
+        return envelope->release_from * envelope_fall[(elapsed * profile->release_rate) >> ENVELOPE_RATE_BITS] / ENVELOPE_FULL;
+    }
+
+    if (elapsed < profile->attack_us)
+        return envelope_rise[(elapsed * profile->attack_rate) >> ENVELOPE_RATE_BITS];
+    elapsed -= profile->attack_us;
+
+    if (elapsed < profile->decay_us)
+        return profile->sustain + (ENVELOPE_FULL - profile->sustain) * envelope_fall[(elapsed * profile->decay_rate) >> ENVELOPE_RATE_BITS] / ENVELOPE_FULL;
+
+    return profile->sustain;
+}
+
+// Note is released and has faded out completely
+bool envelope_done(const Envelope *envelope, uint32_t now)
+{
+    return envelope->released && now - envelope->start >= envelope_profiles[envelope->profile].release_us;
+}
+
+#endif
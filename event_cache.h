@@ -0,0 +1,158 @@
+#ifndef EVENT_CACHE_H
+#define EVENT_CACHE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <pico/stdlib.h>
+#include "ff.h"
+#include "log.h"
+
+// Precompiled songs are stored next to the MIDI file as "<name>.tcev": a
+// header followed by time-ordered note and control records (pitch bend,
+// the controllers of modulation.h and program changes) with the timestamps already
+// resolved against the tempo map, so playing one back is nothing more than
+// reading records in order.
+#define TCEV_EXTENSION ".tcev"
+#define TCEV_MAGIC "TCEV"
+#define TCEV_VERSION 3 // 2: pitch bend and controller records, 3: program changes
+
+// Records written to the card per f_write
+#define TCEV_BLOCK_RECORDS 64
+
+typedef struct
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t source_size; // Size and timestamp of the .mid the cache was made from
+    uint16_t source_date;
+    uint16_t source_time;
+    uint32_t record_count;
+} TcevHeader;
+
+typedef struct
+{
+    uint32_t time_us; // From the start of the song
+    uint8_t status;   // Note on/off, pitch bend, control or program change with channel
+    uint8_t data[2];  // As in the MIDI event, 0 velocity for note off
+    uint8_t reserved;
+} TcevRecord;
+
+static_assert(sizeof(TcevHeader) == 20, "TcevHeader must match the file layout");
+static_assert(sizeof(TcevRecord) == 8, "TcevRecord must match the file layout");
+
+bool tcev_is_cache_name(const char *file_name)
+{
+    size_t length = strlen(file_name);
+    size_t ext_length = strlen(TCEV_EXTENSION);
+
+    return length >= ext_length && strcasecmp(file_name + length - ext_length, TCEV_EXTENSION) == 0;
+}
+
+bool tcev_cache_name(const char *file_name, char *cache_name, size_t size)
+{
+    return snprintf(cache_name, size, "%s%s", file_name, TCEV_EXTENSION) < (int)size;
+}
+
+bool tcev_header_matches(const TcevHeader *header, const FILINFO *source)
+{
+    return memcmp(header->magic, TCEV_MAGIC, 4) == 0 &&
+           header->version == TCEV_VERSION &&
+           header->record_size == sizeof(TcevRecord) &&
+           header->source_size == source->fsize &&
+           header->source_date == source->fdate &&
+           header->source_time == source->ftime;
+}
+
+// Collects records into blocks before handing them to FatFs. The header is
+// only written by finish(), an interrupted compile leaves no valid magic.
+class TcevWriter
+{
+private:
+    FIL *fil = nullptr;
+    TcevRecord block[TCEV_BLOCK_RECORDS];
+    uint16_t block_fill = 0;
+    uint32_t record_count = 0;
+    bool error = false;
+
+    void flush();
+
+public:
+    bool begin(FIL *);
+    void add(uint32_t, uint8_t, uint8_t, uint8_t);
+    bool finish(const FILINFO *);
+};
+
+bool TcevWriter::begin(FIL *file)
+{
+    fil = file;
+    block_fill = 0;
+    record_count = 0;
+    error = false;
+
+    // Placeholder, filled in once the record count is known
+    TcevHeader header;
+    memset(&header, 0, sizeof(header));
+
+    UINT bytes_written;
+    if (f_write(fil, &header, sizeof(header), &bytes_written) != FR_OK || bytes_written != sizeof(header))
+        error = true;
+
+    return !error;
+}
+
+void TcevWriter::flush()
+{
+    if (block_fill == 0 || error)
+        return;
+
+    UINT size = block_fill * sizeof(TcevRecord);
+    UINT bytes_written;
+    if (f_write(fil, block, size, &bytes_written) != FR_OK || bytes_written != size)
+    {
+        LOG_ERROR("Failed to write event cache\n");
+        error = true;
+    }
+
+    block_fill = 0;
+}
+
+void TcevWriter::add(uint32_t time_us, uint8_t status, uint8_t note, uint8_t velocity)
+{
+    TcevRecord *record = &block[block_fill];
+    record->time_us = time_us;
+    record->status = status;
+    record->data[0] = note;
+    record->data[1] = velocity;
+    record->reserved = 0;
+
+    record_count++;
+    if (++block_fill == TCEV_BLOCK_RECORDS)
+        flush();
+}
+
+bool TcevWriter::finish(const FILINFO *source)
+{
+    flush();
+    if (error)
+        return false;
+
+    TcevHeader header;
+    memcpy(header.magic, TCEV_MAGIC, 4);
+    header.version = TCEV_VERSION;
+    header.record_size = sizeof(TcevRecord);
+    header.source_size = source->fsize;
+    header.source_date = source->fdate;
+    header.source_time = source->ftime;
+    header.record_count = record_count;
+
+    UINT bytes_written;
+    if (f_lseek(fil, 0) != FR_OK ||
+        f_write(fil, &header, sizeof(header), &bytes_written) != FR_OK || bytes_written != sizeof(header))
+        return false;
+
+    return true;
+}
+
+#endif
@@ -5,6 +5,7 @@
 #include <pico/stdio.h>
 #include <chrono>
 #include <string.h>
+#include <string>
 #include "lcd.h"
 #include "util.h"
 
@@ -17,7 +18,13 @@
 #define LCD_COLS 20
 #define LCD_ROWS 4
 
-LCD lcd(LCD_D4, LCD_D5, LCD_D6, LCD_D7, LCD_RS, LCD_E, LCD_COLS, LCD_ROWS);
+// Choices of the start menu, in the order they are listed
+#define START_POLYPHONIC 0
+#define START_MONOPHONIC 1
+#define START_BACK 2
+#define START_CHOICES 3
+
+LCD<LcdPins<LCD_D4, LCD_D5, LCD_D6, LCD_D7, LCD_RS, LCD_E>> lcd(LCD_COLS, LCD_ROWS);
 
 class GUI
 {
@@ -50,6 +57,8 @@ public:
     // int contentSize = sizeof(contentList) / sizeof(contentList[0]);
     int current_selection = 0;
 
+    int start_selection = START_POLYPHONIC;
+
     bool controlMenu = true;
     bool sdMenu = false;
     bool midiStartMenu = false;
@@ -58,13 +67,14 @@ public:
     bool lcd_cleared = false;
 
     void init();
-    void printControls();
+    void printControls(bool);
     void setDuty(uint16_t);
     void setFreq(uint16_t);
     void sdCardMenu();
     void sdCardError();
     void sdCardMenuScroll();
     void midiStart();
+    void midiStartScroll();
     void showMidiGui(bool, int, const char *);
 };
 
@@ -75,18 +85,35 @@ void GUI::init()
     lcd.goto_pos(0, 0);
 }
 
-void GUI::printControls()
+// Burst mode puts burst length and rate on the same pots
+void GUI::printControls(bool burst)
 {
-    lcd.goto_pos(6, 0);
-    lcd.print("Frequency");
+    if (burst)
+    {
+        lcd.goto_pos(4, 0);
+        lcd.print("Burst Length");
+    }
+    else
+    {
+        lcd.goto_pos(6, 0);
+        lcd.print("Frequency");
+    }
 
     lcd.goto_pos(0, 1);
     lcd.print("[");
     lcd.goto_pos(19, 1);
     lcd.print("]");
 
-    lcd.goto_pos(5, 2);
-    lcd.print("Pulse Width");
+    if (burst)
+    {
+        lcd.goto_pos(5, 2);
+        lcd.print("Burst Rate");
+    }
+    else
+    {
+        lcd.goto_pos(5, 2);
+        lcd.print("Pulse Width");
+    }
 
     lcd.goto_pos(0, 3);
     lcd.print("[");
@@ -94,32 +121,21 @@ void GUI::printControls()
     lcd.print("]");
 }
 
+// Bars are drawn on every pass, the LCD only sends the cells that changed
 void GUI::setDuty(uint16_t rawDutyPot)
 {
-    int mappedPot = map(rawDutyPot, 0, 4095, 1, 19);
+    int mappedPot = map(rawDutyPot, 0, 4095, 1, 18);
 
-    int previousValue = mappedPot;
-    int currentValue;
-    if (previousValue != currentValue)
-    {
-        lcd.goto_pos(1, 1);
-        lcd.print(value[mappedPot]);
-    }
-    currentValue = previousValue;
+    lcd.goto_pos(1, 1);
+    lcd.print(value[mappedPot]);
 }
 
 void GUI::setFreq(uint16_t rawFreqPot)
 {
-    int mappedPot = map(rawFreqPot, 0, 4095, 1, 19);
+    int mappedPot = map(rawFreqPot, 0, 4095, 1, 18);
 
-    int previousValue = mappedPot;
-    int currentValue;
-    if (previousValue != currentValue)
-    {
-        lcd.goto_pos(1, 3);
-        lcd.print(value[mappedPot]);
-    }
-    currentValue = previousValue;
+    lcd.goto_pos(1, 3);
+    lcd.print(value[mappedPot]);
 }
 
 void GUI::sdCardError()
@@ -127,6 +143,7 @@ void GUI::sdCardError()
     lcd.clear();
     lcd.goto_pos(2, 1);
     lcd.print("No SD Card Found");
+    lcd.flush();
 
     sleep_ms(5000);
 }
@@ -168,18 +185,23 @@ void GUI::sdCardMenuScroll()
 
 void GUI::midiStart()
 {
+    const char *choices[START_CHOICES] = {"Play polyphonic", "Play monophonic", "Back"};
+
     lcd.clear();
     lcd.goto_pos(0, 0);
-
-    lcd.print("You want to play");
-    lcd.goto_pos(0, 1);
     lcd.print(contentList[current_selection]);
-    lcd.print("?");
 
-    lcd.goto_pos(0, 2);
-    lcd.print("SEL to continue or");
-    lcd.goto_pos(0, 3);
-    lcd.print("SCROLL to go back");
+    for (int i = 0; i < START_CHOICES; i++)
+    {
+        lcd.goto_pos(0, i + 1);
+        lcd.print(i == start_selection ? ">" : " ");
+        lcd.print(choices[i]);
+    }
+}
+
+void GUI::midiStartScroll()
+{
+    start_selection = (start_selection + 1) % START_CHOICES;
 }
 
 void GUI::showMidiGui(bool paused, int velocity, const char *note)
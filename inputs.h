@@ -4,6 +4,7 @@
 #include <pico/stdlib.h>
 #include <pico/time.h>
 #include <hardware/adc.h>
+#include <hardware/dma.h>
 #include "util.h"
 
 #define FREQ_PIN 27
@@ -11,43 +12,197 @@
 #define SEL_PIN 28
 #define SCROLL_PIN 29
 
-class Inputs
+// The ADC samples both pots round robin on its own and DMA writes the
+// samples into a ring, so reading a pot never waits for a conversion. A
+// timer averages the ring per pot, smooths that with an IIR filter and
+// only moves a pot's value once the filtered reading has left the
+// hysteresis band, so ADC noise no longer reaches the transmitter.
+#define POT_DUTY_INPUT 0 // ADC inputs of DUTY_PIN and FREQ_PIN
+#define POT_FREQ_INPUT 1
+#define POT_COUNT 2
+
+#define POT_SAMPLE_HZ 2000    // Both pots together
+#define POT_RING_SAMPLES 64   // Power of two, alternating duty and frequency
+#define POT_UPDATE_MS 10
+#define POT_IIR_SHIFT 2       // Filter weight of a new average, 1/4
+#define POT_HYSTERESIS 12     // ADC counts
+#define POT_MAX 4095
+
+// Even, so that a restarted ring keeps duty samples on even indices
+#define POT_DMA_COUNT 0xFFFFFFFEu
+
+typedef struct
 {
-private:
-    int selState = 0;
-    int scrollState = 0;
-    int lastSelState = 0;
-    int lastScrollState = 0;
+    uint32_t filtered;       // IIR state, 4 fractional bits
+    volatile uint16_t value; // What the pot reads as
+} PotFilter;
+
+uint16_t pot_samples[POT_RING_SAMPLES] __attribute__((aligned(POT_RING_SAMPLES * sizeof(uint16_t))));
+PotFilter pot_filters[POT_COUNT];
+volatile uint32_t pot_changes = 0; // Counts changes of any pot value
+int pot_dma = -1;
+repeating_timer_t pot_timer;
+
+void pot_filter_run(bool);
+bool pot_update(repeating_timer_t *);
+
+// Buttons are read from edge interrupts. Every edge pushes the end of the
+// debounce time out, the level is taken once the pin has been quiet for
+// BUTTON_DEBOUNCE_US. Presses and releases, long presses and the auto
+// repeat of a held button go into an event queue from the interrupts, so
+// nothing is lost while the UI loop is busy. Buttons are active low.
+#define BUTTON_DEBOUNCE_US 20000
+#define BUTTON_LONG_MS 600
+#define BUTTON_REPEAT_MS 120
+#define BUTTON_QUEUE_SIZE 16 // Power of two
+
+typedef enum
+{
+    BUTTON_SELECT,
+    BUTTON_SCROLL,
+    BUTTON_COUNT
+} ButtonId;
+
+typedef enum
+{
+    BUTTON_PRESS,
+    BUTTON_RELEASE,
+    BUTTON_LONG,  // Held for BUTTON_LONG_MS
+    BUTTON_REPEAT // Every BUTTON_REPEAT_MS after that, repeating buttons only
+} ButtonEventType;
+
+typedef struct
+{
+    uint8_t button;
+    uint8_t type;
+} ButtonEvent;
+
+typedef struct
+{
+    uint8_t pin;
+    bool repeat;
+    volatile uint64_t last_edge; // us
+    bool settling;               // Debounce alarm pending
+    bool pressed;                // Debounced level
+    bool held;                   // Long press reported
+    alarm_id_t hold_alarm;
+} Button;
+
+// Scroll repeats so long song lists can be run through by holding it
+Button buttons[BUTTON_COUNT] = {{SEL_PIN, false, 0, false, false, false, 0}, {SCROLL_PIN, true, 0, false, false, false, 0}};
 
-    int selReading = 0;
-    int scrollReading = 0;
+// Written by the interrupts on core0, read by the UI loop
+ButtonEvent button_events[BUTTON_QUEUE_SIZE];
+volatile uint32_t button_head = 0;
+volatile uint32_t button_tail = 0;
 
-    unsigned long last_sel_debounce_time = 0;
-    unsigned long last_scroll_debounce_time = 0;
-    unsigned long debounce_delay = 50;
+void button_push(uint8_t, uint8_t);
+bool button_pop(ButtonEvent *);
+void button_gpio_irq(uint, uint32_t);
+int64_t button_settle(alarm_id_t, void *);
+int64_t button_hold(alarm_id_t, void *);
 
-    uint32_t getTimeMs(void);
+class Inputs
+{
+private:
+    // Taken from the event queue and not asked for yet. Every scroll press
+    // is a scroll step as well, so scroll_presses <= scroll_steps.
+    uint16_t selects = 0;
+    uint16_t scroll_presses = 0;
+    uint16_t scroll_steps = 0;
 
 public:
     void init_pots();
     void init_buttons();
+    uint32_t pots_seen = 0;
+
     uint16_t read_dutycycle();
     uint16_t read_frequency();
+    bool pots_changed();
     bool select();
-    bool scroll();
+    bool scroll_pressed();
+    bool scroll_step();
     void updateButtons();
 };
 
-uint32_t Inputs::getTimeMs(void)
-{
-    return to_ms_since_boot(get_absolute_time());
-}
-
 void Inputs::init_pots()
 {
     adc_init();
     adc_gpio_init(FREQ_PIN);
     adc_gpio_init(DUTY_PIN);
+
+    // Free running, alternating between the pots, every sample into the
+    // FIFO with a DMA request
+    adc_select_input(POT_DUTY_INPUT);
+    adc_set_round_robin((1u << POT_DUTY_INPUT) | (1u << POT_FREQ_INPUT));
+    adc_fifo_setup(true, true, 1, false, false);
+    adc_set_clkdiv(48000000.0f / POT_SAMPLE_HZ - 1);
+
+    pot_dma = dma_claim_unused_channel(true);
+    dma_channel_config config = dma_channel_get_default_config(pot_dma);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_16);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, true);
+    channel_config_set_ring(&config, true, __builtin_ctz(sizeof(pot_samples)));
+    channel_config_set_dreq(&config, DREQ_ADC);
+    dma_channel_configure(pot_dma, &config, pot_samples, &adc_hw->fifo, POT_DMA_COUNT, true);
+
+    adc_run(true);
+
+    // Filters start from a full ring instead of creeping up from 0
+    sleep_ms(POT_RING_SAMPLES * 1000 / POT_SAMPLE_HZ + 1);
+    pot_filter_run(true);
+
+    add_repeating_timer_ms(-POT_UPDATE_MS, pot_update, NULL, &pot_timer);
+}
+
+// Averages the ring per pot and runs it through the filters. Called from
+// the timer on core0 only.
+void pot_filter_run(bool prime)
+{
+    uint32_t sums[POT_COUNT] = {0, 0};
+
+    for (int i = 0; i < POT_RING_SAMPLES; i++)
+        sums[i & 1] += pot_samples[i] & 0x0FFF;
+
+    for (int i = 0; i < POT_COUNT; i++)
+    {
+        PotFilter *pot = &pot_filters[i];
+        uint32_t average = (sums[i] << 4) / (POT_RING_SAMPLES / POT_COUNT);
+
+        if (prime)
+            pot->filtered = average;
+        else
+            pot->filtered = pot->filtered + ((int32_t)(average - pot->filtered) >> POT_IIR_SHIFT);
+
+        // Outside the band the value follows, the ends are always reachable
+        int32_t reading = pot->filtered >> 4;
+        uint16_t value = pot->value;
+
+        if (reading <= POT_HYSTERESIS)
+            value = 0;
+        else if (reading >= POT_MAX - POT_HYSTERESIS)
+            value = POT_MAX;
+        else if (prime || reading > value + POT_HYSTERESIS || reading + POT_HYSTERESIS < value)
+            value = reading;
+
+        if (value != pot->value)
+        {
+            pot->value = value;
+            pot_changes = pot_changes + 1;
+        }
+    }
+}
+
+bool pot_update(repeating_timer_t *)
+{
+    // Sampling runs for weeks on one transfer count, start it again should
+    // it ever run out
+    if (!dma_channel_is_busy(pot_dma))
+        dma_channel_set_trans_count(pot_dma, POT_DMA_COUNT, true);
+
+    pot_filter_run(false);
+    return true;
 }
 
 void Inputs::init_buttons()
@@ -56,68 +211,187 @@ void Inputs::init_buttons()
     gpio_init(SCROLL_PIN);
     gpio_set_dir(SEL_PIN, GPIO_IN);
     gpio_set_dir(SCROLL_PIN, GPIO_IN);
-}
 
-uint16_t Inputs::read_dutycycle()
-{
-    adc_select_input(0);
+    for (int i = 0; i < BUTTON_COUNT; i++)
+        buttons[i].pressed = !gpio_get(buttons[i].pin);
 
-    uint16_t output = adc_read();
-    return output;
+    // One callback for all GPIO interrupts of core0
+    gpio_set_irq_enabled_with_callback(SEL_PIN, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, true, button_gpio_irq);
+    gpio_set_irq_enabled(SCROLL_PIN, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, true);
 }
 
-uint16_t Inputs::read_frequency()
+void button_push(uint8_t button, uint8_t type)
 {
-    adc_select_input(1);
+    uint32_t head = button_head;
+
+    // A full queue drops the newest event, the UI is far behind anyway
+    if (head - button_tail >= BUTTON_QUEUE_SIZE)
+        return;
 
-    uint16_t output = adc_read();
-    return output;
+    button_events[head & (BUTTON_QUEUE_SIZE - 1)] = {button, type};
+    __dmb();
+    button_head = head + 1;
 }
 
-bool Inputs::select()
+bool button_pop(ButtonEvent *event)
 {
-    selReading = gpio_get(SEL_PIN);
+    uint32_t tail = button_tail;
+    if (tail == button_head)
+        return false;
 
-    if (selReading != lastSelState)
-        last_sel_debounce_time = getTimeMs();
+    __dmb();
+    *event = button_events[tail & (BUTTON_QUEUE_SIZE - 1)];
+    __dmb();
+    button_tail = tail + 1;
+    return true;
+}
 
-    if ((getTimeMs() - last_sel_debounce_time) > debounce_delay)
+// Any edge, bounce included, restarts the debounce time of its button
+void button_gpio_irq(uint gpio, uint32_t)
+{
+    for (int i = 0; i < BUTTON_COUNT; i++)
     {
-        if (selReading != selState)
-        {
-            selState = selReading;
+        Button *button = &buttons[i];
+        if (button->pin != gpio)
+            continue;
 
-            if (selState == 0)
-                return true;
-        }
+        button->last_edge = time_us_64();
+        if (!button->settling)
+            button->settling = add_alarm_in_us(BUTTON_DEBOUNCE_US, button_settle, button, true) > 0;
     }
-    return false;
 }
 
-bool Inputs::scroll()
+// Runs once the pin had time to settle, or goes back to sleep for the rest
+// of the debounce time if it bounced in the meantime
+int64_t button_settle(alarm_id_t, void *data)
 {
-    scrollReading = gpio_get(SCROLL_PIN);
+    Button *button = (Button *)data;
+    uint8_t index = button - buttons;
 
-    if (scrollReading != lastScrollState)
-        last_scroll_debounce_time = getTimeMs();
+    // The rest of the debounce time counts from now, not from when the
+    // alarm was due
+    uint64_t quiet = time_us_64() - button->last_edge;
+    if (quiet < BUTTON_DEBOUNCE_US)
+        return BUTTON_DEBOUNCE_US - quiet;
 
-    if ((getTimeMs() - last_scroll_debounce_time) > debounce_delay)
-    {
-        if (scrollReading != scrollState)
-        {
-            scrollState = scrollReading;
+    button->settling = false;
 
-            if (scrollState == 0)
-                return true;
-        }
+    bool pressed = !gpio_get(button->pin);
+    if (pressed == button->pressed)
+        return 0;
+
+    button->pressed = pressed;
+    button_push(index, pressed ? BUTTON_PRESS : BUTTON_RELEASE);
+
+    if (pressed)
+    {
+        button->held = false;
+        button->hold_alarm = add_alarm_in_ms(BUTTON_LONG_MS, button_hold, button, true);
+    }
+    else if (button->hold_alarm > 0)
+    {
+        cancel_alarm(button->hold_alarm);
+        button->hold_alarm = 0;
     }
-    return false;
+
+    return 0;
+}
+
+// Long press, then the auto repeat for as long as the button stays down
+int64_t button_hold(alarm_id_t, void *data)
+{
+    Button *button = (Button *)data;
+    uint8_t index = button - buttons;
+
+    button_push(index, button->held ? BUTTON_REPEAT : BUTTON_LONG);
+    button->held = true;
+
+    if (button->repeat)
+        return -(int64_t)BUTTON_REPEAT_MS * 1000;
+
+    button->hold_alarm = 0;
+    return 0;
 }
 
+uint16_t Inputs::read_dutycycle()
+{
+    return pot_filters[POT_DUTY_INPUT].value;
+}
+
+uint16_t Inputs::read_frequency()
+{
+    return pot_filters[POT_FREQ_INPUT].value;
+}
+
+// True once after either pot moved
+bool Inputs::pots_changed()
+{
+    uint32_t changes = pot_changes;
+    if (changes == pots_seen)
+        return false;
+
+    pots_seen = changes;
+    return true;
+}
+
+// Each call takes one press, so a press is handled once even though
+// several menus ask in the same pass
+bool Inputs::select()
+{
+    if (selects == 0)
+        return false;
+
+    selects--;
+    return true;
+}
+
+// Scroll presses only, for the menus where scroll is an action (burst
+// mode, back, stop) that must not repeat while the button is held. The
+// steps of a hold are dropped, they would otherwise move the next list as
+// soon as it opens.
+bool Inputs::scroll_pressed()
+{
+    scroll_steps = scroll_presses;
+    if (scroll_presses == 0)
+        return false;
+
+    scroll_presses--;
+    scroll_steps--;
+    return true;
+}
+
+// Presses and the auto repeat while scroll is held, for moving through
+// lists
+bool Inputs::scroll_step()
+{
+    if (scroll_steps == 0)
+        return false;
+
+    scroll_steps--;
+    if (scroll_presses > scroll_steps)
+        scroll_presses--;
+    return true;
+}
+
+// Takes what the interrupts queued since the last pass
 void Inputs::updateButtons()
 {
-    lastScrollState = scrollReading;
-    lastSelState = selReading;
+    ButtonEvent event;
+
+    while (button_pop(&event))
+    {
+        if (event.type == BUTTON_RELEASE)
+            continue;
+
+        if (event.button == BUTTON_SELECT && event.type == BUTTON_PRESS)
+            selects++;
+        else if (event.button == BUTTON_SCROLL)
+        {
+            scroll_steps++;
+            if (event.type == BUTTON_PRESS)
+                scroll_presses++;
+        }
+    }
 }
 
 #endif
\ No newline at end of file
@@ -3,13 +3,12 @@
 
 #include "pico/stdlib.h"
 #include "pico/time.h"
+#include <string.h>
+#include <array>
 
 #define BLINK true
 #define NO_BLINK false
 
-// Pin Positions in Array
-#define RS 4
-#define E 5
 // Pin Values
 #define HIGH 1
 #define LOW 0
@@ -17,24 +16,95 @@
 #define COMMAND 0
 #define DATA 1
 
+// HD44780 timing, the waits are the datasheet execution times
+#define LCD_ENABLE_US 1      // E high, and E low between the two nibbles
+#define LCD_COMMAND_US 37    // Commands and data writes
+#define LCD_CLEAR_US 1520    // Clear display and return home
+#define LCD_POWER_ON_US 40000
+#define LCD_RESET_US 4100    // After the first function set of the reset sequence
+#define LCD_RESET_2_US 100
+
+// Commands and data go into a queue and an alarm on core0 clocks them out,
+// rescheduling itself for every E edge and wait, so the CPU never waits on
+// the display. Each delay counts from the edge just made, an alarm running
+// late never shortens E high or a wait.
+#define LCD_QUEUE_SIZE 128 // Power of two
+
+#define LCD_ENTRY_DATA 0x01   // RS high
+#define LCD_ENTRY_NIBBLE 0x02 // Upper nibble only, for the reset sequence
+
+typedef struct
+{
+    uint8_t data;
+    uint8_t flags;
+    uint16_t wait_us; // After the entry
+} LcdEntry;
+
+// Writes go into a shadow of the screen, flush() sends the cells that differ
+// from what the display shows. Runs of changed cells share one address
+// command, and none is needed when the display's address counter already
+// points at the next changed cell.
+#define LCD_MAX_CELLS 80
+#define LCD_NO_ADDRESS -1
+
+// GPIO levels of the data lines and RS for every nibble, index
+// (rs << 4) | nibble
+constexpr std::array<uint32_t, 32> lcd_nibble_masks(uint d4, uint d5, uint d6, uint d7, uint rs)
+{
+    std::array<uint32_t, 32> table{};
+    for (uint i = 0; i < 32; i++)
+    {
+        table[i] = (i & 0x01 ? 1u << d4 : 0) | (i & 0x02 ? 1u << d5 : 0) | (i & 0x04 ? 1u << d6 : 0) |
+                   (i & 0x08 ? 1u << d7 : 0) | (i & 0x10 ? 1u << rs : 0);
+    }
+    return table;
+}
+
+// Pin assignment of the display, every nibble is one masked write of a
+// precomputed value
+template <uint D4, uint D5, uint D6, uint D7, uint RS_PIN, uint E_PIN>
+struct LcdPins
+{
+    static_assert(D4 < 30 && D5 < 30 && D6 < 30 && D7 < 30 && RS_PIN < 30 && E_PIN < 30, "LCD pins are GPIOs");
+
+    static constexpr uint enable = E_PIN;
+    static constexpr uint32_t bus = 1u << D4 | 1u << D5 | 1u << D6 | 1u << D7 | 1u << RS_PIN; // without clock
+    static constexpr uint32_t all = bus | 1u << E_PIN;                                      // with clock
+    static constexpr std::array<uint32_t, 32> nibbles = lcd_nibble_masks(D4, D5, D6, D7, RS_PIN);
+
+    static_assert(__builtin_popcount(all) == 6, "LCD pins must all differ");
+};
+
+template <typename Pins>
 class LCD
 {
 private:
-    int LCDPins[6];
-    uint32_t LCDmask_c = 0; // with clock
-    uint32_t LCDmask = 0;   // without clock
     int no_chars;
     int no_lines;
     int cursor_status[2] = {0, 0};
 
-    uint32_t pin_values_to_mask(uint raw_bits[], int length);
-    void uint_into_8bits(uint raw_bits[], uint one_byte);
-    void send_raw_data_one_cycle(uint raw_bits[]);
-    void send_full_byte(uint rs, uint databits[]);
-    void send_byte(uint rs, uint8_t data);
+    char shadow[LCD_MAX_CELLS]; // What the screen should show, row by row
+    char shown[LCD_MAX_CELLS];  // What the display shows once the queue is out
+    int cells;
+    int cursor = 0;                // Next cell written
+    int address = LCD_NO_ADDRESS; // Display's address counter
+
+    // Written by the UI loop, read by the alarm, both on core0
+    LcdEntry queue[LCD_QUEUE_SIZE];
+    volatile uint32_t head = 0;
+    volatile uint32_t tail = 0;
+    volatile bool running = false;
+    uint8_t step = 0; // E edge of the entry at the tail
+
+    int cell_address(int cell);
+
+    bool push(uint8_t data, uint8_t flags, uint16_t wait_us);
+    void command(uint8_t data, uint16_t wait_us = LCD_COMMAND_US);
+    void start(uint32_t delay_us);
+    static int64_t transport(alarm_id_t id, void *data);
 
 public:
-    LCD(int bit4_pin, int bit5_pin, int bit6_pin, int bit7_pin, int rs_pin, int e_pin, int width, int height);
+    LCD(int width, int height);
 
     void clear();
     void cursor_off();
@@ -47,247 +117,255 @@ public:
     void display_on();
     void display_off();
     void write(uint8_t data);
+    void flush();
+    bool busy();
 };
 
-void LCD::send_byte(uint rs, uint8_t data)
+// Room is only taken from the UI loop and only given back by the alarm, so
+// a free slot stays free until it is written
+template <typename Pins>
+bool LCD<Pins>::push(uint8_t data, uint8_t flags, uint16_t wait_us)
 {
-    // send upper nibble
-    uint rawbits[5];
-    rawbits[4] = rs;
+    uint32_t next = head;
+    if (next - tail >= LCD_QUEUE_SIZE)
+        return false;
 
-    for (int i = 0; i < 4; i++)
-    {
-        rawbits[i] = (data >> (7 - i)) & 0x01;
-    }
+    queue[next & (LCD_QUEUE_SIZE - 1)] = {data, flags, wait_us};
+    __dmb();
+    head = next + 1;
 
-    send_raw_data_one_cycle(rawbits);
+    if (!running)
+        start(0);
+    return true;
+}
 
-    // Send Lower nibble
-    for (int i = 0; i < 4; i++)
-    {
-        rawbits[i] = (data >> (3 - i)) & 0x01;
-    }
+// Commands are rare, they wait for room rather than get lost
+template <typename Pins>
+void LCD<Pins>::command(uint8_t data, uint16_t wait_us)
+{
+    while (!push(data, 0, wait_us))
+        tight_loop_contents();
+}
 
-    send_raw_data_one_cycle(rawbits);
+template <typename Pins>
+void LCD<Pins>::start(uint32_t delay_us)
+{
+    running = true;
+    step = 0;
+    if (add_alarm_in_us(delay_us, transport, this, true) < 0)
+        running = false;
 }
 
-uint32_t LCD::pin_values_to_mask(uint raw_bits[], int length)
+// One call per E edge: upper nibble up and down, lower nibble up and down,
+// then the wait of the entry before the next one starts
+template <typename Pins>
+int64_t LCD<Pins>::transport(alarm_id_t, void *data)
 {
-    uint32_t result = 0;
-    uint pinArray[32];
-    for (int i = 0; i < 32; i++)
-    {
-        pinArray[i] = 0;
-    }
-    for (int i = 0; i < length; i++)
+    LCD *lcd = (LCD *)data;
+
+    if (lcd->tail == lcd->head)
     {
-        pinArray[this->LCDPins[i]] = raw_bits[i];
+        lcd->running = false;
+        return 0;
     }
-    for (int i = 0; i < 32; i++)
+
+    __dmb();
+    const LcdEntry *entry = &lcd->queue[lcd->tail & (LCD_QUEUE_SIZE - 1)];
+    uint rs = entry->flags & LCD_ENTRY_DATA ? DATA : COMMAND;
+
+    switch (lcd->step++)
     {
-        result = result << 1;
-        result += pinArray[31 - i];
+    case 0:
+        gpio_put_masked(Pins::bus, Pins::nibbles[rs << 4 | entry->data >> 4]);
+        gpio_put(Pins::enable, HIGH);
+        return LCD_ENABLE_US;
+    case 1:
+        gpio_put(Pins::enable, LOW);
+        if (!(entry->flags & LCD_ENTRY_NIBBLE))
+            return LCD_ENABLE_US;
+        break;
+    case 2:
+        gpio_put_masked(Pins::bus, Pins::nibbles[rs << 4 | (entry->data & 0x0F)]);
+        gpio_put(Pins::enable, HIGH);
+        return LCD_ENABLE_US;
+    default:
+        gpio_put(Pins::enable, LOW);
+        break;
     }
-    return result;
+
+    int64_t wait = entry->wait_us;
+    lcd->step = 0;
+    __dmb();
+    lcd->tail = lcd->tail + 1;
+    return wait;
 }
 
-void LCD::uint_into_8bits(uint raw_bits[], uint one_byte)
+// Entries still going out, or the wait of the last one not over
+template <typename Pins>
+bool LCD<Pins>::busy()
 {
-    for (int i = 0; i < 8; i++)
-    {
-        raw_bits[7 - i] = one_byte % 2;
-        one_byte = one_byte >> 1;
-    }
+    return running;
 }
 
-void LCD::send_raw_data_one_cycle(uint raw_bits[])
+template <typename Pins>
+LCD<Pins>::LCD(int width, int height)
 {
-    uint32_t bit_value = pin_values_to_mask(raw_bits, 5);
-    gpio_put_masked(this->LCDmask, bit_value);
-    gpio_put(this->LCDPins[E], HIGH);
-    sleep_us(100);
-    gpio_put(this->LCDPins[E], LOW);
-    sleep_us(100);
+    this->no_chars = width;
+    this->no_lines = height;
+    this->cells = width * height < LCD_MAX_CELLS ? width * height : LCD_MAX_CELLS;
 }
 
-void LCD::send_full_byte(uint rs, uint databits[])
+// DDRAM address of a cell of the shadow
+template <typename Pins>
+int LCD<Pins>::cell_address(int cell)
 {
-    // send upper nibble (MSN)
-    uint rawbits[5];
-    rawbits[4] = rs;
-    for (int i = 0; i < 4; i++)
-    {
-        rawbits[i] = databits[i];
-    }
-    send_raw_data_one_cycle(rawbits);
-    // send lower nibble (LSN)
-    for (int i = 0; i < 4; i++)
+    int pos = cell % no_chars;
+    int line = cell / no_chars;
+
+    switch (no_lines)
     {
-        rawbits[i] = databits[i + 4];
+    case 2:
+        return 64 * line + pos;
+    case 4:
+        return (line & 1) * 64 + (line >> 1) * no_chars + pos;
+    default:
+        return pos;
     }
-    send_raw_data_one_cycle(rawbits);
 }
 
-LCD::LCD(int bit4_pin, int bit5_pin, int bit6_pin, int bit7_pin, int rs_pin, int e_pin, int width, int height)
+// Blanks the shadow only, the next flush sends just the cells that were
+// not blank and are not written again in the meantime
+template <typename Pins>
+void LCD<Pins>::clear()
 {
-    this->LCDPins[0] = bit7_pin;
-    this->LCDPins[1] = bit6_pin;
-    this->LCDPins[2] = bit5_pin;
-    this->LCDPins[3] = bit4_pin;
-    this->LCDPins[4] = rs_pin;
-    this->LCDPins[5] = e_pin;
-    this->no_chars = width;
-    this->no_lines = height;
+    memset(shadow, ' ', cells);
+    cursor = 0;
 }
 
-void LCD::clear()
+// Queues the changed cells. With the queue full the rest is left for the
+// next flush, shown only takes what was queued.
+template <typename Pins>
+void LCD<Pins>::flush()
 {
-    uint clear_display[8] = {0, 0, 0, 0, 0, 0, 0, 1};
-    send_full_byte(COMMAND, clear_display);
-    sleep_ms(10);
+    for (int i = 0; i < cells; i++)
+    {
+        if (shadow[i] == shown[i])
+            continue;
+
+        int cell_addr = cell_address(i);
+        if (cell_addr != address)
+        {
+            if (!push(cell_addr | 0b10000000, 0, LCD_COMMAND_US))
+                return;
+            address = cell_addr;
+        }
+
+        if (!push((uint8_t)shadow[i], LCD_ENTRY_DATA, LCD_COMMAND_US))
+            return;
+        shown[i] = shadow[i];
+        address = cell_addr + 1;
+    }
 }
 
-void LCD::cursor_off()
+template <typename Pins>
+void LCD<Pins>::cursor_off()
 {
-    uint no_cursor[8] = {0, 0, 0, 0, 1, 1, 0};
-    send_full_byte(COMMAND, no_cursor);
+    command(0b00001100);
     this->cursor_status[0] = 0;
     this->cursor_status[1] = 0;
 }
 
-void LCD::cursor_on()
+template <typename Pins>
+void LCD<Pins>::cursor_on()
 {
-    uint command_cursor[8] = {0, 0, 0, 0, 1, 1, 1, 1};
-    send_full_byte(COMMAND, command_cursor);
+    command(0b00001111);
     this->cursor_status[0] = 1;
     this->cursor_status[1] = 1;
 }
 
-void LCD::cursor_on(bool blink)
+template <typename Pins>
+void LCD<Pins>::cursor_on(bool blink)
 {
-    uint command_cursor[8] = {0, 0, 0, 0, 1, 1, 1, 0};
-    if (blink)
-        command_cursor[7] = 1;
-    send_full_byte(COMMAND, command_cursor);
+    command(0b00001110 | blink);
     this->cursor_status[0] = 1;
-    this->cursor_status[1] = command_cursor[7];
+    this->cursor_status[1] = blink;
 }
 
-void LCD::display_off()
+template <typename Pins>
+void LCD<Pins>::display_off()
 {
-    uint command_display[8] = {0, 0, 0, 0, 1, 0, 0, 0};
-    command_display[7] = this->cursor_status[1];
-    command_display[6] = this->cursor_status[0];
-    send_full_byte(COMMAND, command_display);
+    command(0b00001000 | this->cursor_status[0] << 1 | this->cursor_status[1]);
 }
 
-void LCD::display_on()
+template <typename Pins>
+void LCD<Pins>::display_on()
 {
-    uint command_display[8] = {0, 0, 0, 0, 1, 1, 0, 0};
-    command_display[7] = this->cursor_status[1];
-    command_display[6] = this->cursor_status[0];
-    send_full_byte(COMMAND, command_display);
+    command(0b00001100 | this->cursor_status[0] << 1 | this->cursor_status[1]);
 }
 
-void LCD::init()
+template <typename Pins>
+void LCD<Pins>::init()
 {
-    uint all_ones[6] = {1, 1, 1, 1, 1, 1};
-    uint set_function_8[5] = {0, 0, 1, 1, 0};
-    uint set_function_4a[5] = {0, 0, 1, 0, 0};
+    uint8_t set_function_4 = 0b00100000;
 
-    uint set_function_4[8] = {0, 0, 1, 0, 0, 0, 0, 0};
-    uint cursor_set[8] = {0, 0, 0, 0, 0, 1, 1, 0};
-    uint display_prop_set[8] = {0, 0, 0, 0, 1, 1, 0, 0};
+    gpio_init_mask(Pins::all);          // init all LCD Pins
+    gpio_set_dir_out_masked(Pins::all); // Set all pins as output
+    gpio_clr_mask(Pins::all);           // Set all pins as LOW
 
-    // set mask, initialize masked pins and set to LOW
-    this->LCDmask_c = pin_values_to_mask(all_ones, 6);
-    this->LCDmask = pin_values_to_mask(all_ones, 5);
-    gpio_init_mask(this->LCDmask_c);          // init all LCD Pins
-    gpio_set_dir_out_masked(this->LCDmask_c); // Set all pins as output
-    gpio_clr_mask(this->LCDmask_c);           // Set all pins as LOW
+    // Nothing goes out before the display is powered up, the queue fills
+    // in the meantime
+    start(LCD_POWER_ON_US);
 
     // Set LCD to 4-bit mode and 1 or 2 lines
     if (no_lines == 2 || no_lines == 4)
-        set_function_4[4] = 1;
-    send_raw_data_one_cycle(set_function_8);
-    send_raw_data_one_cycle(set_function_8);
-    send_raw_data_one_cycle(set_function_8);
-    send_raw_data_one_cycle(set_function_4a);
+        set_function_4 |= 0b00001000;
+    push(0b00110000, LCD_ENTRY_NIBBLE, LCD_RESET_US);
+    push(0b00110000, LCD_ENTRY_NIBBLE, LCD_RESET_2_US);
+    push(0b00110000, LCD_ENTRY_NIBBLE, LCD_COMMAND_US);
+    push(0b00100000, LCD_ENTRY_NIBBLE, LCD_COMMAND_US);
 
     // ready up
-    send_full_byte(COMMAND, set_function_4);
-    send_full_byte(COMMAND, cursor_set);
-    send_full_byte(COMMAND, display_prop_set);
+    push(set_function_4, 0, LCD_COMMAND_US);
+    push(0b00000110, 0, LCD_COMMAND_US); // Entry mode, increment
+    push(0b00001100, 0, LCD_COMMAND_US); // Display on, no cursor
+
+    // The only real clear, from here on the display is known to be blank
+    push(0b00000001, 0, LCD_CLEAR_US);
+    memset(shown, ' ', cells);
+    address = 0;
     clear();
 
     this->cursor_status[0] = 0;
     this->cursor_status[1] = 0;
 }
 
-void LCD::goto_pos(int pos_i, int line)
+template <typename Pins>
+void LCD<Pins>::goto_pos(int pos, int line)
 {
-    uint eight_bits[8];
-    uint pos = (uint)pos_i;
-    switch (no_lines)
-    {
-    case 2:
-        pos = 64 * line + pos + 0b10000000;
-        break;
-    case 4:
-        if (line == 0)
-        {
-            pos = pos + 0b10000000;
-        }
-        else if (line == 1)
-        {
-            pos = 64 + pos + 0b10000000;
-        }
-        else if (line == 2)
-        {
-            pos = 20 + pos + 0b10000000;
-        }
-        else if (line == 3)
-        {
-            pos = 84 + pos + 0b10000000;
-        }
-        break;
-    default:
-        pos = pos;
-    }
-    uint_into_8bits(eight_bits, pos);
-    send_full_byte(COMMAND, eight_bits);
+    cursor = line * no_chars + pos;
 }
 
-void LCD::print(const char *str)
+// Text runs on into the next line, anything past the last cell is dropped
+template <typename Pins>
+void LCD<Pins>::print(const char *str)
 {
-    uint eight_bits[8];
-    int i = 0;
-    while (str[i] != 0)
-    {
-        uint_into_8bits(eight_bits, (uint)(str[i]));
-        send_full_byte(DATA, eight_bits);
-        ++i;
-    }
+    while (*str != 0)
+        write((uint8_t)*str++);
 }
 
-void LCD::print_wrapped(const char *str)
+template <typename Pins>
+void LCD<Pins>::print_wrapped(const char *str)
 {
-    uint eight_bits[8];
-    int i = 0;
     goto_pos(0, 0);
-    while (str[i] != 0)
-    {
-        uint_into_8bits(eight_bits, (uint)(str[i]));
-        send_full_byte(DATA, eight_bits);
-        ++i;
-        if (i % no_chars == 0)
-            goto_pos(0, i / no_chars);
-    }
+    print(str);
 }
 
-void LCD::write(uint8_t data)
+template <typename Pins>
+void LCD<Pins>::write(uint8_t data)
 {
-    send_byte(DATA, data);
+    if (cursor >= 0 && cursor < cells)
+        shadow[cursor] = (char)data;
+    cursor++;
 }
 
 #endif
\ No newline at end of file
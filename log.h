@@ -0,0 +1,138 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <pico/stdlib.h>
+#include <hardware/sync.h>
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_TRACE 4
+
+// Messages above this level are compiled out, per-event trace is only built
+// into debug builds (see CMakeLists.txt)
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Entries per core, must be a power of two
+#define LOG_RING_SIZE 64
+#define LOG_MAX_ARGS 4
+
+// Logging only stores the format string pointer and up to four 32-bit
+// arguments into a ring owned by the calling core, formatting happens later
+// in log_drain() on core0. Each ring has one producer (its core) and one
+// consumer (the drain), so no locks are needed. Strings passed for %s must
+// still be alive when the drain runs, so only log static or long lived ones.
+typedef struct
+{
+    const char *format;
+    uint8_t level;
+    uint32_t args[LOG_MAX_ARGS];
+} LogEntry;
+
+typedef struct
+{
+    LogEntry entries[LOG_RING_SIZE];
+    volatile uint32_t head; // Written by the producing core only
+    volatile uint32_t tail; // Written by the drain only
+    volatile uint32_t dropped;
+} LogRing;
+
+LogRing log_rings[2];
+
+template <typename T>
+static inline uint32_t log_arg(T value) { return (uint32_t)value; }
+template <typename T>
+static inline uint32_t log_arg(T *value) { return (uint32_t)(uintptr_t)value; }
+
+template <typename... Args>
+void log_write(uint8_t level, const char *format, Args... args)
+{
+    static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "Too many log arguments");
+
+    LogRing *ring = &log_rings[get_core_num()];
+    uint32_t head = ring->head;
+
+    if (head - ring->tail >= LOG_RING_SIZE)
+    {
+        ring->dropped++;
+        return;
+    }
+
+    LogEntry *entry = &ring->entries[head & (LOG_RING_SIZE - 1)];
+    uint32_t values[LOG_MAX_ARGS + 1] = {log_arg(args)...};
+
+    entry->format = format;
+    entry->level = level;
+    for (int i = 0; i < LOG_MAX_ARGS; i++)
+        entry->args[i] = values[i];
+
+    // Entry has to be complete before the drain can see it
+    __dmb();
+    ring->head = head + 1;
+}
+
+// Formats and prints at most max_entries pending messages. Called from the
+// core0 main loop, so the USB stdio cost never lands on the playback core.
+void log_drain(uint32_t max_entries)
+{
+    for (int core = 0; core < 2; core++)
+    {
+        LogRing *ring = &log_rings[core];
+
+        if (ring->dropped > 0)
+        {
+            printf("WARNING: %" PRIu32 " log messages dropped on core%d\n", ring->dropped, core);
+            ring->dropped = 0;
+        }
+
+        while (max_entries > 0 && ring->tail != ring->head)
+        {
+            __dmb();
+            LogEntry *entry = &ring->entries[ring->tail & (LOG_RING_SIZE - 1)];
+
+            if (entry->level == LOG_LEVEL_ERROR)
+                printf("ERROR: ");
+            else if (entry->level == LOG_LEVEL_WARN)
+                printf("WARNING: ");
+
+            // Arguments are word sized on the RP2040 so they can be passed
+            // through as they were stored
+            printf(entry->format, entry->args[0], entry->args[1], entry->args[2], entry->args[3]);
+
+            __dmb();
+            ring->tail = ring->tail + 1;
+            max_entries--;
+        }
+    }
+}
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) log_write(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) ((void)0)
+#endif
+
+#endif
@@ -14,6 +14,8 @@
 #include "inputs.h"
 #include "util.h"
 #include "transmitter.h"
+#include "burst.h"
+#include "log.h"
 
 Inputs inputs;
 GUI gui;
@@ -22,6 +24,7 @@ Player player;
 void core1_main()
 {
     // player.init_transmitter();
+    bool idle = false;
 
     while (1)
     {
@@ -30,48 +33,7 @@ void core1_main()
             // reset transmitter
             reset_transmitter();
 
-            // Read the Midi Header
-            MidiHeader header;
-            player.read_midi_header(gui.contentList[gui.current_selection], &header);
-
-            // Try to find a track with notes (skip metadata-only tracks)
-            MidiTrack track;
-            bool track_found = false;
-            
-            for (uint32_t track_num = 0; track_num < header.tracks && !track_found; track_num++)
-            {
-                player.read_midi_track(gui.contentList[gui.current_selection], &track, track_num);
-                
-                // Check if track has actual note events by scanning for NOTE_ON (0x90) or NOTE_OFF (0x80)
-                bool has_notes = false;
-                for (uint32_t i = 0; i < track.length - 1; i++)
-                {
-                    uint8_t byte = track.data[i];
-                    if ((byte & 0xF0) == 0x90 || (byte & 0xF0) == 0x80)
-                    {
-                        has_notes = true;
-                        break;
-                    }
-                }
-                
-                if (has_notes)
-                {
-                    printf("Found notes in track %lu\n", track_num);
-                    track_found = true;
-                    player.parse_midi_track(&track);
-                    player.cleanupTrackData(&track);
-                }
-                else
-                {
-                    printf("Track %lu has no notes, skipping\n", track_num);
-                    player.cleanupTrackData(&track);
-                }
-            }
-
-            if (!track_found)
-            {
-                printf("ERROR: No track with notes found\n");
-            }
+            player.play_midi_file(gui.contentList[gui.current_selection]);
 
             reset_transmitter();
             player.resetPlayback();
@@ -80,9 +42,16 @@ void core1_main()
         }
         if (player.play == false && gui.controlMenu == false)
         {
-            transmitt_off();
+            // One off command when going idle is enough, the queue applies it
+            if (!idle)
+                transmitt_off();
+            idle = true;
             sleep_ms(1);
         }
+        else
+        {
+            idle = false;
+        }
     }
 }
 
@@ -97,10 +66,15 @@ int main(int argc, char **argv)
     inputs.init_pots();
 
     transmitter_init();
+    synth_init();
+    burst_init();
+    modulation_init();
 
     multicore_launch_core1(core1_main);
 
     bool displayMenu = true;
+    bool displayControls = true;
+    bool burstMode = false;
     uint16_t pot_frequency, pot_duty_cycle;
     while (true)
     {
@@ -109,19 +83,45 @@ int main(int argc, char **argv)
             pot_frequency = inputs.read_frequency();
             pot_duty_cycle = inputs.read_dutycycle();
 
-            set_transmitter(pot_frequency, pot_duty_cycle);
+            // Scroll toggles burst mode, frequency and pulse width stay
+            // where the pots were and the pots set the bursts
+            if (inputs.scroll_pressed() == true)
+            {
+                burstMode = !burstMode;
+                if (burstMode)
+                    burst_start(pot_frequency_index(pot_duty_cycle), pot_width(pot_frequency), pot_duty_cycle, pot_frequency);
+                else
+                    burst_stop();
+
+                lcd.clear();
+                displayControls = true;
+            }
 
-            gui.printControls();
-            gui.setDuty(pot_duty_cycle);
-            gui.setFreq(pot_frequency);
+            if (burstMode)
+                burst_set(pot_duty_cycle, pot_frequency);
+            else
+                set_transmitter(pot_frequency, pot_duty_cycle);
+
+            // Pot values only change on real movement, the screen is only
+            // redrawn then
+            if (inputs.pots_changed() || displayControls)
+            {
+                gui.printControls(burstMode);
+                gui.setDuty(pot_duty_cycle);
+                gui.setFreq(pot_frequency);
+                displayControls = false;
+            }
 
             if (inputs.select() == true)
             {
                 // player.transmitt_off();
+                burst_stop();
+                burstMode = false;
 
                 if (player.mountFileSystem() == false || player.openCard() == false)
                 {
                     gui.sdCardError();
+                    displayControls = true;
                 }
                 else
                 {
@@ -139,7 +139,7 @@ int main(int argc, char **argv)
                 gui.sdCardMenu();
                 displayMenu = false;
             }
-            if (inputs.scroll() == true)
+            if (inputs.scroll_step() == true)
             {
                 gui.sdCardMenuScroll();
                 displayMenu = true;
@@ -151,6 +151,7 @@ int main(int argc, char **argv)
                     gui.sdMenu = false;
                     gui.controlMenu = true;
                     displayMenu = true;
+                    displayControls = true;
 
                     lcd.clear();
                 }
@@ -164,29 +165,40 @@ int main(int argc, char **argv)
         }
         if (gui.midiStartMenu == true)
         {
+            if (inputs.scroll_step() == true)
+            {
+                gui.midiStartScroll();
+                gui.midiStart();
+            }
             if (inputs.select() == true)
             {
-                gui.midiGui = true;
-                gui.midiStartMenu = false;
-                player.paused = false;
-
-                if (player.play)
+                if (gui.start_selection == START_BACK)
                 {
-                    player.play = false;
-                    transmitt_off();
-                    sleep_ms(10);
+                    gui.midiStartMenu = false;
+                    gui.sdMenu = true;
+                    displayMenu = true;
+
+                    lcd.clear();
                 }
-                player.play = true;
+                else
+                {
+                    gui.midiGui = true;
+                    gui.midiStartMenu = false;
+                    player.paused = false;
 
-                lcd.clear();
-            }
-            if (inputs.scroll() == true)
-            {
-                gui.midiStartMenu = false;
-                gui.sdMenu = true;
-                displayMenu = true;
+                    if (player.play)
+                    {
+                        player.play = false;
+                        transmitt_off();
+                        sleep_ms(10);
+                    }
+                    // Only changed while nothing plays, the player picks
+                    // its path when the song starts
+                    player.polyphonic = gui.start_selection == START_POLYPHONIC;
+                    player.play = true;
 
-                lcd.clear();
+                    lcd.clear();
+                }
             }
         }
         if (gui.midiGui == true)
@@ -196,7 +208,7 @@ int main(int argc, char **argv)
             {
                 player.pause();
             }
-            if (inputs.scroll() == true)
+            if (inputs.scroll_pressed() == true)
             {
                 player.play = false;
                 transmitt_off();
@@ -222,7 +234,14 @@ int main(int argc, char **argv)
             }
         }
 
+        // Whatever the menus drew this pass goes out to the display
+        lcd.flush();
+
         inputs.updateButtons();
+
+        // Print what the player logged, a few messages per pass so the UI
+        // stays responsive
+        log_drain(8);
     }
     free(gui.contentList);
 
@@ -0,0 +1,359 @@
+#ifndef MIDI_MERGER_H
+#define MIDI_MERGER_H
+
+#include <stdio.h>
+#include <pico/stdlib.h>
+#include "ff.h"
+#include "log.h"
+#include "track_stream.h"
+
+// Most tracks that can be merged at once, each one costs a TrackStream
+#define MAX_MIDI_TRACKS 16
+
+#define MIDI_NOTE_ON 0x90
+#define MIDI_NOTE_OFF 0x80
+#define MIDI_SYSEX 0xF0
+#define MIDI_SYSEX_ESCAPE 0xF7
+#define MIDI_META_EVENT 0xFF
+
+#define MIDI_META_END_OF_TRACK 0x2F
+#define MIDI_META_TEMPO 0x51
+
+typedef struct
+{
+    uint32_t tick;      // Absolute position in ticks from the start of the song
+    uint8_t track;      // Track the event came from
+    uint8_t status;     // Channel status byte or MIDI_META_EVENT
+    uint8_t data[2];    // Note and velocity, or meta type in data[0]
+    uint8_t meta[3];    // First bytes of meta event data (tempo)
+    uint8_t meta_length;
+} MidiEvent;
+
+typedef struct
+{
+    TrackStream stream;
+    uint32_t tick;
+    uint8_t running_status;
+    MidiEvent event; // Next event of this track, already decoded
+} TrackCursor;
+
+uint32_t midi_event_tempo(const MidiEvent *event)
+{
+    return (event->meta[0] << 16) | (event->meta[1] << 8) | event->meta[2];
+}
+
+// Combines the tracks of a format 1 file into one stream of events ordered by
+// absolute tick. Every track has a cursor holding its next decoded event and
+// the cursors are kept in a min-heap on that tick, so handing out an event is
+// O(log tracks). Events with the same tick keep the order of their tracks.
+class MidiMerger
+{
+private:
+    TrackCursor cursors[MAX_MIDI_TRACKS];
+    uint8_t heap[MAX_MIDI_TRACKS];
+    uint8_t heap_size = 0;
+    uint8_t track_count = 0;
+    bool error = false;
+
+    bool read_vlq(TrackStream *, uint32_t *);
+    bool read_event(TrackCursor *);
+    bool before(uint8_t, uint8_t);
+    void sift_up(uint8_t);
+    void sift_down(uint8_t);
+
+public:
+    void begin();
+    bool add_track(FIL *, uint32_t, uint32_t);
+    bool next(MidiEvent *);
+    bool refill();
+    void close();
+    bool failed();
+};
+
+void MidiMerger::begin()
+{
+    heap_size = 0;
+    track_count = 0;
+    error = false;
+}
+
+bool MidiMerger::add_track(FIL *fil, uint32_t offset, uint32_t length)
+{
+    if (track_count >= MAX_MIDI_TRACKS)
+    {
+        LOG_WARN("Only %u tracks can be merged, skipping the rest\n", MAX_MIDI_TRACKS);
+        return false;
+    }
+
+    uint8_t index = track_count;
+    TrackCursor *cursor = &cursors[index];
+    cursor->tick = 0;
+    cursor->running_status = 0;
+
+    if (!cursor->stream.open(fil, offset, length))
+        return false;
+
+    track_count++;
+
+    // Tracks that have no events at all never enter the heap
+    if (!read_event(cursor))
+        return true;
+
+    cursor->event.track = index;
+    heap[heap_size] = index;
+    sift_up(heap_size);
+    heap_size++;
+
+    return true;
+}
+
+bool MidiMerger::next(MidiEvent *event)
+{
+    if (heap_size == 0)
+        return false;
+
+    uint8_t index = heap[0];
+    TrackCursor *cursor = &cursors[index];
+    *event = cursor->event;
+
+    if (read_event(cursor))
+    {
+        // Same track stays at the root with a later tick
+        cursor->event.track = index;
+    }
+    else
+    {
+        heap_size--;
+        heap[0] = heap[heap_size];
+    }
+
+    if (heap_size > 0)
+        sift_down(0);
+
+    return true;
+}
+
+// Tops up the first track that needs it. One block per call, so the caller
+// can look at the time between reads. Returns whether a block was read.
+bool MidiMerger::refill()
+{
+    for (uint8_t i = 0; i < track_count; i++)
+    {
+        if (cursors[i].stream.refill())
+            return true;
+    }
+
+    return false;
+}
+
+void MidiMerger::close()
+{
+    for (uint8_t i = 0; i < track_count; i++)
+        cursors[i].stream.close();
+
+    heap_size = 0;
+    track_count = 0;
+}
+
+bool MidiMerger::failed()
+{
+    return error;
+}
+
+bool MidiMerger::before(uint8_t a, uint8_t b)
+{
+    uint32_t tick_a = cursors[a].event.tick;
+    uint32_t tick_b = cursors[b].event.tick;
+
+    return tick_a < tick_b || (tick_a == tick_b && a < b);
+}
+
+void MidiMerger::sift_up(uint8_t pos)
+{
+    while (pos > 0)
+    {
+        uint8_t parent = (pos - 1) / 2;
+        if (!before(heap[pos], heap[parent]))
+            break;
+
+        uint8_t tmp = heap[pos];
+        heap[pos] = heap[parent];
+        heap[parent] = tmp;
+        pos = parent;
+    }
+}
+
+void MidiMerger::sift_down(uint8_t pos)
+{
+    while (1)
+    {
+        uint8_t left = 2 * pos + 1;
+        uint8_t right = left + 1;
+        uint8_t smallest = pos;
+
+        if (left < heap_size && before(heap[left], heap[smallest]))
+            smallest = left;
+        if (right < heap_size && before(heap[right], heap[smallest]))
+            smallest = right;
+        if (smallest == pos)
+            break;
+
+        uint8_t tmp = heap[pos];
+        heap[pos] = heap[smallest];
+        heap[smallest] = tmp;
+        pos = smallest;
+    }
+}
+
+bool MidiMerger::read_vlq(TrackStream *stream, uint32_t *result)
+{
+    uint32_t value = 0;
+    uint8_t byte;
+
+    // Variable length quantities are at most 4 bytes long
+    for (int i = 0; i < 4; i++)
+    {
+        if (!stream->read(&byte))
+            return false;
+
+        value = (value << 7) | (byte & 0x7F);
+        if ((byte & 0x80) == 0)
+        {
+            *result = value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Decodes events of a track until one the player cares about (channel
+// messages and tempo changes) is found. Returns false at the end of the track.
+bool MidiMerger::read_event(TrackCursor *cursor)
+{
+    TrackStream *stream = &cursor->stream;
+    MidiEvent *event = &cursor->event;
+
+    while (1)
+    {
+        uint32_t delta_time;
+        uint8_t status_byte;
+
+        if (stream->eof())
+            return false;
+
+        if (!read_vlq(stream, &delta_time) || !stream->peek(&status_byte))
+        {
+            LOG_ERROR("Track ended inside an event at offset %lu\n", stream->position());
+            error = true;
+            return false;
+        }
+
+        cursor->tick += delta_time;
+
+        // Handle running status
+        if ((status_byte & 0x80) == 0)
+        {
+            if (cursor->running_status == 0)
+            {
+                LOG_ERROR("Running status but no previous status at offset %lu\n", stream->position());
+                error = true;
+                return false;
+            }
+            status_byte = cursor->running_status;
+        }
+        else
+        {
+            stream->read(&status_byte);
+        }
+
+        if (status_byte == MIDI_META_EVENT)
+        {
+            // Meta and SysEx events cancel running status
+            cursor->running_status = 0;
+
+            uint8_t meta_type;
+            uint32_t meta_length;
+            if (!stream->read(&meta_type) || !read_vlq(stream, &meta_length))
+            {
+                LOG_ERROR("Not enough bytes for meta event\n");
+                error = true;
+                return false;
+            }
+
+            event->meta[0] = event->meta[1] = event->meta[2] = 0;
+            for (uint32_t i = 0; i < meta_length; i++)
+            {
+                uint8_t value;
+                if (!stream->read(&value))
+                {
+                    LOG_ERROR("Not enough bytes for meta event data\n");
+                    error = true;
+                    return false;
+                }
+                if (i < 3)
+                    event->meta[i] = value;
+            }
+
+            if (meta_type == MIDI_META_END_OF_TRACK)
+                return false;
+
+            if (meta_type == MIDI_META_TEMPO && meta_length == 3)
+            {
+                event->tick = cursor->tick;
+                event->status = MIDI_META_EVENT;
+                event->data[0] = meta_type;
+                event->data[1] = 0;
+                event->meta_length = meta_length;
+                return true;
+            }
+            continue;
+        }
+
+        if (status_byte == MIDI_SYSEX || status_byte == MIDI_SYSEX_ESCAPE)
+        {
+            cursor->running_status = 0;
+
+            uint32_t sysex_length;
+            uint8_t value;
+            if (!read_vlq(stream, &sysex_length))
+            {
+                error = true;
+                return false;
+            }
+            for (uint32_t i = 0; i < sysex_length; i++)
+            {
+                if (!stream->read(&value))
+                {
+                    error = true;
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        cursor->running_status = status_byte;
+
+        // Program change and channel pressure carry one data byte, the rest two
+        uint8_t type = status_byte & 0xF0;
+        uint8_t data_bytes = (type == 0xC0 || type == 0xD0) ? 1 : 2;
+
+        event->data[1] = 0;
+        for (uint8_t i = 0; i < data_bytes; i++)
+        {
+            if (!stream->read(&event->data[i]))
+            {
+                LOG_ERROR("Not enough bytes for %u-byte event\n", data_bytes);
+                error = true;
+                return false;
+            }
+        }
+
+        event->tick = cursor->tick;
+        event->status = status_byte;
+        event->meta_length = 0;
+        return true;
+    }
+}
+
+#endif
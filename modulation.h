@@ -0,0 +1,302 @@
+#ifndef MODULATION_H
+#define MODULATION_H
+
+#include <pico/stdlib.h>
+#include <pico/sync.h>
+#include <array>
+#include "transmitter.h"
+#include "synth.h"
+#include "note_stack.h"
+
+// Pitch modulation of the output: pitch wheel, vibrato from the mod wheel
+// (CC1) and glide between the notes of the monophonic output (CC65 on, CC5
+// glide time). A repeating timer on core0 works out a period multiplier for
+// every MIDI channel and hands it to the synth voices and the PWM slices.
+// Pitch offsets are in cents and turned into multipliers with fixed point
+// tables, so an update is a few lookups and multiplies per channel.
+#define MOD_UPDATE_MS 2
+
+#define MOD_BEND_CENTS 200           // Pitch wheel fully up or down
+#define MOD_VIBRATO_CENTS 50         // Vibrato depth with the mod wheel fully up
+#define MOD_VIBRATO_MILLIHZ 5500     // Vibrato rate
+#define MOD_GLIDE_STEP_MS 10         // Glide time per step of CC5
+#define MOD_SINE_BITS 6              // 64 entry sine table
+
+#define MIDI_CONTROL_CHANGE 0xB0
+#define MIDI_PITCH_BEND 0xE0
+
+#define MIDI_CC_MODULATION 1
+#define MIDI_CC_PORTAMENTO_TIME 5
+#define MIDI_CC_PORTAMENTO 65
+#define MIDI_CC_RESET_ALL 121
+
+typedef struct
+{
+    int16_t bend;       // Cents
+    uint8_t vibrato;    // CC1
+    uint8_t glide_time; // CC5
+    bool glide;         // CC65
+} ModChannel;
+
+// Monophonic output of one coil
+typedef struct
+{
+    int8_t channel;     // Channel the output follows
+    int8_t last_note;
+    int32_t glide;      // Offset still to glide, 1/256 cents
+    int32_t glide_step; // Per update, 1/256 cents
+    uint32_t scale;     // Last multiplier written to the slice
+} ModOutput;
+
+// 2^(-i/12) and 2^(-i/1200) in 16.16, multiplying a period by them raises
+// the pitch by i semitones or cents
+constexpr std::array<uint32_t, 12> make_semitone_table()
+{
+    std::array<uint32_t, 12> table{};
+    double scale = 1.0;
+    for (int i = 0; i < 12; i++)
+    {
+        table[i] = (uint32_t)(scale * 65536.0 + 0.5);
+        scale /= 1.0594630943592952646;
+    }
+    return table;
+}
+
+constexpr std::array<uint32_t, 100> make_cent_table()
+{
+    std::array<uint32_t, 100> table{};
+    double scale = 1.0;
+    for (int i = 0; i < 100; i++)
+    {
+        table[i] = (uint32_t)(scale * 65536.0 + 0.5);
+        scale /= 1.0005777895065548;
+    }
+    return table;
+}
+
+// One sine period in 1.15 fixed point, Taylor series so it can be constexpr
+constexpr std::array<int16_t, 1 << MOD_SINE_BITS> make_sine_table()
+{
+    std::array<int16_t, 1 << MOD_SINE_BITS> table{};
+    const double pi = 3.14159265358979323846;
+    for (int i = 0; i < (1 << MOD_SINE_BITS); i++)
+    {
+        double x = 2.0 * pi * i / (1 << MOD_SINE_BITS);
+        if (x > pi)
+            x -= 2.0 * pi;
+
+        double term = x;
+        double sine = x;
+        for (int n = 1; n < 10; n++)
+        {
+            term *= -x * x / ((2 * n) * (2 * n + 1));
+            sine += term;
+        }
+        table[i] = (int16_t)(sine * 32767.0 + (sine < 0 ? -0.5 : 0.5));
+    }
+    return table;
+}
+
+constexpr std::array<uint32_t, 12> mod_semitone_table = make_semitone_table();
+constexpr std::array<uint32_t, 100> mod_cent_table = make_cent_table();
+constexpr std::array<int16_t, 1 << MOD_SINE_BITS> mod_sine_table = make_sine_table();
+
+static_assert(mod_semitone_table[0] == 65536 && mod_cent_table[0] == 65536, "Unity multiplier");
+static_assert(mod_sine_table[(1 << MOD_SINE_BITS) / 4] == 32767, "Sine peak");
+
+// LFO phase step per update, the phase wraps at 2^32
+#define MOD_LFO_STEP ((uint32_t)(4294967296ull * MOD_VIBRATO_MILLIHZ * MOD_UPDATE_MS / 1000000))
+
+ModChannel mod_channels[MIDI_CHANNELS];
+critical_section_t mod_lock;
+repeating_timer_t mod_timer;
+
+uint32_t mod_lfo_phase = 0;
+uint32_t mod_scales[MIDI_CHANNELS];
+
+ModOutput mod_outputs[TX_OUTPUTS];
+
+void modulation_init();
+void modulation_reset();
+void modulation_pitch_bend(uint8_t, uint16_t);
+void modulation_control(uint8_t, uint8_t, uint8_t);
+bool modulation_event(uint8_t, uint8_t);
+void modulation_mono_note(uint8_t, uint8_t, uint8_t);
+uint32_t modulation_scale(int32_t);
+bool modulation_update(repeating_timer_t *);
+
+void modulation_init()
+{
+    critical_section_init(&mod_lock);
+    modulation_reset();
+
+    for (int i = 0; i < TX_OUTPUTS; i++)
+        mod_outputs[i].scale = 1u << 16;
+
+    // Timer callbacks run on core0, the core the default alarm pool
+    // belongs to, same as pwm_irq_handler
+    add_repeating_timer_ms(-MOD_UPDATE_MS, modulation_update, NULL, &mod_timer);
+}
+
+// Back to no modulation at all, at the start of every song
+void modulation_reset()
+{
+    critical_section_enter_blocking(&mod_lock);
+
+    for (int i = 0; i < MIDI_CHANNELS; i++)
+    {
+        mod_channels[i] = {0, 0, 0, false};
+        mod_scales[i] = 1u << 16;
+    }
+
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        mod_outputs[i].channel = -1;
+        mod_outputs[i].last_note = -1;
+        mod_outputs[i].glide = 0;
+        mod_outputs[i].glide_step = 0;
+    }
+
+    critical_section_exit(&mod_lock);
+}
+
+void modulation_pitch_bend(uint8_t channel, uint16_t value)
+{
+    // 14-bit value, centred at 8192
+    mod_channels[channel & 0x0F].bend = ((int32_t)value - 8192) * MOD_BEND_CENTS / 8192;
+}
+
+void modulation_control(uint8_t channel, uint8_t controller, uint8_t value)
+{
+    ModChannel *mod = &mod_channels[channel & 0x0F];
+
+    switch (controller)
+    {
+    case MIDI_CC_MODULATION:
+        mod->vibrato = value;
+        break;
+    case MIDI_CC_PORTAMENTO_TIME:
+        mod->glide_time = value;
+        break;
+    case MIDI_CC_PORTAMENTO:
+        mod->glide = value >= 64;
+        break;
+    case MIDI_CC_RESET_ALL:
+        *mod = {0, 0, 0, false};
+        break;
+    }
+}
+
+// Whether a channel event is one the engine reacts to, so the event cache
+// only keeps those
+bool modulation_event(uint8_t status, uint8_t controller)
+{
+    uint8_t type = status & 0xF0;
+
+    if (type == MIDI_PITCH_BEND)
+        return true;
+
+    return type == MIDI_CONTROL_CHANGE &&
+           (controller == MIDI_CC_MODULATION || controller == MIDI_CC_PORTAMENTO_TIME ||
+            controller == MIDI_CC_PORTAMENTO || controller == MIDI_CC_RESET_ALL);
+}
+
+// The monophonic output of a coil moved to a new note. With glide on, it
+// starts at the pitch of the previous note and slides over to the new one.
+void modulation_mono_note(uint8_t index, uint8_t channel, uint8_t note)
+{
+    ModChannel *mod = &mod_channels[channel & 0x0F];
+    ModOutput *output = &mod_outputs[index];
+
+    critical_section_enter_blocking(&mod_lock);
+
+    output->channel = channel & 0x0F;
+    output->glide = 0;
+    output->glide_step = 0;
+
+    uint32_t glide_ms = (uint32_t)mod->glide_time * MOD_GLIDE_STEP_MS;
+    if (mod->glide && output->last_note >= 0 && glide_ms >= MOD_UPDATE_MS)
+    {
+        output->glide = ((int32_t)output->last_note - note) * 100 * 256;
+        output->glide_step = output->glide / (int32_t)(glide_ms / MOD_UPDATE_MS);
+        if (output->glide_step == 0)
+            output->glide_step = output->glide > 0 ? 1 : -1;
+    }
+    output->last_note = note;
+
+    critical_section_exit(&mod_lock);
+}
+
+// Period multiplier (16.16) that raises the pitch by `cents`
+uint32_t modulation_scale(int32_t cents)
+{
+    int32_t octaves = 0;
+
+    while (cents < 0)
+    {
+        cents += 1200;
+        octaves++;
+    }
+    octaves -= cents / 1200;
+    cents %= 1200;
+
+    uint32_t scale = ((uint64_t)mod_semitone_table[cents / 100] * mod_cent_table[cents % 100]) >> 16;
+    return octaves >= 0 ? scale << octaves : scale >> -octaves;
+}
+
+bool modulation_update(repeating_timer_t *)
+{
+    mod_lfo_phase += MOD_LFO_STEP;
+    int32_t sine = mod_sine_table[mod_lfo_phase >> (32 - MOD_SINE_BITS)];
+
+    critical_section_enter_blocking(&mod_lock);
+
+    for (int i = 0; i < MIDI_CHANNELS; i++)
+    {
+        const ModChannel *mod = &mod_channels[i];
+        int32_t cents = mod->bend;
+
+        if (mod->vibrato > 0)
+            cents += MOD_VIBRATO_CENTS * mod->vibrato * sine / (127 * 32767);
+
+        mod_scales[i] = cents == 0 ? 1u << 16 : modulation_scale(cents);
+    }
+
+    uint32_t mono_scales[TX_OUTPUTS];
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        ModOutput *output = &mod_outputs[i];
+        mono_scales[i] = 1u << 16;
+        if (output->channel < 0)
+            continue;
+
+        // Glide moves towards the new note by a fixed step every update
+        if (output->glide > 0)
+            output->glide = output->glide > output->glide_step ? output->glide - output->glide_step : 0;
+        else if (output->glide < 0)
+            output->glide = output->glide < output->glide_step ? output->glide - output->glide_step : 0;
+
+        int32_t glide_cents = output->glide / 256;
+        mono_scales[i] = mod_scales[output->channel];
+        if (glide_cents != 0)
+            mono_scales[i] = ((uint64_t)mono_scales[i] * modulation_scale(glide_cents)) >> 16;
+    }
+
+    critical_section_exit(&mod_lock);
+
+    synth_modulate(mod_scales);
+
+    // Only a changed period is written to a slice
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        if (mono_scales[i] != mod_outputs[i].scale)
+        {
+            mod_outputs[i].scale = mono_scales[i];
+            transmitter_modulate(i, mono_scales[i]);
+        }
+    }
+
+    return true;
+}
+
+#endif
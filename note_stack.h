@@ -0,0 +1,182 @@
+#ifndef NOTE_STACK_H
+#define NOTE_STACK_H
+
+#include <pico/stdlib.h>
+
+// Held notes remembered per MIDI channel, the oldest one is forgotten when a
+// channel holds more than this
+#define NOTE_STACK_DEPTH 8
+#define MIDI_CHANNELS 16
+
+typedef enum
+{
+    NOTE_PRIORITY_LAST,
+    NOTE_PRIORITY_HIGHEST,
+    NOTE_PRIORITY_LOWEST
+} NotePriority;
+
+typedef struct
+{
+    uint8_t note;
+    uint8_t velocity;
+    uint32_t pressed; // Order of the note on, for last note priority
+} HeldNote;
+
+// Fixed-size stack of the notes held on one channel, newest on top
+typedef struct
+{
+    HeldNote notes[NOTE_STACK_DEPTH];
+    uint8_t size;
+} NoteStack;
+
+// Decides which single note a monophonic output plays. Every channel keeps a
+// stack of its held notes, so releasing the sounding note falls back to the
+// note that is still held instead of going silent. All work is bounded by
+// the stack depth and the channel count, nothing is allocated.
+class NoteAllocator
+{
+private:
+    NoteStack stacks[MIDI_CHANNELS];
+    uint32_t press_count = 0;
+
+    bool sounding = false;
+    uint8_t sounding_channel = 0;
+    uint8_t sounding_note = 0;
+    uint8_t sounding_velocity = 0;
+
+    void remove(NoteStack *, uint8_t);
+    bool preferred(const HeldNote *, const HeldNote *);
+
+public:
+    NotePriority priority = NOTE_PRIORITY_LAST;
+
+    void clear();
+    void note_on(uint8_t, uint8_t, uint8_t);
+    void note_off(uint8_t, uint8_t);
+    bool current(uint8_t *, uint8_t *, uint8_t *channel = nullptr);
+    bool update(uint8_t *, uint8_t *);
+    uint8_t channel();
+};
+
+void NoteAllocator::clear()
+{
+    for (int i = 0; i < MIDI_CHANNELS; i++)
+        stacks[i].size = 0;
+
+    sounding = false;
+}
+
+void NoteAllocator::remove(NoteStack *stack, uint8_t note)
+{
+    for (uint8_t i = 0; i < stack->size; i++)
+    {
+        if (stack->notes[i].note == note)
+        {
+            for (uint8_t j = i + 1; j < stack->size; j++)
+                stack->notes[j - 1] = stack->notes[j];
+            stack->size--;
+            return;
+        }
+    }
+}
+
+void NoteAllocator::note_on(uint8_t channel, uint8_t note, uint8_t velocity)
+{
+    NoteStack *stack = &stacks[channel & 0x0F];
+
+    // A repeated note moves to the top, a full stack drops its oldest note
+    remove(stack, note);
+    if (stack->size == NOTE_STACK_DEPTH)
+        remove(stack, stack->notes[0].note);
+
+    HeldNote *held = &stack->notes[stack->size++];
+    held->note = note;
+    held->velocity = velocity;
+    held->pressed = press_count++;
+}
+
+void NoteAllocator::note_off(uint8_t channel, uint8_t note)
+{
+    remove(&stacks[channel & 0x0F], note);
+}
+
+bool NoteAllocator::preferred(const HeldNote *a, const HeldNote *b)
+{
+    switch (priority)
+    {
+    case NOTE_PRIORITY_HIGHEST:
+        return a->note > b->note;
+    case NOTE_PRIORITY_LOWEST:
+        return a->note < b->note;
+    default:
+        return (int32_t)(a->pressed - b->pressed) > 0;
+    }
+}
+
+// Note the output should play across all channels, false if none is held
+bool NoteAllocator::current(uint8_t *note, uint8_t *velocity, uint8_t *channel)
+{
+    const HeldNote *best = nullptr;
+    uint8_t best_channel = 0;
+
+    for (int c = 0; c < MIDI_CHANNELS; c++)
+    {
+        const NoteStack *stack = &stacks[c];
+        for (uint8_t i = 0; i < stack->size; i++)
+        {
+            if (best == nullptr || preferred(&stack->notes[i], best))
+            {
+                best = &stack->notes[i];
+                best_channel = c;
+            }
+        }
+    }
+
+    if (best == nullptr)
+        return false;
+
+    *note = best->note;
+    *velocity = best->velocity;
+    if (channel != nullptr)
+        *channel = best_channel;
+    return true;
+}
+
+// Like current(), but only returns true when the output has to change.
+// Velocity 0 means the output has to go silent.
+bool NoteAllocator::update(uint8_t *note, uint8_t *velocity)
+{
+    uint8_t next_note, next_velocity, next_channel;
+    bool held = current(&next_note, &next_velocity, &next_channel);
+
+    if (!held)
+    {
+        if (!sounding)
+            return false;
+
+        sounding = false;
+        *note = sounding_note;
+        *velocity = 0;
+        return true;
+    }
+
+    if (sounding && next_note == sounding_note && next_velocity == sounding_velocity)
+        return false;
+
+    sounding = true;
+    sounding_channel = next_channel;
+    sounding_note = next_note;
+    sounding_velocity = next_velocity;
+
+    *note = next_note;
+    *velocity = next_velocity;
+    return true;
+}
+
+// Channel of the note the output plays, for pitch bend and vibrato
+uint8_t NoteAllocator::channel()
+{
+    return sounding_channel;
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef NOTE_TABLE_H
+#define NOTE_TABLE_H
+
+#include <stdint.h>
+#include <array>
+
+// Everything the transmitter needs to play a MIDI note. The PWM settings
+// depend on the system clock, so note_table_init() works them out once at
+// startup with pwm_solve() and note changes in the PWM interrupt are a
+// lookup, an integer multiply and a few register writes.
+#define NOTE_TABLE_CLOCK 125000000 // Default clk_sys of the RP2040
+
+// Divider candidates tried above the smallest one that fits the counter
+#define PWM_SOLVE_SPAN 16
+
+// Notes keep this much of the 16-bit counter free, 65536 / 2^(2/12), so
+// their period can be stretched by a pitch bend down of two semitones
+// without a new divider. Bends and glides beyond that are re-solved by the
+// transmitter.
+#define NOTE_MAX_COUNTS 58386
+
+typedef struct
+{
+    uint16_t divider16; // Clock divider, 8.4 fixed point
+    uint16_t wrap;
+    uint32_t ticks_q16; // Counter ticks per us, 16.16 fixed point
+} PwmSetting;
+
+// f = 440 * 2^((n - 69) / 12), tuned A4 at 440Hz
+constexpr double note_frequency(int note)
+{
+    const double semitone = 1.0594630943592952646;
+    double frequency = 440.0;
+
+    for (int i = 69; i < note; i++)
+        frequency *= semitone;
+    for (int i = note; i < 69; i++)
+        frequency /= semitone;
+
+    return frequency;
+}
+
+// Counter ticks per us of a slice clocked at `clock`, 16.16 fixed point
+constexpr uint32_t pwm_ticks_q16(uint32_t clock, uint16_t divider16)
+{
+    return (uint32_t)(((uint64_t)clock << 20) / ((uint64_t)divider16 * 1000000));
+}
+
+// Divider and wrap that bring a slice clocked at `clock` closest to
+// millihz / 1000 Hz with at most max_counts counter steps per period. The
+// period is divider16 * (wrap + 1) / 16 clock cycles, so starting from the
+// smallest divider that fits the counter the
+// next few fractional dividers are tried as well, each with its best wrap.
+// Staying close to the smallest divider keeps the counter, and with it the
+// pulse width resolution, near full range. Integer only, so it is cheap at
+// runtime and can be checked at compile time.
+constexpr PwmSetting pwm_solve(uint32_t clock, uint32_t millihz, uint32_t max_counts = 65536)
+{
+    // Period in divider16 * counts is clock * 16000 / millihz
+    const uint64_t target = (uint64_t)clock * 16000;
+
+    uint64_t divider16_min = (target + (uint64_t)millihz * max_counts - 1) / ((uint64_t)millihz * max_counts);
+    if (divider16_min < 16)
+        divider16_min = 16;
+
+    // Too low for the slowest divider, the longest period it has comes
+    // closest (the lowest MIDI notes)
+    if (divider16_min > 4095)
+        divider16_min = 4095;
+
+    PwmSetting best = {0, 0, 0};
+    uint64_t best_error = UINT64_MAX;
+
+    for (uint64_t divider16 = divider16_min; divider16 < divider16_min + PWM_SOLVE_SPAN && divider16 < 4096; divider16++)
+    {
+        uint64_t step = divider16 * millihz;
+        uint64_t counts = (target + step / 2) / step;
+        if (counts > max_counts)
+            counts = max_counts;
+        if (counts < 2)
+            counts = 2;
+
+        uint64_t period = counts * step;
+        uint64_t error = period > target ? period - target : target - period;
+        if (error < best_error)
+        {
+            best_error = error;
+            best.divider16 = (uint16_t)divider16;
+            best.wrap = (uint16_t)(counts - 1);
+        }
+    }
+
+    best.ticks_q16 = pwm_ticks_q16(clock, best.divider16);
+    return best;
+}
+
+// Counter ticks for a pulse width in us with the given divider
+constexpr uint32_t pwm_ticks(uint32_t clock, uint16_t divider16, uint32_t us)
+{
+    return (uint32_t)(((uint64_t)clock * 16 * us + (uint64_t)divider16 * 500000) / ((uint64_t)divider16 * 1000000));
+}
+
+// Note frequency in mHz, so the solver can run at startup without floats
+constexpr std::array<uint32_t, 128> make_note_millihz_table()
+{
+    std::array<uint32_t, 128> table{};
+    for (int note = 0; note < 128; note++)
+        table[note] = (uint32_t)(note_frequency(note) * 1000.0 + 0.5);
+    return table;
+}
+
+constexpr std::array<uint32_t, 128> note_millihz_table = make_note_millihz_table();
+
+// Compare level for a pulse of width_us, at most half the period so the
+// highest notes do not turn into a mostly-on output
+static inline uint16_t pwm_width_level(const PwmSetting *setting, uint32_t width_us)
+{
+    uint32_t level = (uint32_t)(((uint64_t)width_us * setting->ticks_q16 + 0x8000) >> 16);
+    if (level > setting->wrap / 2u)
+        level = setting->wrap / 2u;
+    return level;
+}
+
+// Note period in 1/16 us for the synth
+constexpr std::array<uint32_t, 128> make_note_period_table()
+{
+    std::array<uint32_t, 128> table{};
+    for (int note = 0; note < 128; note++)
+        table[note] = (uint32_t)(16000000.0 / note_frequency(note) + 0.5);
+    return table;
+}
+
+constexpr std::array<uint32_t, 128> note_period_table = make_note_period_table();
+
+// Filled for the actual system clock by note_table_init()
+PwmSetting note_pwm_table[128];
+
+// A4 has to come out at 440Hz
+static_assert(pwm_solve(NOTE_TABLE_CLOCK, note_millihz_table[69], NOTE_MAX_COUNTS).divider16 == 78 &&
+                  pwm_solve(NOTE_TABLE_CLOCK, note_millihz_table[69], NOTE_MAX_COUNTS).wrap == 58274,
+              "A4 PWM settings");
+static_assert(note_period_table[69] == 36364, "A4 period");
+
+void note_table_init(uint32_t clock)
+{
+    for (int note = 0; note < 128; note++)
+        note_pwm_table[note] = pwm_solve(clock, note_millihz_table[note], NOTE_MAX_COUNTS);
+}
+
+#endif
@@ -11,12 +11,15 @@
 #include "f_util.h"
 #include "hw_config.h"
 #include "ff.h"
+#include "log.h"
 #include "util.h"
 #include "transmitter.h"
-
-#define MIDI_NOTE_ON 0x90
-#define MIDI_NOTE_OFF 0x80
-#define MIDI_META_EVENT 0xFF
+#include "synth.h"
+#include "modulation.h"
+#include "note_stack.h"
+#include "midi_merger.h"
+#include "sequencer.h"
+#include "event_cache.h"
 
 typedef struct
 {
@@ -25,10 +28,19 @@ typedef struct
     uint16_t division;
 } MidiHeader;
 
+// Most tracks kept in the chunk index of a file
+#define MAX_INDEXED_TRACKS 64
+
+// Time one block read from the card may take. Waits only refill the
+// streams while at least this much is left before the next event.
+#define PLAYER_REFILL_SLACK_US 2000
+
 typedef struct
 {
+    uint32_t offset; // File position of the first event byte
     uint32_t length;
-    uint8_t *data;
+    bool has_notes;
+    bool has_tempo;
 } MidiTrack;
 
 class Player
@@ -39,10 +51,20 @@ private:
     DIR dir;
     FILINFO fno;
     FIL fil;
+    FIL cache_fil;
+    MidiMerger merger;
+    Sequencer sequencer;
+    TrackStream stream; // Event cache playback and track scanning
+    TcevWriter cache_writer;
+    NoteAllocator mono_notes[TX_OUTPUTS]; // One allocator per coil
+    char cache_name[FF_MAX_LFN + sizeof(TCEV_EXTENSION)];
 
-    uint32_t current_tempo = 500000; // Default to 120bpm
     uint16_t time_division;
 
+    // Chunk index of the file being played
+    MidiTrack tracks[MAX_INDEXED_TRACKS];
+    uint16_t track_count = 0;
+
     // Lookup table for all notes and octaves
     const char *note_names[129] = {
         "C-1 ", "C#-1", "D-1 ", "D#-1", "E-1 ", "F-1 ", "F#-1", "G-1 ", "G#-1", "A-1 ", "A#-1", "B-1 ",
@@ -57,27 +79,40 @@ private:
         "C8  ", "C#8 ", "D8  ", "D#8 ", "E8  ", "F8  ", "F#8 ", "G8  ", "G#8 ", "A8  ", "A#8 ", "B8  ",
         "C9  ", "C#9 ", "D9  ", "D#9 ", "E9  ", "F9  ", "F#9 ", "G9  ", "G#9 "};
 
-    uint32_t delta_to_ms(uint32_t delta);
+    bool wait_until(absolute_time_t);
+    void play_note(uint8_t, uint8_t, uint8_t);
+    void play_control(uint8_t, uint8_t, uint8_t);
+    bool control_event(uint8_t, uint8_t);
+    bool read_midi_header(MidiHeader *);
+    void scan_midi_track(MidiTrack *);
+    bool compile_midi_tracks(const char *, const FILINFO *);
+    bool open_event_cache(const FILINFO *, uint32_t *);
+    void play_event_cache(uint32_t);
 
 public:
     const char *note_name;
     int pitch = 0;
     bool play = false;
     bool paused = false;
+    bool polyphonic = true; // Play chords through the synth, else monophonic PWM. Picked in the start menu.
+    NotePriority mono_priority = NOTE_PRIORITY_LAST;
+    int8_t envelope_profile = ENVELOPE_BY_PROGRAM; // Same envelope for the whole song, or per channel
+    uint32_t late_us = 0;                          // Latest an event of the song was played, us
 
     bool init();
     bool mountFileSystem();
     bool unmountCard();
     bool openCard();
     void readFileNames(const char ***, int *);
-    void read_midi_header(const char *, MidiHeader *);
-    void read_midi_track(const char *, MidiTrack *, uint32_t);
-    void parse_midi_track(const MidiTrack *);
+    bool index_midi_file(const char *);
+    bool open_midi_tracks(const char *);
+    void close_midi_tracks();
+    void parse_midi_tracks(const char *);
+    void play_midi_file(const char *);
     const char *readFile(const char *);
     void pause();
     const char *getNoteName(uint8_t);
     void resetPlayback(void);
-    void cleanupTrackData(MidiTrack *);
     void resetFileSystem();
 };
 
@@ -128,7 +163,7 @@ void Player::readFileNames(const char ***files, int *file_count)
         fr = f_readdir(&dir, &fno);
         if (fr != FR_OK || fno.fname[0] == 0)
             break;
-        if (fno.fattrib & AM_DIR)
+        if (fno.fattrib & AM_DIR || tcev_is_cache_name(fno.fname))
             continue;
         count++;
     }
@@ -155,7 +190,7 @@ void Player::readFileNames(const char ***files, int *file_count)
         fr = f_readdir(&dir, &fno);
         if (fr != FR_OK || fno.fname[0] == 0)
             break;
-        if (fno.fattrib & AM_DIR)
+        if (fno.fattrib & AM_DIR || tcev_is_cache_name(fno.fname))
             continue;
 
         (*files)[i] = strdup(fno.fname);
@@ -171,366 +206,457 @@ void Player::pause()
     paused = !paused;
 }
 
-void Player::read_midi_header(const char *file_name, MidiHeader *header)
+// Walks the chunks of the file once and records where every track starts,
+// how long it is and whether it has anything to play. Opening a track later
+// is then a single seek.
+bool Player::index_midi_file(const char *file_name)
 {
-    // Open Midi File for reading
+    track_count = 0;
+
     fr = f_open(&fil, file_name, FA_READ);
     if (fr != FR_OK)
     {
-        f_unmount("0:");
-        return;
+        LOG_ERROR("Failed to open file\n");
+        return false;
     }
 
-    // Read and skip "MThd" chunk identifier (4 bytes)
-    char chunk_id[4];
-    f_read(&fil, chunk_id, 4, NULL);
+    MidiHeader header;
+    if (!read_midi_header(&header))
+    {
+        f_close(&fil);
+        return false;
+    }
 
-    // Read and skip chunk size (4 bytes)
-    uint32_t chunk_size;
-    f_read(&fil, &chunk_size, 4, NULL);
+    uint32_t file_size = f_size(&fil);
+    uint32_t chunk_start = f_tell(&fil);
+    uint32_t tracks_found = 0;
 
-    // Read actual header (6 bytes) for format(2) number of tracks(2) and deltaTime(2)
-    uint8_t header_data[6];
-    f_read(&fil, header_data, 6, NULL);
+    while (chunk_start + 8 <= file_size && tracks_found < header.tracks)
+    {
+        uint8_t chunk_header[8];
+        UINT bytes_read;
 
-    // Parse header in big-endian format (MIDI uses big-endian)
-    header->format = (header_data[0] << 8) | header_data[1];
-    header->tracks = (header_data[2] << 8) | header_data[3];
-    header->division = (header_data[4] << 8) | header_data[5];
+        if (f_lseek(&fil, chunk_start) != FR_OK ||
+            f_read(&fil, chunk_header, 8, &bytes_read) != FR_OK || bytes_read != 8)
+        {
+            LOG_ERROR("Failed to read chunk at position %lu\n", chunk_start);
+            break;
+        }
 
-    time_division = header->division; // store time division
+        // Chunk size is big-endian
+        uint32_t chunk_size = ((uint32_t)chunk_header[4] << 24) | ((uint32_t)chunk_header[5] << 16) |
+                              ((uint32_t)chunk_header[6] << 8) | chunk_header[7];
+
+        // Check if this is an MTrk chunk
+        bool is_mtrk = (chunk_header[0] == 'M' && chunk_header[1] == 'T' &&
+                        chunk_header[2] == 'r' && chunk_header[3] == 'k');
 
-    printf("MIDI Header - Format: %u, Tracks: %u, Division: %u\n",
-           header->format, header->tracks, header->division);
+        if (is_mtrk)
+        {
+            if (track_count < MAX_INDEXED_TRACKS)
+            {
+                MidiTrack *track = &tracks[track_count];
+                track->offset = chunk_start + 8;
+                track->length = chunk_size;
+                scan_midi_track(track);
+
+                LOG_INFO("Track %lu: length %lu, %s\n", tracks_found, track->length,
+                         track->has_notes || track->has_tempo ? "played" : "skipped");
+                track_count++;
+            }
+            else
+            {
+                LOG_WARN("Only %u tracks are indexed, skipping track %lu\n", MAX_INDEXED_TRACKS, tracks_found);
+            }
+            tracks_found++;
+        }
+
+        chunk_start += 8 + chunk_size;
+    }
 
     f_close(&fil);
+    return track_count > 0;
 }
 
-void Player::read_midi_track(const char *file_name, MidiTrack *track, uint32_t track_number)
+bool Player::read_midi_header(MidiHeader *header)
 {
-    // Open midi file for reading
-    fr = f_open(&fil, file_name, FA_READ);
-    if (fr != FR_OK)
+    // "MThd", chunk size (4 bytes), format(2) number of tracks(2) and deltaTime(2)
+    uint8_t header_data[14];
+    UINT bytes_read;
+
+    fr = f_read(&fil, header_data, 14, &bytes_read);
+    if (fr != FR_OK || bytes_read != 14 || memcmp(header_data, "MThd", 4) != 0)
     {
-        printf("ERROR: Failed to open file\n");
-        f_unmount("0:");
-        return;
+        LOG_ERROR("Missing MThd header\n");
+        return false;
     }
 
-    // Read header to get actual header size
-    f_lseek(&fil, 0);
+    // Parse header in big-endian format (MIDI uses big-endian)
+    uint32_t chunk_size = ((uint32_t)header_data[4] << 24) | ((uint32_t)header_data[5] << 16) |
+                          ((uint32_t)header_data[6] << 8) | header_data[7];
+    header->format = (header_data[8] << 8) | header_data[9];
+    header->tracks = (header_data[10] << 8) | header_data[11];
+    header->division = (header_data[12] << 8) | header_data[13];
 
-    char chunk_id[4];
-    uint32_t chunk_size;
-    UINT bytes_read;
+    time_division = header->division; // store time division
 
-    // Read "MThd"
-    f_read(&fil, chunk_id, 4, &bytes_read);
-    if (bytes_read != 4)
-    {
-        printf("ERROR: Failed to read MThd chunk ID\n");
-        f_close(&fil);
-        f_unmount("0:");
+    LOG_INFO("MIDI Header - Format: %u, Tracks: %u, Division: %u\n",
+             header->format, header->tracks, header->division);
+
+    // Skip whatever a longer header carries
+    return f_lseek(&fil, 8 + chunk_size) == FR_OK;
+}
+
+// Looks for note status bytes (0x8n, 0x9n) and the FF 51 03 tempo prefix
+// in the raw bytes, without parsing events. Running status only carries on
+// from a status byte sent before, so a track with notes or tempo changes
+// always has one of these and is never dropped. Delta times and meta or
+// sysex payloads can hold the same bytes, that only keeps a track that
+// plays nothing. Scanning stops at the first one seen.
+void Player::scan_midi_track(MidiTrack *track)
+{
+    track->has_notes = false;
+    track->has_tempo = false;
+
+    if (track->length == 0 || !stream.open(&fil, track->offset, track->length))
         return;
-    }
 
-    f_read(&fil, &chunk_size, 4, &bytes_read);
-    if (bytes_read != 4)
+    uint8_t byte, previous[2] = {0, 0};
+    while (!(track->has_notes || track->has_tempo) && stream.read(&byte))
     {
-        printf("ERROR: Failed to read MThd chunk size\n");
-        f_close(&fil);
-        f_unmount("0:");
-        return;
+        if ((byte & 0xF0) == MIDI_NOTE_ON || (byte & 0xF0) == MIDI_NOTE_OFF)
+            track->has_notes = true;
+
+        if (previous[0] == MIDI_META_EVENT && previous[1] == MIDI_META_TEMPO && byte == 0x03)
+            track->has_tempo = true;
+
+        previous[0] = previous[1];
+        previous[1] = byte;
     }
 
-    // Convert chunk size from big-endian
-    chunk_size = ((chunk_size >> 24) & 0xFF) |
-                 ((chunk_size >> 8) & 0xFF00) |
-                 ((chunk_size << 8) & 0xFF0000) |
-                 ((chunk_size << 24) & 0xFF000000);
+    stream.close();
+}
 
-    printf("Header chunk size: %lu\n", chunk_size);
+// Opens the file once and gives every indexed track that has notes or tempo
+// changes its own cursor in the merger
+bool Player::open_midi_tracks(const char *file_name)
+{
+    fr = f_open(&fil, file_name, FA_READ);
+    if (fr != FR_OK)
+        return false;
 
-    // Current position should be at 8, skip the actual header data
-    // New position = 8 + chunk_size
-    f_lseek(&fil, 8 + chunk_size);
+    merger.begin();
+    for (uint16_t i = 0; i < track_count; i++)
+    {
+        if (!tracks[i].has_notes && !tracks[i].has_tempo)
+            continue;
 
-    // Now find the desired track by searching for "MTrk" chunks
-    uint32_t tracks_found = 0;
+        if (!merger.add_track(&fil, tracks[i].offset, tracks[i].length))
+            break;
+    }
 
-    while (1)
+    return true;
+}
+
+void Player::close_midi_tracks()
+{
+    merger.close();
+    f_close(&fil);
+}
+
+void Player::parse_midi_tracks(const char *file_name)
+{
+    uint32_t event_count = 0;
+
+    if (!open_midi_tracks(file_name))
     {
-        uint32_t chunk_start = f_tell(&fil);
+        LOG_ERROR("Failed to open file\n");
+        play = false;
+        return;
+    }
 
-        // Read chunk ID
-        f_read(&fil, chunk_id, 4, &bytes_read);
-        if (bytes_read != 4)
-        {
-            printf("ERROR: Failed to read chunk ID at position %lu\n", chunk_start);
-            f_close(&fil);
-            f_unmount("0:");
-            return;
-        }
+    LOG_INFO("Starting MIDI playback\n");
 
-        // Read chunk size
-        f_read(&fil, &chunk_size, 4, &bytes_read);
-        if (bytes_read != 4)
-        {
-            printf("ERROR: Failed to read chunk size at position %lu\n", chunk_start + 4);
-            f_close(&fil);
-            f_unmount("0:");
-            return;
-        }
+    sequencer.begin(time_division);
 
-        // Convert chunk size from big-endian
-        uint32_t chunk_size_le = ((chunk_size >> 24) & 0xFF) |
-                                 ((chunk_size >> 8) & 0xFF00) |
-                                 ((chunk_size << 8) & 0xFF0000) |
-                                 ((chunk_size << 24) & 0xFF000000);
+    MidiEvent event;
+    while (play == true && merger.next(&event))
+    {
+        if (!wait_until(sequencer.deadline(event.tick)))
+            break;
 
-        printf("Found chunk at %lu: %c%c%c%c, size: %lu\n",
-               chunk_start, chunk_id[0], chunk_id[1], chunk_id[2], chunk_id[3], chunk_size_le);
+        LOG_TRACE("Event %lu: track=%u, tick=%lu, status=0x%02X\n",
+                  event_count, event.track, event.tick, event.status);
 
-        // Check if this is an MTrk chunk
-        bool is_mtrk = (chunk_id[0] == 'M' && chunk_id[1] == 'T' &&
-                        chunk_id[2] == 'r' && chunk_id[3] == 'k');
+        // Check whether note-on or note-off
+        if ((event.status & 0xF0) == MIDI_NOTE_ON || (event.status & 0xF0) == MIDI_NOTE_OFF)
+        {
+            uint8_t velocity = event.data[1];
 
-        if (is_mtrk)
+            // Note offs always reach the transmitter with velocity 0
+            if ((event.status & 0xF0) == MIDI_NOTE_OFF)
+                velocity = 0;
+
+            play_note(event.status, event.data[0], velocity);
+        }
+        else if (control_event(event.status, event.data[0]))
+        {
+            play_control(event.status, event.data[0], event.data[1]);
+        }
+        else if (event.status == MIDI_META_EVENT)
         {
-            // Found an MTrk chunk
-            if (tracks_found == track_number)
+            // Handle tempo meta event
+            if (event.data[0] == MIDI_META_TEMPO)
             {
-                // This is the track we want
-                track->length = chunk_size_le;
-
-                // Safety check
-                if (track->length == 0 || track->length > 1048576)
-                {
-                    printf("ERROR: Invalid track length: %lu\n", track->length);
-                    f_close(&fil);
-                    f_unmount("0:");
-                    return;
-                }
-
-                // Allocate memory for the track data
-                track->data = (uint8_t *)malloc(track->length);
-                if (track->data == NULL)
-                {
-                    printf("ERROR: Failed to allocate %lu bytes for track data\n", track->length);
-                    f_close(&fil);
-                    f_unmount("0:");
-                    return;
-                }
-
-                // Read track data
-                fr = f_read(&fil, track->data, track->length, &bytes_read);
-                if (bytes_read != track->length)
-                {
-                    printf("ERROR: Failed to read track data. Read %u of %lu bytes\n", bytes_read, track->length);
-                    free(track->data);
-                    track->data = NULL;
-                    f_close(&fil);
-                    f_unmount("0:");
-                    return;
-                }
-
-                printf("Successfully read track %lu with length %lu\n", track_number, track->length);
-                f_close(&fil);
-                return;
+                uint32_t tempo = midi_event_tempo(&event);
+                sequencer.set_tempo(event.tick, tempo);
+                LOG_TRACE("    Tempo updated: %lu microseconds per beat\n", tempo);
             }
-            tracks_found++;
         }
-
-        // Move to next chunk
-        // Current position is after the chunk size field, so we need to skip chunk_size_le bytes
-        f_lseek(&fil, chunk_start + 8 + chunk_size_le);
-
-        // Safety check to prevent infinite loop
-        if (f_eof(&fil))
+        else
         {
-            printf("ERROR: Reached end of file before finding track %lu\n", track_number);
-            f_close(&fil);
-            f_unmount("0:");
-            return;
+            LOG_TRACE("  Other event: 0x%02X\n", event.status);
         }
+
+        event_count++;
     }
+
+    if (merger.failed())
+        LOG_ERROR("Reading tracks from card failed\n");
+
+    close_midi_tracks();
+
+    LOG_INFO("MIDI playback finished. Events processed: %lu, up to %lu us late\n", event_count, late_us);
+    play = false;
 }
 
-void Player::parse_midi_track(const MidiTrack *track)
+void Player::play_midi_file(const char *file_name)
 {
-    const uint8_t *data = track->data;
-    uint32_t offset = 0;
-    uint32_t event_count = 0;
-    uint8_t running_status = 0;
+    FILINFO source;
+    uint32_t record_count;
 
-    printf("Starting MIDI playback, track length: %lu\n", track->length);
+    fr = f_stat(file_name, &source);
+    if (fr != FR_OK)
+    {
+        LOG_ERROR("Failed to stat %s\n", file_name);
+        play = false;
+        return;
+    }
+
+    if (polyphonic)
+        synth_start();
 
-    while (offset < track->length && play == true)
+    for (int i = 0; i < TX_OUTPUTS; i++)
     {
-        uint32_t delta_time = 0;
-        uint8_t value;
+        mono_notes[i].clear();
+        mono_notes[i].priority = mono_priority;
+    }
+    modulation_reset();
+    envelope_reset(envelope_profile);
+    late_us = 0;
 
-        // read variable length delta time
-        do
-        {
-            if (offset >= track->length)
-            {
-                printf("ERROR: Offset exceeded track length during delta time read\n");
-                play = false;
-                return;
-            }
-            value = data[offset];
-            offset++;
-            delta_time = (delta_time << 7) | (value & 0x7F);
-        } while (value & 0x80);
+    bool cacheable = tcev_cache_name(file_name, cache_name, sizeof(cache_name));
+    if (cacheable && open_event_cache(&source, &record_count))
+    {
+        play_event_cache(record_count);
+        return;
+    }
 
-        // Convert it to ms
-        uint32_t wait_time = delta_to_ms(delta_time);
+    if (!index_midi_file(file_name))
+    {
+        LOG_ERROR("No track found\n");
+        play = false;
+        return;
+    }
 
-        if (offset >= track->length)
-        {
-            printf("ERROR: Offset exceeded track length after delta time read\n");
-            play = false;
-            return;
-        }
+    if (cacheable && compile_midi_tracks(file_name, &source) &&
+        open_event_cache(&source, &record_count))
+    {
+        play_event_cache(record_count);
+        return;
+    }
 
-        // Read MIDI Event type
-        uint8_t status_byte = data[offset];
+    // Card is read only or full, decode the file while playing instead
+    parse_midi_tracks(file_name);
+}
 
-        // Handle running status
-        if ((status_byte & 0x80) == 0)
+// Runs the merged tracks through the tempo map without waiting and writes
+// the resulting note events to the cache file
+bool Player::compile_midi_tracks(const char *file_name, const FILINFO *source)
+{
+    fr = f_open(&cache_fil, cache_name, FA_WRITE | FA_CREATE_ALWAYS);
+    if (fr != FR_OK)
+    {
+        LOG_WARN("Cannot create %s, playing without cache\n", cache_name);
+        return false;
+    }
+
+    if (!open_midi_tracks(file_name))
+    {
+        f_close(&cache_fil);
+        f_unlink(cache_name);
+        return false;
+    }
+
+    LOG_INFO("Compiling %s to %s\n", file_name, cache_name);
+
+    sequencer.begin(time_division);
+    bool ok = cache_writer.begin(&cache_fil);
+
+    MidiEvent event;
+    while (ok && merger.next(&event))
+    {
+        uint8_t type = event.status & 0xF0;
+        bool note = type == MIDI_NOTE_ON || type == MIDI_NOTE_OFF;
+
+        if (note || control_event(event.status, event.data[0]))
         {
-            // High bit not set - this is data, not a status byte
-            // Use running status from previous event
-            if (running_status == 0)
+            uint64_t time_us = sequencer.tick_to_us(event.tick);
+            if (time_us > UINT32_MAX)
             {
-                printf("ERROR: Running status but no previous status at offset %lu\n", offset);
-                play = false;
-                return;
+                LOG_ERROR("Song too long for the event cache\n");
+                ok = false;
+                break;
             }
-            status_byte = running_status;
-            // Don't increment offset - we'll use this byte as data
+
+            uint8_t value = type == MIDI_NOTE_OFF ? 0 : event.data[1];
+            cache_writer.add(time_us, event.status, event.data[0], value);
         }
-        else
+        else if (event.status == MIDI_META_EVENT && event.data[0] == MIDI_META_TEMPO)
         {
-            // This is a real status byte
-            offset++;
-            running_status = status_byte;
-
-            // Meta events and SysEx don't use running status
-            if (status_byte == MIDI_META_EVENT || status_byte == 0xF0 || status_byte == 0xF7)
-            {
-                running_status = 0;
-            }
+            sequencer.set_tempo(event.tick, midi_event_tempo(&event));
         }
+    }
 
-        printf("Event %lu: offset=%lu, delta=%lu, wait_time=%lu, status=0x%02X\n",
-               event_count, offset - 1, delta_time, wait_time, status_byte);
-
-        // Check whether note-on or note-off
-        if ((status_byte & 0xF0) == MIDI_NOTE_ON || (status_byte & 0xF0) == MIDI_NOTE_OFF)
-        {
-            if (offset + 2 > track->length)
-            {
-                printf("ERROR: Not enough bytes for note event\n");
-                play = false;
-                return;
-            }
+    ok = ok && !merger.failed() && cache_writer.finish(source);
 
-            uint8_t channel = status_byte & 0x0F;
-            uint8_t note = data[offset];
-            uint8_t velocity = data[offset + 1];
-            offset += 2;
+    close_midi_tracks();
+    f_close(&cache_fil);
 
-            printf("  NOTE %s: note=%u, velocity=%u, channel=%u\n",
-                   (status_byte & 0xF0) == MIDI_NOTE_ON ? "ON" : "OFF", note, velocity, channel);
+    if (!ok)
+        f_unlink(cache_name);
 
-            // Register the output only on note on event
-            if (velocity > 0)
-            {
-                note_name = getNoteName(note);
-                pitch = velocity;
-            }
+    return ok;
+}
 
-            transmitt_music(note, velocity);
-            
-            // Wait for duration of note
-            while (paused && play == true)
-            {
-                transmitt_off();
-                sleep_ms(10);
-            }
-            sleep_ms(wait_time);
-        }
-        else if (status_byte == MIDI_META_EVENT)
-        {
-            if (offset + 2 > track->length)
-            {
-                printf("ERROR: Not enough bytes for meta event\n");
-                play = false;
-                return;
-            }
+bool Player::open_event_cache(const FILINFO *source, uint32_t *record_count)
+{
+    fr = f_open(&cache_fil, cache_name, FA_READ);
+    if (fr != FR_OK)
+        return false;
 
-            uint8_t meta_type = data[offset];
-            uint8_t meta_length = data[offset + 1];
-            offset += 2;
+    TcevHeader header;
+    UINT bytes_read;
+    fr = f_read(&cache_fil, &header, sizeof(header), &bytes_read);
+    if (fr == FR_OK && bytes_read == sizeof(header) && tcev_header_matches(&header, source))
+    {
+        *record_count = header.record_count;
+        return true;
+    }
 
-            printf("  META event: type=0x%02X, length=%u\n", meta_type, meta_length);
+    // Stale or broken, it gets rebuilt from the source
+    LOG_INFO("Event cache %s is out of date\n", cache_name);
+    f_close(&cache_fil);
+    return false;
+}
 
-            if (offset + meta_length > track->length)
-            {
-                printf("ERROR: Not enough bytes for meta event data\n");
-                play = false;
-                return;
-            }
+void Player::play_event_cache(uint32_t record_count)
+{
+    uint32_t event_count = 0;
 
-            // Handle tempo meta event
-            if (meta_type == 0x51 && meta_length == 3)
-            {
-                current_tempo = (data[offset] << 16) | (data[offset + 1] << 8) | (data[offset + 2]);
-                printf("    Tempo updated: %lu microseconds per beat\n", current_tempo);
-            }
+    LOG_INFO("Starting cached playback, %lu events\n", record_count);
 
-            offset += meta_length;
+    if (record_count > 0 && !stream.open(&cache_fil, sizeof(TcevHeader), record_count * sizeof(TcevRecord)))
+    {
+        LOG_ERROR("Failed to start streaming event cache\n");
+        record_count = 0;
+    }
 
-            // Still need to wait (even for meta events)
-            // sleep_ms(wait_time);
-        }
-        else
-        {
-            printf("  Other event: 0x%02X\n", status_byte);
+    sequencer.start();
 
-            // Other MIDI Events
-            if ((status_byte & 0xF0) == 0xC0 || (status_byte & 0xF0) == 0xD0)
-            {
-                if (offset + 1 > track->length)
-                {
-                    printf("ERROR: Not enough bytes for program/channel event\n");
-                    play = false;
-                    return;
-                }
-                offset += 1;
-            }
-            else
-            {
-                if (offset + 2 > track->length)
-                {
-                    printf("ERROR: Not enough bytes for 2-byte event\n");
-                    play = false;
-                    return;
-                }
-                offset += 2;
-            }
-            // sleep_ms(wait_time);
-        }
+    TcevRecord record;
+    while (play == true && event_count < record_count && stream.read_bytes(&record, sizeof(record)))
+    {
+        if (!wait_until(sequencer.deadline_us(record.time_us)))
+            break;
 
+        uint8_t type = record.status & 0xF0;
+        if (type == MIDI_NOTE_ON || type == MIDI_NOTE_OFF)
+            play_note(record.status, record.data[0], record.data[1]);
+        else
+            play_control(record.status, record.data[0], record.data[1]);
         event_count++;
     }
 
-    printf("MIDI playback finished. Events processed: %lu\n", event_count);
+    stream.close();
+    f_close(&cache_fil);
+
+    LOG_INFO("MIDI playback finished. Events processed: %lu, up to %lu us late\n", event_count, late_us);
     play = false;
 }
 
+void Player::play_note(uint8_t status, uint8_t note, uint8_t velocity)
+{
+    LOG_TRACE("  NOTE %s: note=%u, velocity=%u, channel=%u\n",
+              velocity > 0 ? "ON" : "OFF", note, velocity, status & 0x0F);
+
+    // Register the output only on note on event
+    if (velocity > 0)
+    {
+        note_name = getNoteName(note);
+        pitch = velocity;
+    }
+
+    // The routing table decides which coil plays the channel
+    uint8_t output = transmitter_output(status);
+
+    if (polyphonic)
+    {
+        if (velocity > 0)
+            synth_note_on(output, status & 0x0F, note, velocity, envelope_for_channel(status));
+        else
+            synth_note_off(output, note);
+        return;
+    }
+
+    // Releasing the sounding note falls back to one still held
+    NoteAllocator *notes = &mono_notes[output];
+    if (velocity > 0)
+        notes->note_on(status & 0x0F, note, velocity);
+    else
+        notes->note_off(status & 0x0F, note);
+
+    uint8_t mono_note, mono_velocity;
+    if (notes->update(&mono_note, &mono_velocity))
+    {
+        // Pitch bend and glide follow the channel of the sounding note
+        if (mono_velocity > 0)
+            modulation_mono_note(output, notes->channel(), mono_note);
+
+        transmitt_music(output, mono_note, mono_velocity, envelope_for_channel(notes->channel()));
+    }
+}
+
+// Pitch wheel, the controllers of the modulation engine and program
+// changes, which pick the envelope of the channel
+void Player::play_control(uint8_t status, uint8_t data1, uint8_t data2)
+{
+    LOG_TRACE("  CONTROL 0x%02X: %u %u\n", status, data1, data2);
+
+    if ((status & 0xF0) == MIDI_PITCH_BEND)
+        modulation_pitch_bend(status & 0x0F, data1 | (data2 << 7));
+    else if ((status & 0xF0) == MIDI_PROGRAM_CHANGE)
+        envelope_program(status & 0x0F, data1);
+    else
+        modulation_control(status & 0x0F, data1, data2);
+}
+
+// Channel events play_control acts on, the rest is not cached
+bool Player::control_event(uint8_t status, uint8_t data1)
+{
+    return modulation_event(status, data1) || (status & 0xF0) == MIDI_PROGRAM_CHANGE;
+}
+
 const char *Player::getNoteName(uint8_t note_value)
 {
     if (note_value < 128)
@@ -585,23 +711,15 @@ void Player::resetPlayback(void)
     note_name = nullptr;
 
     resetFileSystem();
+    synth_stop();
     reset_transmitter();
 }
 
-void Player::cleanupTrackData(MidiTrack *track)
-{
-    if (track && track->data)
-    {
-        free(track->data);
-        track->data = nullptr;
-        track->length = 0;
-    }
-}
-
 void Player::resetFileSystem()
 {
     // Close Files and Directory
     f_close(&fil);
+    f_close(&cache_fil);
     f_closedir(&dir);
 
     // Unmount and remount card
@@ -609,9 +727,56 @@ void Player::resetFileSystem()
     f_mount(&fs, "0:", 1);
 }
 
-uint32_t Player::delta_to_ms(uint32_t delta)
+// Sleeps until the deadline in short slices so that stopping and pausing
+// stay responsive during long rests. The track streams are refilled a block
+// at a time while there is slack for it, so a card read never delays an
+// event that is due. Time spent paused moves the song start so the
+// following events keep their spacing. Returns false when stopped.
+bool Player::wait_until(absolute_time_t deadline)
 {
-    return (delta * current_tempo) / (time_division * 1000);
+    while (play == true)
+    {
+        if (paused)
+        {
+            absolute_time_t pause_start = get_absolute_time();
+
+            transmitt_off();
+            synth_all_off();
+            while (paused && play == true)
+                sleep_ms(10);
+
+            uint64_t paused_us = absolute_time_diff_us(pause_start, get_absolute_time());
+            sequencer.shift(paused_us);
+            deadline = delayed_by_us(deadline, paused_us);
+
+            // Held notes are still known in monophonic mode, bring the
+            // sounding ones back
+            for (int i = 0; i < TX_OUTPUTS && !polyphonic; i++)
+            {
+                uint8_t mono_note, mono_velocity;
+                if (mono_notes[i].current(&mono_note, &mono_velocity))
+                    transmitt_music(i, mono_note, mono_velocity, envelope_for_channel(mono_notes[i].channel()));
+            }
+            continue;
+        }
+
+        int64_t slack = absolute_time_diff_us(get_absolute_time(), deadline);
+        if (slack <= 0)
+        {
+            if ((uint64_t)-slack > late_us)
+                late_us = -slack;
+            return true;
+        }
+
+        // Only one of them is open, merged tracks or the event cache
+        if (slack > PLAYER_REFILL_SLACK_US && (merger.refill() || stream.refill()))
+            continue;
+
+        absolute_time_t slice_end = make_timeout_time_ms(10);
+        sleep_until(absolute_time_diff_us(slice_end, deadline) < 0 ? deadline : slice_end);
+    }
+
+    return false;
 }
 
 #endif
\ No newline at end of file
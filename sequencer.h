@@ -0,0 +1,106 @@
+#ifndef SEQUENCER_H
+#define SEQUENCER_H
+
+#include <pico/stdlib.h>
+
+#define DEFAULT_TEMPO 500000 // us per quarter note, 120bpm
+
+// Turns absolute tick positions into absolute deadlines. The song time of
+// the last tempo change is kept in 64-bit us and everything after it is
+// computed from there, so rounding never accumulates from event to event and
+// time spent decoding or logging is not added on top of the waits.
+class Sequencer
+{
+private:
+    absolute_time_t start_time;
+    uint32_t base_tick = 0; // Tick of the last tempo change
+    uint64_t base_us = 0;   // Song time at base_tick
+    uint64_t us_num = DEFAULT_TEMPO;
+    uint64_t us_den = 1;
+    bool smpte = false;
+
+public:
+    void begin(uint16_t);
+    void start();
+    void set_tempo(uint32_t, uint32_t);
+    void shift(uint64_t);
+    uint64_t tick_to_us(uint32_t);
+    absolute_time_t deadline(uint32_t);
+    absolute_time_t deadline_us(uint64_t);
+};
+
+void Sequencer::begin(uint16_t division)
+{
+    base_tick = 0;
+    base_us = 0;
+
+    if (division & 0x8000)
+    {
+        // SMPTE division: negative frames per second in the upper byte and
+        // ticks per frame in the lower one, tempo events do not apply
+        uint8_t fps = -(int8_t)(division >> 8);
+        uint8_t ticks_per_frame = division & 0xFF;
+
+        smpte = true;
+        if (fps == 29)
+        {
+            // 29.97 drop frame
+            us_num = 1001000000ULL;
+            us_den = 30000ULL * ticks_per_frame;
+        }
+        else
+        {
+            us_num = 1000000ULL;
+            us_den = (uint64_t)fps * ticks_per_frame;
+        }
+    }
+    else
+    {
+        smpte = false;
+        us_num = DEFAULT_TEMPO;
+        us_den = division;
+    }
+
+    if (us_den == 0)
+        us_den = 1;
+
+    start();
+}
+
+void Sequencer::start()
+{
+    start_time = get_absolute_time();
+}
+
+void Sequencer::set_tempo(uint32_t tick, uint32_t tempo)
+{
+    if (smpte)
+        return;
+
+    base_us = tick_to_us(tick);
+    base_tick = tick;
+    us_num = tempo;
+}
+
+// Moves the song start, used to skip the time spent paused
+void Sequencer::shift(uint64_t us)
+{
+    start_time = delayed_by_us(start_time, us);
+}
+
+uint64_t Sequencer::tick_to_us(uint32_t tick)
+{
+    return base_us + (uint64_t)(tick - base_tick) * us_num / us_den;
+}
+
+absolute_time_t Sequencer::deadline(uint32_t tick)
+{
+    return deadline_us(tick_to_us(tick));
+}
+
+absolute_time_t Sequencer::deadline_us(uint64_t song_us)
+{
+    return delayed_by_us(start_time, song_us);
+}
+
+#endif
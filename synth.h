@@ -0,0 +1,436 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <pico/stdlib.h>
+#include <pico/sync.h>
+#include <hardware/pio.h>
+#include <hardware/dma.h>
+#include <hardware/irq.h>
+#include <hardware/clocks.h>
+#include <hardware/gpio.h>
+#include "transmitter.h"
+#include "tc_pulse.pio.h"
+
+// Polyphonic output: every sounding note is a voice with its own period and
+// pulse width, and the pulses of the voices of an output are merged into the
+// one train its coil gets. The pulses themselves come from the tc_pulse PIO
+// program, fed by DMA from a schedule the synth plans one block ahead, so
+// the CPU does nothing per pulse. The PWM slices are only used for pot
+// control and monophonic playback.
+#define SYNTH_VOICES 6 // Per output
+
+#define SYNTH_MIN_GAP_US 100 // Off time enforced between two pulses
+#define SYNTH_MAX_SLIP_US 200 // A pulse pushed back further than this is dropped
+
+// Times and periods are kept in 1/16 us (note_period_table) so the pitch of
+// a voice does not suffer from rounding its period to whole microseconds.
+// The state machine runs at the same rate, so schedule words are 1/16 us too.
+#define SYNTH_FRAC_BITS 4
+#define SYNTH_SM_HZ (1000000 << SYNTH_FRAC_BITS)
+
+// The schedule is planned in blocks, a note change is heard within a few
+// blocks. Requests per block leave room for the densest pulse train.
+#define SYNTH_BLOCK_US 1000
+#define SYNTH_BLOCK_REQUESTS 16
+
+// Cycle counts of tc_pulse.pio
+#define TC_PULSE_RISE 7 // Start of a request to the pulse going on
+#define TC_PULSE_HIGH 3 // On time is 2 * on + TC_PULSE_HIGH
+
+// Longest on time the state machine lets through, in loop counts
+#define SYNTH_ON_CEILING ((MAX_PULSE_WIDTH * 16 - TC_PULSE_HIGH) / 2)
+
+typedef struct
+{
+    bool active;
+    uint8_t channel;
+    uint8_t note;
+    uint16_t on;          // 1/16 us, before the envelope
+    uint32_t base_period; // 1/16 us, as the note is written
+    uint32_t period;      // 1/16 us, after pitch modulation
+    uint64_t next;    // Next pulse of this voice, 1/16 us since boot
+    uint32_t started; // Age for voice stealing
+    Envelope envelope; // Timed in us on the planning timeline, cursor
+} SynthVoice;
+
+// Voices and pulse schedule of one output. Every output has its own state
+// machine running tc_pulse on its pins and its own DMA channel, the program
+// itself is loaded once.
+typedef struct
+{
+    TxOutput *tx;
+    SynthVoice voices[SYNTH_VOICES];
+
+    int sm;
+    int dma;
+    uint32_t blocks[2][SYNTH_BLOCK_REQUESTS * 2];
+    uint16_t block_words[2];
+    uint8_t playing_block; // Block the DMA is feeding
+
+    uint64_t cursor;  // Where the next request starts, 1/16 us since boot
+    uint64_t free_at; // Earliest start of the next pulse, 1/16 us
+} SynthOutput;
+
+SynthOutput synth_outputs[TX_OUTPUTS];
+critical_section_t synth_lock;
+
+PIO synth_pio = pio0;
+uint synth_offset;
+
+volatile bool synth_running = false;
+uint32_t synth_note_count = 0;
+
+void synth_init();
+void synth_start();
+void synth_stop();
+void synth_note_on(uint8_t, uint8_t, uint8_t, uint8_t, uint8_t);
+void synth_note_off(uint8_t, uint8_t);
+void synth_all_off();
+void synth_modulate(const uint32_t *);
+bool synth_notes_older(uint32_t, uint32_t);
+int synth_next_voice(SynthOutput *, uint64_t, uint64_t *);
+void synth_fill(SynthOutput *, uint8_t);
+void synth_play(SynthOutput *, uint8_t);
+void synth_dma_irq_handler();
+
+void synth_init()
+{
+    critical_section_init(&synth_lock);
+
+    synth_offset = pio_add_program(synth_pio, &tc_pulse_program);
+
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        SynthOutput *output = &synth_outputs[i];
+        output->tx = &tx_outputs[i];
+        output->sm = pio_claim_unused_sm(synth_pio, true);
+        output->dma = dma_claim_unused_channel(true);
+    }
+
+    // DMA_IRQ_0 is left to the SD card driver. Taken on core0, the core
+    // that enables it here.
+    irq_set_exclusive_handler(DMA_IRQ_1, synth_dma_irq_handler);
+    irq_set_enabled(DMA_IRQ_1, true);
+}
+
+// Hands the pins of every output over from their PWM slice to the synth
+void synth_start()
+{
+    critical_section_enter_blocking(&synth_lock);
+
+    float clkdiv = (float)clock_get_hz(clk_sys) / SYNTH_SM_HZ;
+
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        SynthOutput *output = &synth_outputs[i];
+
+        for (int j = 0; j < SYNTH_VOICES; j++)
+            output->voices[j].active = false;
+
+        tc_pulse_program_init(synth_pio, output->sm, synth_offset, output->tx->pin, clkdiv, SYNTH_ON_CEILING);
+
+        // Both blocks are planned before the state machine starts, it then
+        // always has one block in hand while the other is planned
+        output->cursor = time_us_64() << SYNTH_FRAC_BITS;
+        output->free_at = 0;
+        synth_fill(output, 0);
+        synth_fill(output, 1);
+    }
+
+    synth_running = true;
+
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        SynthOutput *output = &synth_outputs[i];
+
+        dma_channel_acknowledge_irq1(output->dma);
+        dma_channel_set_irq1_enabled(output->dma, true);
+        synth_play(output, 0);
+        pio_sm_set_enabled(synth_pio, output->sm, true);
+    }
+
+    critical_section_exit(&synth_lock);
+}
+
+void synth_stop()
+{
+    critical_section_enter_blocking(&synth_lock);
+
+    synth_running = false;
+
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        SynthOutput *output = &synth_outputs[i];
+
+        // Abort with the interrupt off, an abort can still raise it
+        dma_channel_set_irq1_enabled(output->dma, false);
+        dma_channel_abort(output->dma);
+        dma_channel_acknowledge_irq1(output->dma);
+
+        pio_sm_set_enabled(synth_pio, output->sm, false);
+        pio_sm_exec(synth_pio, output->sm, pio_encode_set(pio_pins, 0));
+        pio_sm_clear_fifos(synth_pio, output->sm);
+
+        for (int j = 0; j < SYNTH_VOICES; j++)
+            output->voices[j].active = false;
+
+        gpio_set_function(output->tx->pin, GPIO_FUNC_PWM);
+        gpio_set_function(output->tx->led, GPIO_FUNC_PWM);
+    }
+
+    critical_section_exit(&synth_lock);
+}
+
+void synth_note_on(uint8_t index, uint8_t channel, uint8_t note, uint8_t velocity, uint8_t envelope)
+{
+    // Same range as the monophonic path, C1-B5
+    if (note <= 23 || note >= 84 || velocity == 0 || velocity > 127)
+        return;
+
+    uint32_t period = note_period_table[note];
+    uint16_t on_us = velocity_width(velocity);
+
+    critical_section_enter_blocking(&synth_lock);
+
+    SynthOutput *output = &synth_outputs[index];
+    SynthVoice *voices = output->voices;
+
+    // Retrigger the voice already playing this note, else take a free one,
+    // else one fading out, else steal the one that has been playing longest
+    int slot = -1;
+    for (int i = 0; i < SYNTH_VOICES && slot < 0; i++)
+    {
+        if (voices[i].active && voices[i].note == note)
+            slot = i;
+    }
+    for (int i = 0; i < SYNTH_VOICES && slot < 0; i++)
+    {
+        if (!voices[i].active)
+            slot = i;
+    }
+    for (int i = 0; i < SYNTH_VOICES && slot < 0; i++)
+    {
+        if (voices[i].envelope.released)
+            slot = i;
+    }
+    if (slot < 0)
+    {
+        slot = 0;
+        for (int i = 1; i < SYNTH_VOICES; i++)
+        {
+            if (synth_notes_older(voices[i].started, voices[slot].started))
+                slot = i;
+        }
+    }
+
+    // The first pulse goes into the next block that is planned
+    SynthVoice *voice = &voices[slot];
+    voice->active = true;
+    voice->channel = channel & 0x0F;
+    voice->note = note;
+    voice->on = on_us << SYNTH_FRAC_BITS;
+    voice->base_period = period;
+    voice->period = period;
+    voice->next = output->cursor;
+    voice->started = synth_note_count++;
+    envelope_start(&voice->envelope, envelope, (uint32_t)(output->cursor >> SYNTH_FRAC_BITS));
+
+    critical_section_exit(&synth_lock);
+}
+
+// The voice fades out over the release of its envelope, synth_fill frees
+// it once that is over
+void synth_note_off(uint8_t index, uint8_t note)
+{
+    critical_section_enter_blocking(&synth_lock);
+
+    SynthOutput *output = &synth_outputs[index];
+
+    for (int i = 0; i < SYNTH_VOICES; i++)
+    {
+        SynthVoice *voice = &output->voices[i];
+        if (!voice->active || voice->note != note)
+            continue;
+
+        if (envelope_profiles[voice->envelope.profile].release_us > 0)
+            envelope_release(&voice->envelope, (uint32_t)(output->cursor >> SYNTH_FRAC_BITS));
+        else
+            voice->active = false;
+    }
+
+    critical_section_exit(&synth_lock);
+}
+
+void synth_all_off()
+{
+    critical_section_enter_blocking(&synth_lock);
+
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        for (int j = 0; j < SYNTH_VOICES; j++)
+            synth_outputs[i].voices[j].active = false;
+    }
+
+    critical_section_exit(&synth_lock);
+}
+
+// Applies the period multipliers (16.16) of every MIDI channel to the voices
+// playing on it. The phase of a voice is kept, only the spacing of its
+// following pulses changes.
+void synth_modulate(const uint32_t *channel_scales)
+{
+    critical_section_enter_blocking(&synth_lock);
+
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        for (int j = 0; j < SYNTH_VOICES; j++)
+        {
+            SynthVoice *voice = &synth_outputs[i].voices[j];
+            if (voice->active)
+                voice->period = ((uint64_t)voice->base_period * channel_scales[voice->channel]) >> 16;
+        }
+    }
+
+    critical_section_exit(&synth_lock);
+}
+
+bool synth_notes_older(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
+// Picks the voice whose pulse is due first, starting no earlier than
+// `earliest`. Voice phases always advance by whole periods, so a pulse that
+// has to be dropped on a collision does not detune its voice.
+int synth_next_voice(SynthOutput *output, uint64_t earliest, uint64_t *rise)
+{
+    const uint64_t max_slip = (uint64_t)SYNTH_MAX_SLIP_US << SYNTH_FRAC_BITS;
+    SynthVoice *voices = output->voices;
+    int next_voice = -1;
+
+    for (int i = 0; i < SYNTH_VOICES; i++)
+    {
+        SynthVoice *voice = &voices[i];
+        if (!voice->active)
+            continue;
+
+        while (voice->next + max_slip < earliest)
+            voice->next += voice->period;
+
+        if (next_voice < 0 || voice->next < voices[next_voice].next)
+            next_voice = i;
+    }
+
+    if (next_voice >= 0)
+        *rise = voices[next_voice].next > earliest ? voices[next_voice].next : earliest;
+
+    return next_voice;
+}
+
+// Plans the next SYNTH_BLOCK_US of pulses of an output into a block as
+// tc_pulse requests. A wait fills the rest of the block, so the state
+// machine never runs dry and its timeline stays in step with the cursor.
+// Must be called with synth_lock held.
+void synth_fill(SynthOutput *output, uint8_t index)
+{
+    uint32_t *words = output->blocks[index];
+    uint16_t count = 0;
+    uint64_t block_end = output->cursor + ((uint64_t)SYNTH_BLOCK_US << SYNTH_FRAC_BITS);
+
+    // One request is kept for the closing wait
+    while (count < (SYNTH_BLOCK_REQUESTS - 1) * 2)
+    {
+        uint64_t earliest = output->cursor + TC_PULSE_RISE;
+        uint64_t rise;
+
+        if (output->free_at > earliest)
+            earliest = output->free_at;
+
+        int next_voice = synth_next_voice(output, earliest, &rise);
+        if (next_voice < 0 || rise >= block_end)
+            break;
+
+        SynthVoice *voice = &output->voices[next_voice];
+        uint32_t rise_us = (uint32_t)(rise >> SYNTH_FRAC_BITS);
+
+        if (envelope_done(&voice->envelope, rise_us))
+        {
+            voice->active = false;
+            continue;
+        }
+
+        // Width follows the envelope, then the duty governor of the output
+        // may shorten the pulse or drop it. The voice keeps its phase either
+        // way.
+        uint32_t on_us = (voice->on >> SYNTH_FRAC_BITS) * envelope_level(&voice->envelope, rise_us) / ENVELOPE_FULL;
+        if (on_us >= MIN_PULSE_WIDTH)
+            on_us = governor_pulse(output->tx, rise >> SYNTH_FRAC_BITS, on_us);
+        else
+            on_us = 0;
+
+        if (on_us == 0)
+        {
+            voice->next += voice->period;
+            continue;
+        }
+
+        uint32_t on = ((on_us << SYNTH_FRAC_BITS) - TC_PULSE_HIGH) / 2;
+        uint64_t fall = rise + 2 * on + TC_PULSE_HIGH;
+
+        words[count++] = (uint32_t)(rise - output->cursor - TC_PULSE_RISE);
+        words[count++] = on;
+
+        output->cursor = fall + 1;
+        output->free_at = fall + ((uint64_t)SYNTH_MIN_GAP_US << SYNTH_FRAC_BITS);
+        voice->next += voice->period;
+    }
+
+    if (block_end >= output->cursor + TC_PULSE_RISE)
+    {
+        words[count++] = (uint32_t)(block_end - output->cursor - TC_PULSE_RISE);
+        words[count++] = 0;
+        output->cursor = block_end;
+    }
+
+    output->block_words[index] = count;
+}
+
+void synth_play(SynthOutput *output, uint8_t index)
+{
+    dma_channel_config config = dma_channel_get_default_config(output->dma);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, true);
+    channel_config_set_write_increment(&config, false);
+    channel_config_set_dreq(&config, pio_get_dreq(synth_pio, output->sm, true));
+
+    output->playing_block = index;
+    dma_channel_configure(output->dma, &config, &synth_pio->txf[output->sm], output->blocks[index],
+                          output->block_words[index], true);
+}
+
+// A block of an output is fully in its FIFO: start the other one and plan
+// the next block into the one just sent
+void synth_dma_irq_handler()
+{
+    critical_section_enter_blocking(&synth_lock);
+
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        SynthOutput *output = &synth_outputs[i];
+        if (!dma_channel_get_irq1_status(output->dma))
+            continue;
+
+        dma_channel_acknowledge_irq1(output->dma);
+
+        if (synth_running)
+        {
+            uint8_t sent = output->playing_block;
+            synth_play(output, sent ^ 1);
+            synth_fill(output, sent);
+        }
+    }
+
+    critical_section_exit(&synth_lock);
+}
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef F_UTIL_H
+#define F_UTIL_H
+
+// Nothing the host tests need
+
+#endif
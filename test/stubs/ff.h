@@ -0,0 +1,193 @@
+#ifndef FF_H
+#define FF_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "pico/stdlib.h"
+
+// FatFs on an in-memory card. Reads take sim_sd_read_us of simulated time
+// per started 512 byte sector, so tests can see where the firmware blocks
+// on the card.
+
+typedef unsigned int UINT;
+typedef uint32_t DWORD;
+typedef uint16_t WORD;
+typedef uint8_t BYTE;
+typedef DWORD FSIZE_t;
+typedef char TCHAR;
+
+typedef enum
+{
+    FR_OK = 0,
+    FR_DISK_ERR,
+    FR_INT_ERR,
+    FR_NOT_READY,
+    FR_NO_FILE,
+    FR_WRITE_PROTECTED
+} FRESULT;
+
+#define AM_DIR 0x10
+#define FA_READ 0x01
+#define FA_WRITE 0x02
+#define FA_OPEN_EXISTING 0x00
+#define FA_CREATE_ALWAYS 0x08
+#define FF_MAX_LFN 255
+
+typedef struct
+{
+    int mounted;
+} FATFS;
+
+typedef struct
+{
+    size_t index;
+} DIR;
+
+typedef struct
+{
+    std::string *data;
+    FSIZE_t fptr;
+} FIL;
+
+typedef struct
+{
+    FSIZE_t fsize;
+    WORD fdate;
+    WORD ftime;
+    BYTE fattrib;
+    TCHAR fname[FF_MAX_LFN + 1];
+} FILINFO;
+
+inline std::map<std::string, std::string> sim_files;
+inline uint64_t sim_sd_read_us = 0;
+inline uint64_t sim_sd_reads = 0; // Sectors read
+inline bool sim_sd_write_protected = false;
+
+static inline std::string sim_file_name(const TCHAR *path)
+{
+    std::string name = path;
+    if (name.rfind("0:/", 0) == 0)
+        name = name.substr(3);
+    return name;
+}
+
+static inline FRESULT f_mount(FATFS *fs, const TCHAR *, BYTE)
+{
+    fs->mounted = 1;
+    return FR_OK;
+}
+static inline FRESULT f_unmount(const TCHAR *) { return FR_OK; }
+
+static inline FRESULT f_opendir(DIR *dir, const TCHAR *)
+{
+    dir->index = 0;
+    return FR_OK;
+}
+static inline FRESULT f_closedir(DIR *) { return FR_OK; }
+
+static inline FRESULT f_stat(const TCHAR *path, FILINFO *info)
+{
+    auto file = sim_files.find(sim_file_name(path));
+    if (file == sim_files.end())
+        return FR_NO_FILE;
+
+    info->fsize = file->second.size();
+    info->fdate = 0;
+    info->ftime = 0;
+    info->fattrib = 0;
+    snprintf(info->fname, sizeof(info->fname), "%s", file->first.c_str());
+    return FR_OK;
+}
+
+// A null info rewinds the directory
+static inline FRESULT f_readdir(DIR *dir, FILINFO *info)
+{
+    if (info == nullptr)
+    {
+        dir->index = 0;
+        return FR_OK;
+    }
+
+    auto file = sim_files.begin();
+    std::advance(file, std::min(dir->index, sim_files.size()));
+    if (file == sim_files.end())
+    {
+        info->fname[0] = 0;
+        return FR_OK;
+    }
+
+    dir->index++;
+    return f_stat(file->first.c_str(), info);
+}
+
+static inline FRESULT f_open(FIL *fil, const TCHAR *path, BYTE mode)
+{
+    std::string name = sim_file_name(path);
+    auto file = sim_files.find(name);
+
+    if ((mode & (FA_WRITE | FA_CREATE_ALWAYS)) && sim_sd_write_protected)
+        return FR_WRITE_PROTECTED;
+    if (mode & FA_CREATE_ALWAYS)
+        file = sim_files.insert_or_assign(name, std::string()).first;
+    else if (file == sim_files.end())
+        return FR_NO_FILE;
+
+    fil->data = &file->second;
+    fil->fptr = 0;
+    return FR_OK;
+}
+
+static inline FRESULT f_close(FIL *fil)
+{
+    fil->data = nullptr;
+    return FR_OK;
+}
+
+static inline FRESULT f_read(FIL *fil, void *buffer, UINT size, UINT *read)
+{
+    FSIZE_t length = fil->data->size();
+    UINT count = fil->fptr >= length ? 0 : std::min<FSIZE_t>(size, length - fil->fptr);
+
+    memcpy(buffer, fil->data->data() + fil->fptr, count);
+    fil->fptr += count;
+    *read = count;
+
+    uint64_t sectors = (count + 511) / 512;
+    sim_sd_reads += sectors;
+    if (sim_sd_read_us > 0)
+        sim_advance_us(sectors * sim_sd_read_us);
+    return FR_OK;
+}
+
+static inline FRESULT f_write(FIL *fil, const void *buffer, UINT size, UINT *written)
+{
+    if (fil->data->size() < fil->fptr + size)
+        fil->data->resize(fil->fptr + size);
+
+    memcpy(&(*fil->data)[fil->fptr], buffer, size);
+    fil->fptr += size;
+    *written = size;
+    return FR_OK;
+}
+
+static inline FRESULT f_lseek(FIL *fil, FSIZE_t offset)
+{
+    fil->fptr = offset;
+    return FR_OK;
+}
+
+static inline FRESULT f_unlink(const TCHAR *path)
+{
+    return sim_files.erase(sim_file_name(path)) ? FR_OK : FR_NO_FILE;
+}
+
+static inline FRESULT f_sync(FIL *) { return FR_OK; }
+static inline FSIZE_t f_tell(FIL *fil) { return fil->fptr; }
+static inline FSIZE_t f_size(FIL *fil) { return fil->data->size(); }
+static inline int f_eof(FIL *fil) { return fil->fptr >= fil->data->size(); }
+
+static inline bool sd_init_driver() { return true; }
+static inline const char *FRESULT_str(FRESULT) { return "FR"; }
+
+#endif
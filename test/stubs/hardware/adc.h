@@ -0,0 +1,22 @@
+#ifndef HARDWARE_ADC_H
+#define HARDWARE_ADC_H
+
+#include "pico/stdlib.h"
+
+typedef struct
+{
+    volatile uint32_t fifo;
+} adc_hw_t;
+
+inline adc_hw_t sim_adc_hw;
+#define adc_hw (&sim_adc_hw)
+
+static inline void adc_init() {}
+static inline void adc_gpio_init(uint) {}
+static inline void adc_select_input(uint) {}
+static inline void adc_set_round_robin(uint) {}
+static inline void adc_fifo_setup(bool, bool, uint, bool, bool) {}
+static inline void adc_set_clkdiv(float) {}
+static inline void adc_run(bool) {}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef HARDWARE_DMA_H
+#define HARDWARE_DMA_H
+
+#include "pico/stdlib.h"
+
+// DMA channels only keep what they were last given, transfers are up to
+// the tests
+
+#define SIM_DMA_CHANNELS 12
+
+typedef struct
+{
+    uint32_t ctrl;
+} dma_channel_config;
+
+enum dma_channel_transfer_size
+{
+    DMA_SIZE_8 = 0,
+    DMA_SIZE_16 = 1,
+    DMA_SIZE_32 = 2
+};
+
+#define DREQ_ADC 36
+
+typedef struct
+{
+    volatile void *write;
+    const volatile void *read;
+    uint32_t count;
+    bool busy;
+    bool irq1_enabled;
+    bool irq1_status;
+} SimDmaChannel;
+
+inline SimDmaChannel sim_dma[SIM_DMA_CHANNELS];
+
+typedef struct
+{
+    struct
+    {
+        volatile uint32_t al3_read_addr_trig;
+    } ch[SIM_DMA_CHANNELS];
+} dma_hw_t;
+
+inline dma_hw_t sim_dma_hw;
+#define dma_hw (&sim_dma_hw)
+inline uint16_t sim_dma_claimed = 0;
+
+static inline int dma_claim_unused_channel(bool)
+{
+    int channel = __builtin_ctz(~(uint32_t)sim_dma_claimed);
+    sim_dma_claimed |= 1u << channel;
+    return channel;
+}
+
+static inline dma_channel_config dma_channel_get_default_config(uint) { return {0}; }
+static inline dma_channel_config dma_get_channel_config(uint) { return {0}; }
+static inline void channel_config_set_transfer_data_size(dma_channel_config *, enum dma_channel_transfer_size) {}
+static inline void channel_config_set_read_increment(dma_channel_config *, bool) {}
+static inline void channel_config_set_write_increment(dma_channel_config *, bool) {}
+static inline void channel_config_set_dreq(dma_channel_config *, uint) {}
+static inline void channel_config_set_ring(dma_channel_config *, bool, uint) {}
+static inline void channel_config_set_chain_to(dma_channel_config *, uint) {}
+
+static inline void dma_channel_configure(uint channel, const dma_channel_config *, volatile void *write,
+                                         const volatile void *read, uint32_t count, bool start)
+{
+    sim_dma[channel].write = write;
+    sim_dma[channel].read = read;
+    sim_dma[channel].count = count;
+    sim_dma[channel].busy = start;
+}
+
+static inline void dma_channel_set_config(uint, const dma_channel_config *, bool) {}
+static inline void dma_channel_set_trans_count(uint channel, uint32_t count, bool start)
+{
+    sim_dma[channel].count = count;
+    sim_dma[channel].busy = start;
+}
+static inline void dma_channel_start(uint channel) { sim_dma[channel].busy = true; }
+static inline void dma_channel_abort(uint channel) { sim_dma[channel].busy = false; }
+static inline bool dma_channel_is_busy(uint channel) { return sim_dma[channel].busy; }
+static inline void dma_channel_set_irq1_enabled(uint channel, bool enabled) { sim_dma[channel].irq1_enabled = enabled; }
+static inline bool dma_channel_get_irq1_status(uint channel) { return sim_dma[channel].irq1_status; }
+static inline void dma_channel_acknowledge_irq1(uint channel) { sim_dma[channel].irq1_status = false; }
+
+#endif
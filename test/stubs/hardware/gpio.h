@@ -0,0 +1,6 @@
+#ifndef HARDWARE_GPIO_H
+#define HARDWARE_GPIO_H
+
+#include "pico/stdlib.h"
+
+#endif
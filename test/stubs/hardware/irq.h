@@ -0,0 +1,20 @@
+#ifndef HARDWARE_IRQ_H
+#define HARDWARE_IRQ_H
+
+#include "pico/stdlib.h"
+
+typedef sim_irq_handler_t irq_handler_t;
+
+#define DMA_IRQ_0 11
+#define DMA_IRQ_1 12
+
+static inline void irq_set_exclusive_handler(uint irq, irq_handler_t handler) { sim_irq_handlers[irq] = handler; }
+
+static inline void irq_set_enabled(uint irq, bool enabled)
+{
+    sim_irq_enabled[irq] = enabled;
+    if (irq == SIM_PWM_IRQ)
+        sim_pwm_dispatch();
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef HARDWARE_PIO_H
+#define HARDWARE_PIO_H
+
+#include "pico/stdlib.h"
+
+// Enough of a PIO block for synth.h to set up its state machines. The tests
+// that care about what the state machine does run tc_pulse.pio themselves.
+
+typedef struct
+{
+    volatile uint32_t txf[4];
+    bool enabled[4];
+    uint8_t claimed;
+} pio_hw_t;
+
+typedef pio_hw_t *PIO;
+
+typedef struct
+{
+    const uint16_t *instructions;
+    uint8_t length;
+    int8_t origin;
+} pio_program_t;
+
+typedef struct
+{
+    uint32_t offset;
+} pio_sm_config;
+
+enum pio_src_dest
+{
+    pio_pins = 0,
+    pio_x = 1,
+    pio_y = 2,
+    pio_isr = 6,
+    pio_osr = 7
+};
+
+inline pio_hw_t sim_pio[2];
+#define pio0 (&sim_pio[0])
+#define pio1 (&sim_pio[1])
+
+static inline uint pio_add_program(PIO, const pio_program_t *) { return 0; }
+
+static inline uint pio_claim_unused_sm(PIO pio, bool)
+{
+    uint sm = __builtin_ctz(~(uint32_t)pio->claimed);
+    pio->claimed |= 1u << sm;
+    return sm;
+}
+
+static inline void pio_sm_set_enabled(PIO pio, uint sm, bool enabled) { pio->enabled[sm] = enabled; }
+static inline void pio_sm_exec(PIO, uint, uint) {}
+static inline void pio_sm_clear_fifos(PIO, uint) {}
+static inline void pio_sm_put(PIO pio, uint sm, uint32_t data) { pio->txf[sm] = data; }
+static inline void pio_sm_init(PIO, uint, uint, const pio_sm_config *) {}
+static inline void pio_sm_set_pins_with_mask(PIO, uint, uint32_t, uint32_t) {}
+static inline void pio_sm_set_consecutive_pindirs(PIO, uint, uint, uint, bool) {}
+static inline void pio_gpio_init(PIO pio, uint pin) { sim_gpio_functions[pin] = pio == pio0 ? 6 : 7; }
+static inline uint pio_get_dreq(PIO, uint sm, bool) { return sm; }
+static inline uint pio_encode_set(enum pio_src_dest, uint value) { return 0xE000 | value; }
+static inline uint pio_encode_pull(bool, bool) { return 0x80A0; }
+static inline uint pio_encode_mov(enum pio_src_dest, enum pio_src_dest) { return 0xA000; }
+static inline void sm_config_set_set_pins(pio_sm_config *, uint, uint) {}
+static inline void sm_config_set_clkdiv(pio_sm_config *, float) {}
+
+#endif
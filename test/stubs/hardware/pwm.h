@@ -0,0 +1,130 @@
+#ifndef HARDWARE_PWM_H
+#define HARDWARE_PWM_H
+
+#include "pico/stdlib.h"
+
+// PWM slices of the simulator. Register writes bring the slice up to the
+// current time first, so a write lands between the right two ticks.
+
+typedef struct
+{
+    uint16_t divider16;
+    uint16_t top;
+} pwm_config;
+
+#define pwm_hw (&sim_pwm_hw)
+#define PWM_IRQ_WRAP SIM_PWM_IRQ
+
+static inline uint pwm_gpio_to_slice_num(uint gpio) { return (gpio >> 1) & 7; }
+static inline uint pwm_gpio_to_channel(uint gpio) { return gpio & 1; }
+
+static inline pwm_config pwm_get_default_config() { return {16, 0xFFFF}; }
+static inline void pwm_config_set_clkdiv(pwm_config *config, float divider) { config->divider16 = (uint16_t)(divider * 16); }
+static inline void pwm_config_set_wrap(pwm_config *config, uint16_t wrap) { config->top = wrap; }
+
+static inline void pwm_set_enabled(uint slice, bool enabled)
+{
+    sim_register_access();
+    SimPwmSlice *s = &sim_pwm[slice];
+    sim_pwm_sync(s);
+    s->enabled = enabled;
+    s->counter_ps = sim_now_ps;
+    if (enabled)
+        sim_pwm_hw.en |= 1u << slice;
+    else
+        sim_pwm_hw.en &= ~(1u << slice);
+}
+
+static inline void pwm_init(uint slice, pwm_config *config, bool start)
+{
+    SimPwmSlice *s = &sim_pwm[slice];
+    pwm_set_enabled(slice, false);
+    s->divider16 = config->divider16;
+    s->top_buffer = config->top;
+    s->cc_buffer[0] = s->cc_buffer[1] = 0;
+    s->counter = 0;
+    sim_pwm_latch_if_stopped(s);
+    pwm_set_enabled(slice, start);
+}
+
+static inline void pwm_set_wrap(uint slice, uint16_t wrap)
+{
+    sim_register_access();
+    SimPwmSlice *s = &sim_pwm[slice];
+    sim_pwm_sync(s);
+    s->top_buffer = wrap;
+    sim_pwm_latch_if_stopped(s);
+}
+
+static inline void pwm_set_chan_level(uint slice, uint channel, uint16_t level)
+{
+    sim_register_access();
+    SimPwmSlice *s = &sim_pwm[slice];
+    sim_pwm_sync(s);
+    s->cc_buffer[channel] = level;
+    sim_pwm_latch_if_stopped(s);
+}
+
+static inline void pwm_set_counter(uint slice, uint16_t counter)
+{
+    sim_register_access();
+    SimPwmSlice *s = &sim_pwm[slice];
+    sim_pwm_sync(s);
+    s->counter = counter;
+    s->counter_ps = sim_now_ps;
+    sim_pwm_compare(s, sim_now_ps);
+}
+
+static inline uint16_t pwm_get_counter(uint slice)
+{
+    sim_register_access();
+    SimPwmSlice *s = &sim_pwm[slice];
+    sim_pwm_sync(s);
+    return (uint16_t)s->counter;
+}
+
+// The divider is not buffered, it applies from the next tick
+static inline void pwm_set_clkdiv_int_frac(uint slice, uint8_t integer, uint8_t fract)
+{
+    sim_register_access();
+    SimPwmSlice *s = &sim_pwm[slice];
+    sim_pwm_sync(s);
+    s->divider16 = (uint16_t)(integer << 4 | fract);
+}
+
+static inline void pwm_clear_irq(uint slice)
+{
+    sim_pwm_hw.intr &= ~(1u << slice);
+    sim_pwm_update_ints();
+}
+
+static inline void pwm_set_irq_enabled(uint slice, bool enabled)
+{
+    if (enabled)
+        sim_pwm_hw.inte |= 1u << slice;
+    else
+        sim_pwm_hw.inte &= ~(1u << slice);
+    sim_pwm_update_ints();
+    sim_pwm_dispatch();
+}
+
+static inline void pwm_force_irq(uint slice)
+{
+    sim_pwm_hw.intf |= 1u << slice;
+    sim_pwm_update_ints();
+    sim_pwm_dispatch();
+}
+
+static inline void hw_clear_bits(volatile uint32_t *address, uint32_t mask)
+{
+    *address &= ~mask;
+    sim_pwm_update_ints();
+}
+
+static inline void hw_set_bits(volatile uint32_t *address, uint32_t mask)
+{
+    *address |= mask;
+    sim_pwm_update_ints();
+}
+
+#endif
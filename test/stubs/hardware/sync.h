@@ -0,0 +1,6 @@
+#ifndef HARDWARE_SYNC_H
+#define HARDWARE_SYNC_H
+
+#include "pico/stdlib.h"
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef HARDWARE_TIMER_H
+#define HARDWARE_TIMER_H
+
+#include "pico/stdlib.h"
+
+#endif
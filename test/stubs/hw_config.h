@@ -0,0 +1,6 @@
+#ifndef HW_CONFIG_H
+#define HW_CONFIG_H
+
+// Nothing the host tests need
+
+#endif
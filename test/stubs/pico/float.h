@@ -0,0 +1,6 @@
+#ifndef PICO_FLOAT_H
+#define PICO_FLOAT_H
+
+#include "pico/stdlib.h"
+
+#endif
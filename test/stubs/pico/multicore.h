@@ -0,0 +1,8 @@
+#ifndef PICO_MULTICORE_H
+#define PICO_MULTICORE_H
+
+#include "pico/stdlib.h"
+
+static inline void multicore_launch_core1(void (*)(void)) {}
+
+#endif
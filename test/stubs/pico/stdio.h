@@ -0,0 +1,6 @@
+#ifndef PICO_STDIO_H
+#define PICO_STDIO_H
+
+#include "pico/stdlib.h"
+
+#endif
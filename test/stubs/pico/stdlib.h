@@ -0,0 +1,149 @@
+#ifndef PICO_STDLIB_H
+#define PICO_STDLIB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+
+// pico_stdlib on top of the simulator: time, sleeps, GPIO and the alarm
+// pool. Core 0 is the only core on the host unless a test says otherwise.
+
+typedef uint64_t absolute_time_t;
+typedef int32_t alarm_id_t;
+typedef sim_alarm_callback_t alarm_callback_t;
+typedef struct repeating_timer repeating_timer_t;
+typedef sim_repeating_callback_t repeating_timer_callback_t;
+typedef sim_gpio_callback_t gpio_irq_callback_t;
+
+#define GPIO_IN false
+#define GPIO_OUT true
+
+enum gpio_function
+{
+    GPIO_FUNC_SIO = 5,
+    GPIO_FUNC_PWM = SIM_GPIO_FUNC_PWM,
+    GPIO_FUNC_PIO0 = 6,
+    GPIO_FUNC_PIO1 = 7,
+    GPIO_FUNC_NULL = 0x1F
+};
+
+enum gpio_irq_level
+{
+    GPIO_IRQ_LEVEL_LOW = 1,
+    GPIO_IRQ_LEVEL_HIGH = 2,
+    GPIO_IRQ_EDGE_FALL = 4,
+    GPIO_IRQ_EDGE_RISE = 8
+};
+
+inline uint sim_core_num = 0;
+
+static inline uint64_t time_us_64() { return sim_now_us(); }
+static inline uint32_t time_us_32() { return (uint32_t)sim_now_us(); }
+static inline absolute_time_t get_absolute_time() { return sim_now_us(); }
+static inline absolute_time_t from_us_since_boot(uint64_t us) { return us; }
+static inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
+static inline uint32_t to_ms_since_boot(absolute_time_t t) { return (uint32_t)(t / 1000); }
+static inline absolute_time_t delayed_by_us(absolute_time_t t, uint64_t us) { return t + us; }
+static inline absolute_time_t delayed_by_ms(absolute_time_t t, uint32_t ms) { return t + (uint64_t)ms * 1000; }
+static inline absolute_time_t make_timeout_time_us(uint64_t us) { return sim_now_us() + us; }
+static inline absolute_time_t make_timeout_time_ms(uint32_t ms) { return sim_now_us() + (uint64_t)ms * 1000; }
+static inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) { return (int64_t)(to - from); }
+static inline bool time_reached(absolute_time_t t) { return sim_now_us() >= t; }
+
+static inline void sleep_until(absolute_time_t t)
+{
+    if (t * SIM_PS_PER_US > sim_now_ps)
+        sim_advance_to(t * SIM_PS_PER_US);
+}
+static inline void sleep_us(uint64_t us) { sim_advance_us(us); }
+static inline void sleep_ms(uint32_t ms) { sim_advance_us((uint64_t)ms * 1000); }
+static inline void busy_wait_us(uint64_t us) { sim_advance_us(us); }
+
+static inline void tight_loop_contents() { sim_busy(); }
+static inline void __dmb() {}
+static inline void __compiler_memory_barrier() {}
+static inline void __sev() {}
+static inline void __wfe() {}
+static inline void __wfi() {}
+static inline uint get_core_num() { return sim_core_num; }
+
+static inline uint32_t save_and_disable_interrupts()
+{
+    sim_irq_depth++;
+    return 0;
+}
+static inline void restore_interrupts(uint32_t) { sim_irq_depth--; }
+
+static inline bool stdio_init_all() { return true; }
+
+static inline void gpio_init(uint pin) { sim_gpio_functions[pin] = GPIO_FUNC_SIO; }
+static inline void gpio_set_dir(uint, bool) {}
+static inline void gpio_pull_up(uint) {}
+static inline void gpio_set_function(uint pin, enum gpio_function function) { sim_gpio_functions[pin] = function; }
+static inline bool gpio_get(uint pin)
+{
+    sim_register_access();
+    return sim_gpio_read(pin);
+}
+static inline void gpio_put(uint pin, bool value) { sim_gpio_write(1u << pin, (uint32_t)value << pin); }
+static inline void gpio_put_masked(uint32_t mask, uint32_t value) { sim_gpio_write(mask, value); }
+static inline void gpio_init_mask(uint32_t mask)
+{
+    for (uint pin = 0; pin < SIM_GPIO_COUNT; pin++)
+    {
+        if (mask & (1u << pin))
+            gpio_init(pin);
+    }
+}
+static inline void gpio_set_dir_out_masked(uint32_t) {}
+static inline void gpio_clr_mask(uint32_t mask) { gpio_put_masked(mask, 0); }
+static inline void gpio_set_mask(uint32_t mask) { gpio_put_masked(mask, mask); }
+
+static inline void gpio_set_irq_enabled(uint pin, uint32_t events, bool enabled)
+{
+    if (enabled)
+        sim_gpio_irq_events[pin] |= events;
+    else
+        sim_gpio_irq_events[pin] &= ~events;
+}
+static inline void gpio_set_irq_enabled_with_callback(uint pin, uint32_t events, bool enabled, gpio_irq_callback_t callback)
+{
+    sim_gpio_callback = callback;
+    gpio_set_irq_enabled(pin, events, enabled);
+}
+
+static inline alarm_id_t add_alarm_at(absolute_time_t t, alarm_callback_t callback, void *user_data, bool)
+{
+    return sim_add_alarm(t * SIM_PS_PER_US, false, (void *)callback, user_data, nullptr);
+}
+static inline alarm_id_t add_alarm_in_us(uint64_t us, alarm_callback_t callback, void *user_data, bool fire_if_past)
+{
+    return add_alarm_at(sim_now_us() + us, callback, user_data, fire_if_past);
+}
+static inline alarm_id_t add_alarm_in_ms(uint32_t ms, alarm_callback_t callback, void *user_data, bool fire_if_past)
+{
+    return add_alarm_in_us((uint64_t)ms * 1000, callback, user_data, fire_if_past);
+}
+static inline bool cancel_alarm(alarm_id_t id) { return sim_cancel_alarm(id); }
+
+// Negative delays are from one callback start to the next, as in the SDK
+static inline bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *timer)
+{
+    timer->delay_us = delay_us;
+    timer->user_data = user_data;
+    uint64_t first = delay_us < 0 ? -delay_us : delay_us;
+    timer->alarm_id = sim_add_alarm(sim_now_ps + first * SIM_PS_PER_US, true, (void *)callback, user_data, timer);
+    return true;
+}
+static inline bool add_repeating_timer_ms(int32_t delay_ms, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *timer)
+{
+    return add_repeating_timer_us((int64_t)delay_ms * 1000, callback, user_data, timer);
+}
+static inline bool cancel_repeating_timer(repeating_timer_t *timer) { return sim_cancel_alarm(timer->alarm_id); }
+
+#define count_of(a) (sizeof(a) / sizeof((a)[0]))
+#define __not_in_flash_func(f) f
+#define __time_critical_func(f) f
+
+#endif
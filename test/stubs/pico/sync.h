@@ -0,0 +1,24 @@
+#ifndef PICO_SYNC_H
+#define PICO_SYNC_H
+
+#include "pico/stdlib.h"
+
+// One simulated core, a critical section only has to keep interrupts out
+typedef struct
+{
+    int depth;
+} critical_section_t;
+
+static inline void critical_section_init(critical_section_t *section) { section->depth = 0; }
+static inline void critical_section_enter_blocking(critical_section_t *section)
+{
+    section->depth++;
+    sim_irq_depth++;
+}
+static inline void critical_section_exit(critical_section_t *section)
+{
+    section->depth--;
+    sim_irq_depth--;
+}
+
+#endif
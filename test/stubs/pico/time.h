@@ -0,0 +1,6 @@
+#ifndef PICO_TIME_H
+#define PICO_TIME_H
+
+#include "pico/stdlib.h"
+
+#endif
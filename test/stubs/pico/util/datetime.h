@@ -0,0 +1,4 @@
+#ifndef PICO_UTIL_DATETIME_H
+#define PICO_UTIL_DATETIME_H
+
+#endif
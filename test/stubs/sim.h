@@ -0,0 +1,432 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <vector>
+#include <algorithm>
+
+// Host stand-in for the parts of the RP2040 the firmware uses. Time is kept
+// in picoseconds and only moves when a test moves it, or when the firmware
+// busy waits (tight_loop_contents, sleeps). Alarms, repeating timers, GPIO
+// edge interrupts and PWM slices are simulated closely enough for the timing
+// checks of the tests: a slice counts, wraps, latches its double buffered
+// TOP and CC and raises its wrap interrupt, and every edge of its outputs
+// can be traced.
+
+typedef unsigned int uint;
+
+#define SIM_PS_PER_US 1000000ull
+#define SIM_GPIO_COUNT 30
+#define SIM_PWM_SLICES 8
+
+typedef struct
+{
+    uint64_t time_ps;
+    bool level;
+} SimEdge;
+
+// Every SIO write to output pins while sim_gpio_trace is on
+typedef struct
+{
+    uint64_t time_ps;
+    uint32_t mask;
+    uint32_t levels;
+} SimGpioWrite;
+
+typedef struct
+{
+    int32_t id;
+    uint64_t due_ps;
+    bool repeating;
+    void *callback; // alarm_callback_t or repeating_timer_callback_t
+    void *user_data;
+    void *timer;    // repeating_timer_t of repeating timers
+} SimAlarm;
+
+typedef struct
+{
+    bool enabled;
+    uint16_t divider16 = 16;
+    uint16_t top = 0xFFFF, top_buffer = 0xFFFF;
+    uint16_t cc[2] = {0, 0}, cc_buffer[2] = {0, 0};
+    uint32_t counter = 0;
+    uint64_t counter_ps = 0; // Time the counter took its value
+    bool level[2] = {false, false};
+    bool trace = false;
+    std::vector<SimEdge> edges[2];
+} SimPwmSlice;
+
+struct repeating_timer
+{
+    int64_t delay_us;
+    void *user_data;
+    int32_t alarm_id;
+};
+
+typedef int64_t (*sim_alarm_callback_t)(int32_t id, void *user_data);
+typedef bool (*sim_repeating_callback_t)(struct repeating_timer *timer);
+typedef void (*sim_irq_handler_t)(void);
+typedef void (*sim_gpio_callback_t)(uint gpio, uint32_t event_mask);
+
+inline uint32_t sim_clock_hz = 125000000;
+inline uint64_t sim_now_ps = 0;
+inline uint64_t sim_busy_step_ps = 100000; // One pass of a busy wait, 100 ns
+inline int sim_irq_depth = 0;              // Nested interrupt handlers running
+inline uint64_t sim_irq_latency_ps = 0;    // Alarm due to its callback running
+inline uint64_t sim_irq_jitter_ps = 0;     // Up to this much later again, differing from alarm to alarm
+inline uint64_t sim_register_ps = 0;       // Time one peripheral register access takes
+
+inline std::vector<SimAlarm> sim_alarms;
+inline int32_t sim_next_alarm_id = 1;
+
+inline bool sim_gpio_levels[SIM_GPIO_COUNT];
+inline int sim_gpio_functions[SIM_GPIO_COUNT];
+inline uint32_t sim_gpio_irq_events[SIM_GPIO_COUNT];
+inline sim_gpio_callback_t sim_gpio_callback = nullptr;
+inline bool sim_gpio_trace = false;
+inline std::vector<SimGpioWrite> sim_gpio_writes;
+
+inline SimPwmSlice sim_pwm[SIM_PWM_SLICES];
+inline sim_irq_handler_t sim_irq_handlers[32];
+inline bool sim_irq_enabled[32];
+
+struct sim_pwm_regs
+{
+    volatile uint32_t en, intr, inte, intf, ints;
+};
+inline sim_pwm_regs sim_pwm_hw;
+
+#define SIM_PWM_IRQ 4
+#define SIM_GPIO_FUNC_PWM 1
+
+void sim_advance_to(uint64_t);
+
+inline uint64_t sim_now_us() { return sim_now_ps / SIM_PS_PER_US; }
+
+// Length of one counter step of a slice
+inline uint64_t sim_pwm_tick_ps(const SimPwmSlice *slice)
+{
+    return (uint64_t)slice->divider16 * 1000000000000ull / ((uint64_t)sim_clock_hz * 16);
+}
+
+inline void sim_pwm_update_ints()
+{
+    sim_pwm_hw.ints = (sim_pwm_hw.intr | sim_pwm_hw.intf) & sim_pwm_hw.inte;
+}
+
+inline void sim_pwm_set_level(SimPwmSlice *slice, int channel, bool level, uint64_t when)
+{
+    if (slice->level[channel] == level)
+        return;
+
+    slice->level[channel] = level;
+    if (slice->trace)
+        slice->edges[channel].push_back({when, level});
+}
+
+// Output levels follow counter < CC
+inline void sim_pwm_compare(SimPwmSlice *slice, uint64_t when)
+{
+    for (int c = 0; c < 2; c++)
+        sim_pwm_set_level(slice, c, slice->counter < slice->cc[c], when);
+}
+
+// Counter of a slice brought up to the current time without processing
+// events, for reads and writes in between ticks
+inline void sim_pwm_sync(SimPwmSlice *slice)
+{
+    if (!slice->enabled)
+    {
+        slice->counter_ps = sim_now_ps;
+        return;
+    }
+
+    uint64_t tick = sim_pwm_tick_ps(slice);
+    uint64_t ticks = (sim_now_ps - slice->counter_ps) / tick;
+    slice->counter += ticks;
+    slice->counter_ps += ticks * tick;
+}
+
+// Buffered values take effect at once while the slice is stopped
+inline void sim_pwm_latch_if_stopped(SimPwmSlice *slice)
+{
+    if (slice->enabled)
+        return;
+
+    slice->top = slice->top_buffer;
+    slice->cc[0] = slice->cc_buffer[0];
+    slice->cc[1] = slice->cc_buffer[1];
+    sim_pwm_compare(slice, sim_now_ps);
+}
+
+// Time of the next compare match or wrap of a running slice
+inline uint64_t sim_pwm_next_event(const SimPwmSlice *slice)
+{
+    if (!slice->enabled)
+        return UINT64_MAX;
+
+    uint64_t tick = sim_pwm_tick_ps(slice);
+    uint32_t steps = slice->top + 1 - slice->counter; // To the wrap
+
+    if (slice->counter > slice->top)
+        steps = 0x10000 - slice->counter; // Counter was put above TOP, runs to 0xFFFF
+
+    for (int c = 0; c < 2; c++)
+    {
+        if (slice->cc[c] > slice->counter && slice->cc[c] - slice->counter < steps)
+            steps = slice->cc[c] - slice->counter;
+    }
+
+    return slice->counter_ps + (uint64_t)steps * tick;
+}
+
+inline void sim_pwm_event(int index, uint64_t when)
+{
+    SimPwmSlice *slice = &sim_pwm[index];
+    uint64_t tick = sim_pwm_tick_ps(slice);
+    uint32_t steps = (uint32_t)((when - slice->counter_ps) / tick);
+
+    slice->counter += steps;
+    slice->counter_ps = when;
+
+    bool wrapped = slice->counter > slice->top && slice->counter - steps <= slice->top;
+    if (slice->counter > 0xFFFF)
+        wrapped = true;
+
+    if (wrapped)
+    {
+        slice->counter = 0;
+        slice->top = slice->top_buffer;
+        slice->cc[0] = slice->cc_buffer[0];
+        slice->cc[1] = slice->cc_buffer[1];
+        sim_pwm_hw.intr |= 1u << index;
+        sim_pwm_update_ints();
+    }
+
+    sim_pwm_compare(slice, when);
+}
+
+// Runs the PWM wrap handler while any enabled slice interrupt is pending,
+// unless an interrupt handler is running already
+inline void sim_pwm_dispatch()
+{
+    if (sim_irq_depth > 0 || !sim_irq_enabled[SIM_PWM_IRQ] || sim_irq_handlers[SIM_PWM_IRQ] == nullptr)
+        return;
+
+    for (int guard = 0; guard < 16 && sim_pwm_hw.ints != 0; guard++)
+    {
+        sim_irq_depth++;
+        sim_irq_handlers[SIM_PWM_IRQ]();
+        sim_irq_depth--;
+    }
+}
+
+inline bool sim_alarm_due_first(const SimAlarm &a, const SimAlarm &b)
+{
+    return a.due_ps < b.due_ps || (a.due_ps == b.due_ps && a.id < b.id);
+}
+
+inline int32_t sim_add_alarm(uint64_t, bool, void *, void *, void *);
+
+// Runs a timer callback and reschedules it the way the pico alarm pool
+// does: a negative return counts from the time the alarm was due, a
+// positive one from the time the callback returned
+inline void sim_fire_alarm(SimAlarm alarm)
+{
+    sim_irq_depth++;
+
+    int64_t again;
+    if (alarm.repeating)
+    {
+        struct repeating_timer *timer = (struct repeating_timer *)alarm.timer;
+        again = ((sim_repeating_callback_t)alarm.callback)(timer) ? timer->delay_us : 0;
+    }
+    else
+    {
+        again = ((sim_alarm_callback_t)alarm.callback)(alarm.id, alarm.user_data);
+    }
+
+    sim_irq_depth--;
+
+    if (again == 0)
+        return;
+
+    uint64_t due = again < 0 ? alarm.due_ps + (uint64_t)-again * SIM_PS_PER_US : sim_now_ps + (uint64_t)again * SIM_PS_PER_US;
+    alarm.due_ps = due;
+    sim_alarms.push_back(alarm);
+}
+
+// Time an alarm's callback runs after it was due. The jitter part is the
+// same for the alarm every time it is looked at.
+inline uint64_t sim_alarm_late_ps(const SimAlarm &alarm)
+{
+    if (sim_irq_jitter_ps == 0)
+        return sim_irq_latency_ps;
+
+    uint64_t hash = alarm.due_ps * 0x9E3779B97F4A7C15ull ^ (uint64_t)alarm.id * 0xBF58476D1CE4E5B9ull;
+    hash ^= hash >> 31;
+    hash *= 0x94D049BB133111EBull;
+    hash ^= hash >> 29;
+    return sim_irq_latency_ps + hash % (sim_irq_jitter_ps + 1);
+}
+
+// Moves time forward, handling every alarm and PWM event on the way. Inside
+// an interrupt handler only the PWM slices move, interrupts wait.
+inline void sim_advance_to(uint64_t target_ps)
+{
+    while (true)
+    {
+        uint64_t next = UINT64_MAX;
+        int kind = -1; // 0..7 slice, 8 alarm
+
+        for (int i = 0; i < SIM_PWM_SLICES; i++)
+        {
+            uint64_t at = sim_pwm_next_event(&sim_pwm[i]);
+            if (at < next)
+            {
+                next = at;
+                kind = i;
+            }
+        }
+
+        // Alarms go first when they are due at the same time as a slice,
+        // their callbacks run sim_alarm_late_ps late
+        if (sim_irq_depth == 0 && !sim_alarms.empty())
+        {
+            auto due = std::min_element(sim_alarms.begin(), sim_alarms.end(), sim_alarm_due_first);
+            uint64_t runs = std::max(due->due_ps + sim_alarm_late_ps(*due), sim_now_ps);
+            if (runs <= next)
+            {
+                next = runs;
+                kind = 8;
+            }
+        }
+
+        if (kind < 0 || next > target_ps)
+            break;
+
+        if (next > sim_now_ps)
+            sim_now_ps = next;
+
+        if (kind < 8)
+        {
+            sim_pwm_event(kind, next);
+            sim_pwm_dispatch();
+            continue;
+        }
+
+        auto due = std::min_element(sim_alarms.begin(), sim_alarms.end(), sim_alarm_due_first);
+        SimAlarm alarm = *due;
+        sim_alarms.erase(due);
+        sim_fire_alarm(alarm);
+        sim_pwm_dispatch();
+    }
+
+    if (target_ps > sim_now_ps)
+        sim_now_ps = target_ps;
+
+    for (int i = 0; i < SIM_PWM_SLICES; i++)
+        sim_pwm_sync(&sim_pwm[i]);
+}
+
+inline void sim_advance_us(uint64_t us)
+{
+    sim_advance_to(sim_now_ps + us * SIM_PS_PER_US);
+}
+
+// Peripheral access from the firmware, time moves on by sim_register_ps so
+// an access can race a wrap
+inline void sim_register_access()
+{
+    if (sim_register_ps > 0)
+        sim_advance_to(sim_now_ps + sim_register_ps);
+}
+
+// One pass of a busy wait in the firmware
+inline void sim_busy()
+{
+    sim_advance_to(sim_now_ps + sim_busy_step_ps);
+}
+
+inline int32_t sim_add_alarm(uint64_t due_ps, bool repeating, void *callback, void *user_data, void *timer)
+{
+    SimAlarm alarm = {sim_next_alarm_id++, due_ps, repeating, callback, user_data, timer};
+    sim_alarms.push_back(alarm);
+    return alarm.id;
+}
+
+inline bool sim_cancel_alarm(int32_t id)
+{
+    for (size_t i = 0; i < sim_alarms.size(); i++)
+    {
+        if (sim_alarms[i].id == id)
+        {
+            sim_alarms.erase(sim_alarms.begin() + i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Drives an input pin, raising the GPIO interrupt on an enabled edge
+inline void sim_gpio_drive(uint pin, bool level)
+{
+    bool previous = sim_gpio_levels[pin];
+    sim_gpio_levels[pin] = level;
+
+    if (previous == level || sim_gpio_callback == nullptr)
+        return;
+
+    uint32_t event = level ? 8u : 4u; // GPIO_IRQ_EDGE_RISE, GPIO_IRQ_EDGE_FALL
+    if ((sim_gpio_irq_events[pin] & event) == 0)
+        return;
+
+    sim_irq_depth++;
+    sim_gpio_callback(pin, event);
+    sim_irq_depth--;
+}
+
+// Sets the output pins of a mask, as gpio_put and gpio_put_masked do
+inline void sim_gpio_write(uint32_t mask, uint32_t levels)
+{
+    for (uint pin = 0; pin < SIM_GPIO_COUNT; pin++)
+    {
+        if (mask & (1u << pin))
+            sim_gpio_levels[pin] = (levels >> pin) & 1;
+    }
+
+    if (sim_gpio_trace)
+        sim_gpio_writes.push_back({sim_now_ps, mask, levels & mask});
+}
+
+inline bool sim_gpio_read(uint pin)
+{
+    if (sim_gpio_functions[pin] == SIM_GPIO_FUNC_PWM)
+        return sim_pwm[(pin >> 1) & 7].level[pin & 1];
+    return sim_gpio_levels[pin];
+}
+
+// Back to power on, for tests that run several cases
+inline void sim_reset()
+{
+    sim_now_ps = 0;
+    sim_irq_depth = 0;
+    sim_irq_jitter_ps = 0;
+    sim_alarms.clear();
+    for (int i = 0; i < SIM_GPIO_COUNT; i++)
+    {
+        sim_gpio_levels[i] = false;
+        sim_gpio_functions[i] = 0;
+        sim_gpio_irq_events[i] = 0;
+    }
+    sim_gpio_callback = nullptr;
+    sim_gpio_trace = false;
+    sim_gpio_writes.clear();
+    for (int i = 0; i < SIM_PWM_SLICES; i++)
+        sim_pwm[i] = SimPwmSlice();
+    sim_pwm_hw.en = sim_pwm_hw.intr = sim_pwm_hw.inte = sim_pwm_hw.intf = sim_pwm_hw.ints = 0;
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef TC_PULSE_PIO_H
+#define TC_PULSE_PIO_H
+
+#include "hardware/pio.h"
+
+// Stand-in for the header pioasm generates, the program itself is read from
+// tc_pulse.pio by the tests that run it
+
+static const uint16_t tc_pulse_program_instructions[1] = {0};
+static const pio_program_t tc_pulse_program = {tc_pulse_program_instructions, 1, -1};
+
+inline uint32_t sim_tc_pulse_ceiling = 0;
+
+static inline void tc_pulse_program_init(PIO, uint, uint, uint pin, float, uint32_t ceiling)
+{
+    sim_gpio_functions[pin] = sim_gpio_functions[pin + 1] = 6;
+    sim_tc_pulse_ceiling = ceiling;
+}
+
+#endif
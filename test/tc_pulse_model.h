@@ -0,0 +1,41 @@
+#ifndef TC_PULSE_MODEL_H
+#define TC_PULSE_MODEL_H
+
+#include <stdint.h>
+#include <vector>
+#include "synth.h"
+
+// What tc_pulse.pio makes of a list of requests, by its documented cycle
+// counts (test_tc_pulse checks those against the program itself):
+//  - a request rises off + TC_PULSE_RISE cycles after it starts
+//  - stays on for 2 * on + TC_PULSE_HIGH, at most the ceiling allows
+//  - the next request starts a cycle after the fall
+//  - a request without on time only waits off + TC_PULSE_RISE
+
+typedef struct
+{
+    uint64_t rise; // State machine cycles
+    uint64_t fall;
+} Pulse;
+
+// Runs `count` words from `*start` on, which is left at the end of the
+// last request
+inline void tc_pulse_decode(const uint32_t *words, int count, uint64_t *start, std::vector<Pulse> *pulses)
+{
+    for (int i = 0; i + 1 < count; i += 2)
+    {
+        uint64_t rise = *start + words[i] + TC_PULSE_RISE;
+        if (words[i + 1] == 0)
+        {
+            *start = rise;
+            continue;
+        }
+
+        uint32_t on = words[i + 1] < SYNTH_ON_CEILING ? words[i + 1] : SYNTH_ON_CEILING;
+        uint64_t fall = rise + 2 * on + TC_PULSE_HIGH;
+        pulses->push_back({rise, fall});
+        *start = fall + 1;
+    }
+}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Checks for the host tests. A failed check prints where and why and the
+// test goes on, main returns test_result() so ctest sees the failures.
+
+inline int test_failures = 0;
+inline int test_checks = 0;
+
+#define CHECK(condition)                                                          \
+    do                                                                            \
+    {                                                                             \
+        test_checks++;                                                            \
+        if (!(condition))                                                         \
+        {                                                                         \
+            test_failures++;                                                      \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+        }                                                                         \
+    } while (0)
+
+// Like CHECK, with a printf style message for the values involved
+#define CHECK_MSG(condition, ...)                                                 \
+    do                                                                            \
+    {                                                                             \
+        test_checks++;                                                            \
+        if (!(condition))                                                         \
+        {                                                                         \
+            test_failures++;                                                      \
+            printf("%s:%d: CHECK(%s) failed: ", __FILE__, __LINE__, #condition);  \
+            printf(__VA_ARGS__);                                                  \
+            printf("\n");                                                         \
+        }                                                                         \
+    } while (0)
+
+#define CHECK_EQ(a, b) CHECK_MSG((a) == (b), "%lld != %lld", (long long)(a), (long long)(b))
+
+inline int test_result()
+{
+    printf("%d checks, %d failed\n", test_checks, test_failures);
+    return test_failures == 0 ? 0 : 1;
+}
+
+#endif
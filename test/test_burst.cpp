@@ -0,0 +1,92 @@
+// Burst patterns over every setting the pots can reach. Each pattern is run
+// through the tc_pulse model as the DMA loops it: the burst period comes out
+// as burst_build reports it, no request wraps around, the pulses inside a
+// burst are one pulse period apart, every burst is followed by at least
+// BURST_MIN_GAP_MS off, and the duty stays under the long governor window.
+
+#include "test.h"
+#include "burst.h"
+#include "tc_pulse_model.h"
+
+void check_pattern(uint8_t frequency_index, uint16_t width_us, uint16_t length_ms, uint16_t rate_hz)
+{
+    uint32_t pattern[BURST_WORDS];
+    uint32_t period_us = 0;
+    uint16_t pulses = burst_build(pattern, frequency_index, width_us, length_ms, rate_hz, &period_us);
+
+    // Two rounds, so the gap into the next burst is seen as well
+    std::vector<Pulse> train;
+    uint64_t start = 0;
+    tc_pulse_decode(pattern, BURST_WORDS, &start, &train);
+    uint64_t burst_period = start;
+    tc_pulse_decode(pattern, BURST_WORDS, &start, &train);
+
+    const uint64_t period = SYNTH_SM_HZ / frequency_table[frequency_index];
+    const uint64_t nominal = SYNTH_SM_HZ / rate_hz;
+    const uint64_t min_gap = ((uint64_t)BURST_MIN_GAP_MS * 1000) << SYNTH_FRAC_BITS;
+
+    for (int i = 0; i < BURST_WORDS; i++)
+        CHECK_MSG(pattern[i] < SYNTH_SM_HZ * 2, "%u Hz, %u us, %u ms at %u Hz: word %d is %u", frequency_table[frequency_index],
+                  width_us, length_ms, rate_hz, i, pattern[i]);
+
+    CHECK_MSG(pulses >= 1 && pulses <= BURST_MAX_PULSES, "%u pulses", pulses);
+    CHECK_EQ(train.size(), 2u * pulses);
+    CHECK_EQ(burst_period >> SYNTH_FRAC_BITS, period_us);
+
+    // At the rate asked for, unless not even one pulse period and the gap
+    // fit into it
+    if (nominal >= period + min_gap)
+        CHECK_EQ(burst_period, nominal);
+    else
+        CHECK_EQ(burst_period, period + min_gap);
+
+    for (size_t i = 1; i < train.size(); i++)
+    {
+        uint64_t spacing = train[i].rise - train[i - 1].rise;
+        if (i % pulses != 0)
+            CHECK_EQ(spacing, period);
+        else
+            CHECK_MSG(train[i].rise - train[i - 1].fall >= min_gap, "%u Hz at %u Hz: gap %llu", frequency_table[frequency_index],
+                      rate_hz, (unsigned long long)(train[i].rise - train[i - 1].fall));
+    }
+
+    // The first burst starts where the pattern does, pulse period and length
+    // as asked for when there is room
+    uint64_t on = 0;
+    for (uint16_t i = 0; i < pulses; i++)
+        on += train[i].fall - train[i].rise;
+    CHECK_MSG(on * 1000 <= burst_period * GOVERNOR_LONG_PERMILLE, "duty %llu permille",
+              (unsigned long long)(on * 1000 / burst_period));
+}
+
+int main()
+{
+    int patterns = 0;
+    int stretched = 0;
+
+    for (uint8_t index = 0; index < 18; index++)
+    {
+        for (uint16_t width_us = MIN_PULSE_WIDTH; width_us <= MAX_PULSE_WIDTH; width_us += 35)
+        {
+            for (uint16_t length_ms = BURST_MIN_MS; length_ms <= BURST_MAX_MS; length_ms++)
+            {
+                for (uint16_t rate_hz = BURST_MIN_HZ; rate_hz <= BURST_MAX_HZ; rate_hz++)
+                {
+                    check_pattern(index, width_us, length_ms, rate_hz);
+                    patterns++;
+
+                    uint32_t pattern[BURST_WORDS];
+                    uint32_t period_us;
+                    burst_build(pattern, index, width_us, length_ms, rate_hz, &period_us);
+                    if (period_us > 1000000u / rate_hz)
+                        stretched++;
+                }
+            }
+        }
+    }
+
+    printf("%d patterns, %d with a stretched burst period\n", patterns, stretched);
+    CHECK(stretched > 0);
+
+    return test_result();
+}
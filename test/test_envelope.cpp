@@ -0,0 +1,173 @@
+// Pulse widths of enveloped notes on the simulated slice. Every envelope is
+// played with a note off after its decay, and every pulse of the TX pin is
+// checked against the width a reference envelope asks for: the curve step
+// worked out in floating point from the time since note on or off, so a
+// phase that runs out of rate precision before its last step shows. A low
+// note with a release shorter than its period checks the output is silenced
+// when the envelope ends between two wraps.
+
+#include "test.h"
+#include "transmitter.h"
+
+#include <cmath>
+#include <vector>
+
+const uint8_t velocity = 127;
+
+// Window around the wrap a level was set at, the interrupt latency and
+// the register accesses of the step
+const uint64_t slack_us = 20;
+
+// How far the rates, rounded down, may fall behind, as a part of the time
+// into the phase. A tenth of a step at the end of the longest phase.
+const double rate_lag = 0.002;
+
+typedef struct
+{
+    uint64_t start_us;   // Note on
+    uint64_t release_us; // Note off as applied
+    uint8_t profile;
+} Played;
+
+// Curve step `elapsed` into a phase of `duration`, without the fixed point
+// rates of the firmware, `lag` behind
+uint32_t reference_step(uint64_t elapsed, uint32_t duration, double lag)
+{
+    uint32_t step = (uint32_t)floor((double)elapsed * (1.0 - lag) * ENVELOPE_STEPS / duration);
+    return step < ENVELOPE_STEPS ? step : ENVELOPE_STEPS - 1;
+}
+
+uint32_t reference_level(const Played *played, uint64_t now, double lag)
+{
+    const EnvelopeProfile *profile = &envelope_profiles[played->profile];
+
+    if (now >= played->release_us)
+    {
+        Played held = {played->start_us, UINT64_MAX, played->profile};
+        uint32_t from = reference_level(&held, played->release_us, lag);
+        uint64_t elapsed = now - played->release_us;
+        if (elapsed >= profile->release_us)
+            return 0;
+        return from * envelope_fall[reference_step(elapsed, profile->release_us, lag)] / ENVELOPE_FULL;
+    }
+
+    uint64_t elapsed = now - played->start_us;
+    if (elapsed < profile->attack_us)
+        return envelope_rise[reference_step(elapsed, profile->attack_us, lag)];
+    elapsed -= profile->attack_us;
+
+    if (elapsed < profile->decay_us)
+        return profile->sustain + (ENVELOPE_FULL - profile->sustain) *
+                                      envelope_fall[reference_step(elapsed, profile->decay_us, lag)] / ENVELOPE_FULL;
+
+    return profile->sustain;
+}
+
+uint32_t reference_width(const Played *played, uint64_t now, double lag)
+{
+    uint32_t width = velocity_width(velocity) * reference_level(played, now, lag) / ENVELOPE_FULL;
+    return width < MIN_PULSE_WIDTH ? 0 : width;
+}
+
+void start_test()
+{
+    sim_reset();
+    sim_irq_latency_ps = 5 * SIM_PS_PER_US;
+    for (int i = 0; i < 2; i++)
+    {
+        tx_outputs[0].queues[i].head = 0;
+        tx_outputs[0].queues[i].tail = 0;
+
+        DutyWindow *window = &tx_outputs[0].governor[i];
+        for (uint16_t j = 0; j < window->bucket_count; j++)
+            window->buckets[j] = 0;
+        window->total = 0;
+    }
+    transmitter_init();
+    sim_pwm[tx_outputs[0].slice].trace = true;
+    sim_advance_us(1000);
+}
+
+void test_profile(uint8_t profile, uint8_t note)
+{
+    const EnvelopeProfile *shape = &envelope_profiles[profile];
+    start_test();
+
+    Played played = {0, UINT64_MAX, profile};
+    transmitt_music(0, note, velocity, profile);
+    played.start_us = tx_outputs[0].envelope.start;
+
+    sim_advance_us(shape->attack_us + shape->decay_us + 200000);
+    transmitt_music(0, note, 0, profile);
+    sim_advance_us(20000);
+    played.release_us = tx_outputs[0].envelope.released ? tx_outputs[0].envelope.start : sim_now_us();
+    sim_advance_us(shape->release_us + 100000);
+
+    // The level for a pulse is set at the wrap a period before it rises
+    const uint64_t period_us = 1000000000ull / note_millihz_table[note];
+    const std::vector<SimEdge> &edges = sim_pwm[tx_outputs[0].slice].edges[pwm_gpio_to_channel(tx_outputs[0].pin)];
+
+    uint32_t pulses = 0;
+    uint32_t wrong = 0;
+    uint32_t last_step_pulses = 0;
+
+    for (size_t i = 0; i + 1 < edges.size(); i++)
+    {
+        if (!edges[i].level || edges[i + 1].level)
+            continue;
+
+        uint64_t rise_us = edges[i].time_ps / SIM_PS_PER_US;
+        double width = (double)(edges[i + 1].time_ps - edges[i].time_ps) / SIM_PS_PER_US;
+        pulses++;
+
+        // The first pulse was set by the note on itself
+        uint64_t set_us = played.start_us;
+        if (rise_us > played.start_us + period_us)
+            set_us = rise_us - period_us;
+
+        uint32_t early = reference_width(&played, set_us > played.start_us + slack_us ? set_us - slack_us : played.start_us, rate_lag);
+        uint32_t late = reference_width(&played, set_us + slack_us, 0);
+        double least = (early < late ? early : late) - 1.0;
+        double most = (early < late ? late : early) + 1.0;
+
+        if ((width < least || width > most) && wrong++ < 10)
+            printf("envelope %u note %u: %.2f us pulse at %llu us, expected %u to %u us\n", profile, note, width,
+                   (unsigned long long)rise_us, early, late);
+
+        // Pulses from the last step of the decay, before the sustain
+        uint64_t decay_end = played.start_us + shape->attack_us + shape->decay_us;
+        if (shape->decay_us > 0 && set_us < decay_end && set_us >= decay_end - shape->decay_us / ENVELOPE_STEPS)
+            last_step_pulses++;
+    }
+
+    printf("envelope %u note %u: %u pulses\n", profile, note, pulses);
+    CHECK(pulses > 0);
+    CHECK_EQ(wrong, 0);
+
+    // Nothing is played once the release is over
+    uint64_t last_rise = 0;
+    for (size_t i = 0; i < edges.size(); i++)
+    {
+        if (edges[i].level)
+            last_rise = edges[i].time_ps / SIM_PS_PER_US;
+    }
+    CHECK(last_rise <= played.release_us + shape->release_us + period_us);
+
+    // Long decays get to their last step, where it is loud enough to play
+    uint32_t last_width = reference_width(&played, played.start_us + shape->attack_us + shape->decay_us - 1, 0);
+    if (shape->decay_us / ENVELOPE_STEPS > 2 * period_us && last_width > 0)
+        CHECK_MSG(last_step_pulses > 0, "envelope %u: no pulse from the last decay step", profile);
+}
+
+int main()
+{
+    transmitter_init();
+
+    for (uint8_t profile = 0; profile < ENVELOPE_COUNT; profile++)
+        test_profile(profile, 60);
+
+    // 27 ms periods against a 20 ms release
+    test_profile(ENVELOPE_ORGAN, 26);
+
+    return test_result();
+}
@@ -0,0 +1,316 @@
+// Cost of turning a note or a pot setting into PWM registers, before and
+// after the integer pulse width API. The Cortex-M0+ has no FPU, every float
+// or double operation is a call into the soft float library, so the count
+// of those calls per event is what a cycle count would mostly show. The old
+// interrupt code runs here on counting float and double types; the new
+// path is read from the firmware sources and must not have any. Both are
+// also compared for how close the pulse widths come to what was asked.
+
+#include "test.h"
+#include "transmitter.h"
+
+#include <cmath>
+#include <fstream>
+#include <regex>
+#include <sstream>
+#include <string>
+
+typedef struct
+{
+    uint32_t add;
+    uint32_t mul;
+    uint32_t div;
+    uint32_t convert;
+    uint32_t pow;
+} SoftCount;
+
+SoftCount soft_count;
+
+uint32_t soft_calls()
+{
+    return soft_count.add + soft_count.mul + soft_count.div + soft_count.convert + soft_count.pow;
+}
+
+// A float or double whose every operation and conversion is counted
+template <typename T>
+struct Soft
+{
+    T v;
+
+    explicit Soft(T value) : v(value) {}
+
+    template <typename I, typename = std::enable_if_t<std::is_integral<I>::value>>
+    static Soft from(I value)
+    {
+        soft_count.convert++;
+        return Soft((T)value);
+    }
+
+    template <typename U>
+    Soft<U> to() const
+    {
+        soft_count.convert++;
+        return Soft<U>((U)v);
+    }
+
+    template <typename I>
+    I to_int() const
+    {
+        soft_count.convert++;
+        return (I)v;
+    }
+};
+
+// Mixed float and double go through double, like C does
+template <typename A, typename B>
+using SoftCommon = Soft<decltype(A() + B())>;
+
+template <typename A, typename B>
+SoftCommon<A, B> promote(Soft<A> a, Soft<B> b, SoftCommon<A, B> *other)
+{
+    typedef decltype(A() + B()) C;
+    if (!std::is_same<A, C>::value)
+        soft_count.convert++;
+    if (!std::is_same<B, C>::value)
+        soft_count.convert++;
+    *other = SoftCommon<A, B>((C)b.v);
+    return SoftCommon<A, B>((C)a.v);
+}
+
+template <typename A, typename B>
+SoftCommon<A, B> operator+(Soft<A> a, Soft<B> b)
+{
+    SoftCommon<A, B> y(0);
+    SoftCommon<A, B> x = promote(a, b, &y);
+    soft_count.add++;
+    return SoftCommon<A, B>(x.v + y.v);
+}
+
+template <typename A, typename B>
+SoftCommon<A, B> operator-(Soft<A> a, Soft<B> b)
+{
+    SoftCommon<A, B> y(0);
+    SoftCommon<A, B> x = promote(a, b, &y);
+    soft_count.add++;
+    return SoftCommon<A, B>(x.v - y.v);
+}
+
+template <typename A, typename B>
+SoftCommon<A, B> operator*(Soft<A> a, Soft<B> b)
+{
+    SoftCommon<A, B> y(0);
+    SoftCommon<A, B> x = promote(a, b, &y);
+    soft_count.mul++;
+    return SoftCommon<A, B>(x.v * y.v);
+}
+
+template <typename A, typename B>
+SoftCommon<A, B> operator/(Soft<A> a, Soft<B> b)
+{
+    SoftCommon<A, B> y(0);
+    SoftCommon<A, B> x = promote(a, b, &y);
+    soft_count.div++;
+    return SoftCommon<A, B>(x.v / y.v);
+}
+
+Soft<double> soft_pow(Soft<double> base, Soft<double> exponent)
+{
+    soft_count.pow++;
+    return Soft<double>(pow(base.v, exponent.v));
+}
+
+typedef Soft<float> F;
+typedef Soft<double> D;
+
+// set_transmitter_freq_duty(uint, uint, uint32_t, float) as it was, for
+// one channel: the level for a duty in percent
+uint32_t old_freq_duty(uint32_t f, F d, uint16_t *divider16_out, uint32_t *wrap_out)
+{
+    uint32_t clock = 125000000;
+    uint32_t divider16 = clock / f / 4096 + (clock % (f * 4096) != 0);
+
+    if (divider16 / 16 == 0)
+        divider16 = 16;
+
+    uint32_t wrap = clock * 16 / divider16 / f - 1;
+    uint32_t high_time = (F::from(wrap) * d / D(100.0)).to_int<uint32_t>();
+
+    *divider16_out = divider16;
+    *wrap_out = wrap;
+    return high_time;
+}
+
+// The MIDI branch of the old pwm_irq_handler, both channels. Returns the
+// pulse width it asked for and the one the level gives, in us.
+void old_note(uint8_t note_tx, uint8_t velocity_tx, double *asked, double *got)
+{
+    uint32_t frequency = (D::from(440) * soft_pow(D(2), (F::from(note_tx) - D(69.0)) / D(12.0))).to_int<uint32_t>();
+    F pulse_width = (D::from(MIN_PULSE_WIDTH) + (F::from(MAX_PULSE_WIDTH - MIN_PULSE_WIDTH) * F::from(velocity_tx)) /
+                                                    D(127.0)).to<float>();
+    F duty_cycle = ((pulse_width / F(1000000.f)) / (F(1.f) / F::from(frequency))) * F(100.f);
+
+    uint16_t divider16;
+    uint32_t wrap;
+    uint32_t level = old_freq_duty(frequency, duty_cycle, &divider16, &wrap);
+    old_freq_duty(frequency, duty_cycle, &divider16, &wrap);
+
+    *asked = pulse_width.v;
+    *got = level * (divider16 / 16.0) / 125.0;
+}
+
+// The pot branch, both channels
+void old_pots(uint16_t freq_input, uint16_t duty_input, double *asked, double *got)
+{
+    uint8_t index = duty_input * 17 / 4095;
+    uint32_t frequency = frequency_table[index];
+
+    F pulse_width = (D::from(MIN_PULSE_WIDTH) +
+                     D::from((MAX_PULSE_WIDTH - MIN_PULSE_WIDTH) * freq_input) / D(4095.0)).to<float>();
+    F duty_cycle = ((pulse_width / F(1000000.f)) / (F(1.f) / F::from(frequency))) * F(100.f);
+
+    uint16_t divider16;
+    uint32_t wrap;
+    uint32_t level = old_freq_duty(frequency, duty_cycle, &divider16, &wrap);
+    old_freq_duty(frequency, duty_cycle, &divider16, &wrap);
+
+    *asked = pulse_width.v;
+    *got = level * (divider16 / 16.0) / 125.0;
+}
+
+double level_us(const PwmSetting *setting, uint16_t level)
+{
+    return level * (setting->divider16 / 16.0) / (transmitter_clock / 1e6);
+}
+
+// Body of a function in a firmware file, comments removed
+std::string function_body(const std::string &source, const std::string &name)
+{
+    std::smatch match;
+    std::regex head("\\n[A-Za-z_][\\w \\*]* \\**" + name + "\\([^;{]*\\)\\s*\\{");
+    if (!std::regex_search(source, match, head))
+        return "";
+
+    size_t at = match.position(0) + match.length(0);
+    int depth = 1;
+    size_t end = at;
+    while (end < source.size() && depth > 0)
+    {
+        if (source[end] == '{')
+            depth++;
+        else if (source[end] == '}')
+            depth--;
+        end++;
+    }
+
+    return std::regex_replace(source.substr(at, end - at), std::regex("//[^\\n]*"), "");
+}
+
+std::string read_source(const char *name)
+{
+    std::ifstream file(std::string(FIRMWARE_DIR) + "/" + name);
+    std::stringstream text;
+    text << file.rdbuf();
+    return text.str();
+}
+
+// Everything pwm_irq_handler and transmitt_music's immediate note on can
+// run, no float types, float literals or math library calls
+void test_new_path_integer()
+{
+    const char *files[] = {"transmitter.h", "note_table.h", "envelope.h"};
+    const char *functions[] = {"pwm_irq_handler", "transmitter_serve", "transmitter_apply", "transmitter_step",
+                               "transmitter_pulse", "transmitter_retune", "transmitter_scaled_setting",
+                               "transmitter_envelope_width", "governor_pulse", "velocity_width", "pwm_width_level",
+                               "pwm_ticks", "pwm_ticks_q16", "envelope_start", "envelope_release", "envelope_level",
+                               "envelope_done"};
+    std::regex floating("\\b(float|double|powf?|sqrtf?|logf?|expf?)\\b|\\b[0-9]+\\.[0-9]*f?\\b");
+
+    for (const char *function : functions)
+    {
+        std::string body;
+        for (const char *file : files)
+        {
+            body = function_body(read_source(file), function);
+            if (!body.empty())
+                break;
+        }
+
+        CHECK_MSG(!body.empty(), "%s not found", function);
+        std::smatch match;
+        CHECK_MSG(!std::regex_search(body, match, floating), "%s uses %s", function, match.str(0).c_str());
+    }
+}
+
+void benchmark()
+{
+    transmitter_init();
+
+    // Every playable note at every velocity
+    uint32_t most = 0;
+    double old_worst = 0;
+    double new_worst = 0;
+
+    for (uint8_t note = 24; note < 84; note++)
+    {
+        for (uint8_t velocity = 1; velocity < 128; velocity++)
+        {
+            soft_count = {0, 0, 0, 0, 0};
+            double asked, got;
+            old_note(note, velocity, &asked, &got);
+            if (soft_calls() > most)
+                most = soft_calls();
+            if (fabs(got - asked) > old_worst)
+                old_worst = fabs(got - asked);
+
+            const PwmSetting *setting = &note_pwm_table[note];
+            uint32_t width = velocity_width(velocity);
+            double error = fabs(level_us(setting, pwm_width_level(setting, width)) - width);
+            if (error > new_worst)
+                new_worst = error;
+        }
+    }
+
+    SoftCount note = soft_count;
+    printf("note on: %u soft float calls before (%u add, %u mul, %u div, %u convert, %u pow), 0 after\n", most,
+           note.add, note.mul, note.div, note.convert, note.pow);
+    printf("note widths: %.3f us off before, %.3f us after\n", old_worst, new_worst);
+    CHECK(most > 0);
+    CHECK(new_worst <= old_worst);
+
+    // Pots over their whole range
+    most = 0;
+    old_worst = 0;
+    new_worst = 0;
+    for (uint16_t freq = 0; freq < 4096; freq += 15)
+    {
+        for (uint16_t duty = 0; duty < 4096; duty += 15)
+        {
+            soft_count = {0, 0, 0, 0, 0};
+            double asked, got;
+            old_pots(freq, duty, &asked, &got);
+            if (soft_calls() > most)
+                most = soft_calls();
+            if (fabs(got - asked) > old_worst)
+                old_worst = fabs(got - asked);
+
+            const PwmSetting *setting = &frequency_pwm_table[pot_frequency_index(duty)];
+            uint32_t width = pot_width(freq);
+            double error = fabs(level_us(setting, pwm_width_level(setting, width)) - width);
+            if (error > new_worst)
+                new_worst = error;
+        }
+    }
+
+    printf("pot change: %u soft float calls before, 0 after\n", most);
+    printf("pot widths: %.3f us off before, %.3f us after\n", old_worst, new_worst);
+    CHECK(most > 0);
+    CHECK(new_worst <= old_worst);
+}
+
+int main()
+{
+    test_new_path_integer();
+    benchmark();
+
+    return test_result();
+}
@@ -0,0 +1,212 @@
+// Duty governor on its own with dense and sparse pulse trains, then on the
+// PWM paths: pot control and monophonic notes run on the simulated slice
+// and the on time of the TX pin is measured from its edges over sliding
+// windows of both governor lengths.
+
+#include "test.h"
+#include "transmitter.h"
+
+#include <vector>
+
+const uint64_t short_window_us = (uint64_t)GOVERNOR_SHORT_BUCKETS * GOVERNOR_SHORT_BUCKET_US;
+const uint64_t long_window_us = (uint64_t)GOVERNOR_LONG_BUCKETS * GOVERNOR_LONG_BUCKET_US;
+
+// Budgets of the windows plus the bucket the window can straddle at the
+// duty of the train
+uint64_t window_limit(uint64_t window_us, uint32_t permille, uint64_t bucket_us, uint32_t train_permille)
+{
+    return window_us * permille / 1000 + bucket_us * train_permille / 1000;
+}
+
+typedef struct
+{
+    uint64_t start; // us
+    uint32_t on;    // us
+} OnTime;
+
+// Most on time inside any window_us long stretch of the train
+uint64_t max_window_on(const std::vector<OnTime> &train, uint64_t window_us)
+{
+    uint64_t most = 0;
+    uint64_t sum = 0;
+    size_t first = 0;
+
+    for (size_t i = 0; i < train.size(); i++)
+    {
+        sum += train[i].on;
+        while (train[i].start + train[i].on - train[first].start > window_us)
+            sum -= train[first++].on;
+        if (sum > most)
+            most = sum;
+    }
+
+    return most;
+}
+
+void reset_governor(TxOutput *output)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        DutyWindow *window = &output->governor[i];
+        for (uint16_t j = 0; j < window->bucket_count; j++)
+            window->buckets[j] = 0;
+        window->total = 0;
+        window->current = 0;
+        window->current_end = 0;
+    }
+}
+
+// governor_pulse with a steady train of hz pulses of on_us for seconds
+std::vector<OnTime> governed_train(uint32_t hz, uint32_t on_us, uint32_t seconds, uint32_t *shortened)
+{
+    TxOutput *output = &tx_outputs[0];
+    std::vector<OnTime> train;
+    uint64_t start = 1000000;
+
+    reset_governor(output);
+    *shortened = 0;
+
+    for (uint64_t i = 0; i < (uint64_t)hz * seconds; i++)
+    {
+        uint64_t now = start + i * 1000000 / hz;
+        uint32_t allowed = governor_pulse(output, now, on_us);
+        if (allowed < on_us)
+            (*shortened)++;
+        if (allowed > 0)
+            train.push_back({now, allowed});
+    }
+
+    return train;
+}
+
+void check_train(const std::vector<OnTime> &train, uint32_t train_permille, const char *name)
+{
+    uint64_t short_on = max_window_on(train, short_window_us);
+    uint64_t long_on = max_window_on(train, long_window_us);
+
+    printf("%s: %llu us in 100 ms, %llu us in 10 s\n", name, (unsigned long long)short_on, (unsigned long long)long_on);
+    CHECK(short_on <= window_limit(short_window_us, GOVERNOR_SHORT_PERMILLE, GOVERNOR_SHORT_BUCKET_US, train_permille));
+    CHECK(long_on <= window_limit(long_window_us, GOVERNOR_LONG_PERMILLE, GOVERNOR_LONG_BUCKET_US, train_permille));
+}
+
+void test_dense_and_sparse()
+{
+    uint32_t shortened;
+
+    // 1 kHz at 100 us is 10%, over the long window's 8%
+    std::vector<OnTime> dense = governed_train(1000, 100, 40, &shortened);
+    check_train(dense, 100, "1 kHz, 100 us");
+    CHECK(shortened > 0);
+
+    // 200 ms bursts of 2 kHz at 100 us, 20% while they last and beyond the
+    // short window, every 400 ms
+    TxOutput *output = &tx_outputs[0];
+    std::vector<OnTime> bursts;
+    uint32_t dropped = 0;
+    reset_governor(output);
+    for (uint64_t now = 1000000; now < 41000000; now += 500)
+    {
+        if ((now / 200000) % 2 == 0)
+            continue;
+        uint32_t allowed = governor_pulse(output, now, 100);
+        if (allowed > 0)
+            bursts.push_back({now, allowed});
+        else
+            dropped++;
+    }
+    check_train(bursts, 200, "bursts of 2 kHz, 100 us");
+    CHECK(dropped > 0);
+
+    // 65 Hz at 100 us is far under both budgets, nothing may be touched
+    std::vector<OnTime> sparse = governed_train(65, 100, 40, &shortened);
+    check_train(sparse, 7, "65 Hz, 100 us");
+    CHECK_EQ(shortened, 0);
+    CHECK_EQ(sparse.size(), 65u * 40);
+}
+
+// On time of the TX pin of output 0 from its traced edges
+std::vector<OnTime> traced_train()
+{
+    std::vector<OnTime> train;
+    const std::vector<SimEdge> &edges = sim_pwm[tx_outputs[0].slice].edges[pwm_gpio_to_channel(tx_outputs[0].pin)];
+
+    for (size_t i = 0; i + 1 < edges.size(); i++)
+    {
+        if (edges[i].level && !edges[i + 1].level)
+            train.push_back({edges[i].time_ps / SIM_PS_PER_US, (uint32_t)((edges[i + 1].time_ps - edges[i].time_ps) / SIM_PS_PER_US)});
+    }
+
+    return train;
+}
+
+void start_pwm_test()
+{
+    sim_reset();
+    transmitter_init();
+    reset_governor(&tx_outputs[0]);
+    sim_pwm[tx_outputs[0].slice].trace = true;
+    sim_advance_us(1000);
+}
+
+// Pots at the highest frequency and the widest pulse
+void test_pots()
+{
+    start_pwm_test();
+    set_transmitter(4095, 4095);
+    sim_advance_us(40 * 1000000ull);
+
+    std::vector<OnTime> train = traced_train();
+    CHECK(train.size() > 30000);
+    check_train(train, 100, "pots 1 kHz, 100 us");
+
+    // Sparse pot setting, every pulse at full width
+    start_pwm_test();
+    set_transmitter(4095, 0);
+    sim_advance_us(20 * 1000000ull);
+
+    train = traced_train();
+    CHECK(train.size() >= 15 * 20 - 1);
+    for (size_t i = 0; i < train.size(); i++)
+        CHECK_MSG(train[i].on >= MAX_PULSE_WIDTH - 1 && train[i].on <= MAX_PULSE_WIDTH, "pulse %zu %u us", i, train[i].on);
+}
+
+// B5 at full velocity, about 9.9% duty from the velocity width alone
+void test_note()
+{
+    start_pwm_test();
+    transmitt_music(0, 83, 127, ENVELOPE_FLAT);
+    sim_advance_us(40 * 1000000ull);
+
+    std::vector<OnTime> train = traced_train();
+    CHECK(train.size() > 30000);
+    check_train(train, 99, "B5, 100 us");
+
+    // C2 stays under the budgets
+    start_pwm_test();
+    transmitt_music(0, 36, 127, ENVELOPE_FLAT);
+    sim_advance_us(20 * 1000000ull);
+
+    train = traced_train();
+    CHECK(train.size() >= 65 * 20 - 1);
+    for (size_t i = 0; i < train.size(); i++)
+        CHECK_MSG(train[i].on >= MAX_PULSE_WIDTH - 1 && train[i].on <= MAX_PULSE_WIDTH, "pulse %zu %u us", i, train[i].on);
+
+    // Note off silences the output and the wrap interrupt goes quiet
+    transmitt_music(0, 36, 0, ENVELOPE_FLAT);
+    sim_advance_us(100000);
+    size_t pulses = traced_train().size();
+    sim_advance_us(1000000);
+    CHECK_EQ(traced_train().size(), pulses);
+    CHECK((sim_pwm_hw.inte & (1u << tx_outputs[0].slice)) == 0);
+}
+
+int main()
+{
+    transmitter_init();
+
+    test_dense_and_sparse();
+    test_pots();
+    test_note();
+
+    return test_result();
+}
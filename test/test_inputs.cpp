@@ -0,0 +1,206 @@
+// Buttons under synthetic contact bounce. Presses and releases bounce for a
+// few ms before the level settles, and each must come out of the debounce
+// as exactly one event. Holding scroll gives the long press and the auto
+// repeat, which step lists with scroll_step but never count as another
+// scroll_pressed, the action that toggles burst mode.
+
+#include "test.h"
+#include "inputs.h"
+
+#include <random>
+#include <vector>
+
+std::mt19937 bounce_random(7);
+
+// Moves a button pin to `level`, bouncing for up to bounce_us on the way:
+// random edges 20 us to 2 ms apart, ending on the new level
+void bounce(uint pin, bool level, uint32_t bounce_us)
+{
+    uint32_t elapsed = 0;
+    bool at = !level;
+
+    while (elapsed < bounce_us)
+    {
+        uint32_t step = 20 + bounce_random() % 2000;
+        sim_advance_us(step);
+        elapsed += step;
+        at = !at;
+        sim_gpio_drive(pin, at);
+    }
+
+    sim_gpio_drive(pin, level);
+}
+
+// Buttons are active low
+void press(uint pin, uint32_t bounce_us) { bounce(pin, false, bounce_us); }
+void release(uint pin, uint32_t bounce_us) { bounce(pin, true, bounce_us); }
+
+std::vector<ButtonEvent> drain()
+{
+    std::vector<ButtonEvent> events;
+    ButtonEvent event;
+
+    while (button_pop(&event))
+        events.push_back(event);
+
+    return events;
+}
+
+void start_test(Inputs *inputs)
+{
+    sim_reset();
+    sim_irq_latency_ps = 5 * SIM_PS_PER_US;
+    sim_gpio_levels[SEL_PIN] = true;
+    sim_gpio_levels[SCROLL_PIN] = true;
+    button_head = button_tail = 0;
+    for (int i = 0; i < BUTTON_COUNT; i++)
+    {
+        buttons[i].settling = false;
+        buttons[i].hold_alarm = 0;
+    }
+    inputs->init_buttons();
+}
+
+// Short presses of both buttons with long bounces: one press and one
+// release each, in order
+void test_bounced_presses()
+{
+    Inputs inputs;
+    start_test(&inputs);
+
+    for (int i = 0; i < 50; i++)
+    {
+        uint pin = i % 2 ? SCROLL_PIN : SEL_PIN;
+        uint8_t id = i % 2 ? BUTTON_SCROLL : BUTTON_SELECT;
+
+        press(pin, 8000);
+        sim_advance_us(150000);
+        release(pin, 8000);
+        sim_advance_us(150000);
+
+        std::vector<ButtonEvent> events = drain();
+        CHECK_EQ(events.size(), 2);
+        if (events.size() == 2)
+        {
+            CHECK(events[0].button == id && events[0].type == BUTTON_PRESS);
+            CHECK(events[1].button == id && events[1].type == BUTTON_RELEASE);
+        }
+    }
+
+    // A spike shorter than the debounce time is no press at all
+    for (int i = 0; i < 20; i++)
+    {
+        sim_gpio_drive(SEL_PIN, false);
+        sim_advance_us(50 + bounce_random() % 5000);
+        sim_gpio_drive(SEL_PIN, true);
+        sim_advance_us(100000);
+    }
+    CHECK_EQ(drain().size(), 0);
+
+    // Settling is decided a debounce time after the last edge, whatever
+    // the interrupt latency of the alarm
+    press(SEL_PIN, 0);
+    uint64_t pressed_at = sim_now_ps;
+    while (button_head == button_tail && sim_now_ps < pressed_at + 100000 * SIM_PS_PER_US)
+        sim_advance_us(100);
+    uint64_t settled_us = (sim_now_ps - pressed_at) / SIM_PS_PER_US;
+    CHECK_MSG(settled_us >= BUTTON_DEBOUNCE_US && settled_us <= BUTTON_DEBOUNCE_US + 200, "settled after %llu us",
+              (unsigned long long)settled_us);
+    release(SEL_PIN, 0);
+    sim_advance_us(100000);
+    drain();
+}
+
+// Scroll held for two seconds: press, long press, a repeat every
+// BUTTON_REPEAT_MS, release. One scroll_pressed, or a scroll_step per
+// event.
+void test_held_scroll()
+{
+    Inputs inputs;
+    start_test(&inputs);
+
+    press(SCROLL_PIN, 5000);
+    sim_advance_us(2000000);
+    release(SCROLL_PIN, 5000);
+    sim_advance_us(100000);
+
+    // Once through the UI loop with every pass asking like main.cpp does
+    inputs.updateButtons();
+
+    uint32_t presses = 0;
+    while (inputs.scroll_pressed())
+        presses++;
+    CHECK_EQ(presses, 1);
+
+    // The press went with its step, the long press and repeats are dropped
+    // so a list opened next does not move
+    CHECK(!inputs.scroll_step());
+
+    // A list in front of the same hold gets every step, presses included
+    press(SCROLL_PIN, 5000);
+    sim_advance_us(1000000);
+    release(SCROLL_PIN, 5000);
+    sim_advance_us(100000);
+    inputs.updateButtons();
+
+    uint32_t steps = 0;
+    while (inputs.scroll_step())
+        steps++;
+    uint32_t repeats = (1000000 - BUTTON_LONG_MS * 1000) / (BUTTON_REPEAT_MS * 1000);
+    CHECK_MSG(steps >= repeats + 1 && steps <= repeats + 2, "%u steps", steps);
+    CHECK(!inputs.scroll_pressed());
+
+    // Select does not repeat
+    press(SEL_PIN, 5000);
+    sim_advance_us(2000000);
+    release(SEL_PIN, 5000);
+    sim_advance_us(100000);
+    inputs.updateButtons();
+
+    uint32_t selects = 0;
+    while (inputs.select())
+        selects++;
+    CHECK_EQ(selects, 1);
+}
+
+// Control menu toggling burst mode on scroll_pressed each pass while
+// scroll is held: it toggles once
+void test_burst_toggle()
+{
+    Inputs inputs;
+    start_test(&inputs);
+
+    bool burst = false;
+    int toggles = 0;
+
+    press(SCROLL_PIN, 3000);
+    for (int pass = 0; pass < 300; pass++)
+    {
+        sim_advance_us(10000);
+        inputs.updateButtons();
+        if (inputs.scroll_pressed())
+        {
+            burst = !burst;
+            toggles++;
+        }
+    }
+    release(SCROLL_PIN, 3000);
+
+    CHECK_EQ(toggles, 1);
+    CHECK(burst);
+
+    // The song list opened after it starts at the top
+    sim_advance_us(100000);
+    inputs.updateButtons();
+    inputs.scroll_pressed();
+    CHECK(!inputs.scroll_step());
+}
+
+int main()
+{
+    test_bounced_presses();
+    test_held_scroll();
+    test_burst_toggle();
+
+    return test_result();
+}
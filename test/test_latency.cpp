@@ -0,0 +1,143 @@
+// Note on to first pulse on the simulated slice, for every playable note
+// after silence, after the lowest and the highest note and after itself,
+// at random points of the period that was playing. The slice is retuned
+// right away, so the first pulse comes MIN_PULSE_GAP after the note on,
+// plus at most the rest of a pulse that was on, whatever played before.
+
+#include "test.h"
+#include "transmitter.h"
+
+#include <random>
+#include <vector>
+
+const uint8_t lowest = 24;
+const uint8_t highest = 83;
+
+// Register accesses of the retune
+const uint64_t overhead_ps = 5 * SIM_PS_PER_US;
+
+void start_test()
+{
+    sim_reset();
+    sim_register_ps = 24000;
+    for (int i = 0; i < 2; i++)
+    {
+        tx_outputs[0].queues[i].head = 0;
+        tx_outputs[0].queues[i].tail = 0;
+
+        DutyWindow *window = &tx_outputs[0].governor[i];
+        for (uint16_t j = 0; j < window->bucket_count; j++)
+            window->buckets[j] = 0;
+        window->total = 0;
+    }
+    transmitter_init();
+    sim_pwm[tx_outputs[0].slice].trace = true;
+    sim_advance_us(1000);
+}
+
+// First pulse at or after `from`, 0 if there is none
+const SimEdge *first_pulse(uint64_t from, uint64_t *width)
+{
+    const std::vector<SimEdge> &edges = sim_pwm[tx_outputs[0].slice].edges[pwm_gpio_to_channel(tx_outputs[0].pin)];
+
+    for (size_t i = 0; i + 1 < edges.size(); i++)
+    {
+        if (edges[i].level && edges[i].time_ps >= from && !edges[i + 1].level)
+        {
+            *width = edges[i + 1].time_ps - edges[i].time_ps;
+            return &edges[i];
+        }
+    }
+
+    return nullptr;
+}
+
+// Note on after `previous` (0 for silence) has played for a random part
+// of its period, returns the time to the first pulse of the new note
+uint64_t onset(uint8_t previous, uint8_t note, std::mt19937 *random)
+{
+    start_test();
+
+    if (previous > 0)
+    {
+        transmitt_music(0, previous, 127, ENVELOPE_FLAT);
+        uint64_t period_ps = 1000000000ull * SIM_PS_PER_US / note_millihz_table[previous];
+        sim_advance_to(sim_now_ps + 5 * period_ps + (*random)() % period_ps);
+    }
+    else
+    {
+        sim_advance_us((*random)() % 50000);
+    }
+
+    uint64_t on_ps = sim_now_ps;
+    transmitt_music(0, note, 127, ENVELOPE_FLAT);
+
+    // The first pulse of the new note is the first one to start after the
+    // note on came in and left the old pulse alone
+    uint64_t width;
+    sim_advance_us(100000);
+    uint64_t from = on_ps;
+    const SimEdge *rise = first_pulse(from, &width);
+
+    // A pulse of the old note that was still on finished first
+    while (rise != nullptr && rise->time_ps < on_ps + MIN_PULSE_GAP * SIM_PS_PER_US - SIM_PS_PER_US)
+    {
+        from = rise->time_ps + 1;
+        rise = first_pulse(from, &width);
+    }
+
+    CHECK_MSG(rise != nullptr, "%u after %u: no pulse", note, previous);
+    if (rise == nullptr)
+        return UINT64_MAX;
+
+    // Full width from the first pulse on
+    CHECK_MSG(width + SIM_PS_PER_US >= MAX_PULSE_WIDTH * SIM_PS_PER_US, "%u after %u: first pulse %llu ps", note,
+              previous, (unsigned long long)width);
+
+    return rise->time_ps - on_ps;
+}
+
+int main()
+{
+    std::mt19937 random(11);
+    uint64_t worst_after_silence = 0;
+    uint64_t worst = 0;
+    uint64_t worst_period = 0;
+
+    for (uint8_t note = lowest; note <= highest; note++)
+    {
+        const uint8_t previous_notes[] = {0, lowest, highest, note};
+
+        for (uint8_t previous : previous_notes)
+        {
+            for (int phase = 0; phase < 4; phase++)
+            {
+                uint64_t latency = onset(previous, note, &random);
+                if (previous == 0 && latency > worst_after_silence)
+                    worst_after_silence = latency;
+                if (latency > worst)
+                    worst = latency;
+
+                CHECK_MSG(latency >= MIN_PULSE_GAP * SIM_PS_PER_US, "%u after %u: %llu ps", note, previous,
+                          (unsigned long long)latency);
+                CHECK_MSG(latency <= (MAX_PULSE_WIDTH + MIN_PULSE_GAP) * SIM_PS_PER_US + overhead_ps,
+                          "%u after %u: %llu ps", note, previous, (unsigned long long)latency);
+            }
+
+            // What waiting for the wrap of the previous note would cost
+            if (previous > 0)
+            {
+                uint64_t period_ps = 1000000000ull * SIM_PS_PER_US / note_millihz_table[previous];
+                if (period_ps > worst_period)
+                    worst_period = period_ps;
+            }
+        }
+    }
+
+    printf("note on to first pulse: up to %.1f us after silence, %.1f us after a note (a wrap is up to %.1f us)\n",
+           (double)worst_after_silence / SIM_PS_PER_US, (double)worst / SIM_PS_PER_US,
+           (double)worst_period / SIM_PS_PER_US);
+    CHECK(worst_after_silence <= MIN_PULSE_GAP * SIM_PS_PER_US + overhead_ps);
+
+    return test_result();
+}
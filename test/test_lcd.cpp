@@ -0,0 +1,500 @@
+// The LCD on its simulated pins. Every SIO write is traced, the enable
+// pulses are decoded into nibbles and fed to a model of the HD44780, whose
+// DDRAM then has to show what the GUI drew. The nibbles of each control
+// mode frame are counted and compared with what the driver before the
+// shadow buffer sent for the same frame. The transport runs from an alarm,
+// so the bus timing is checked against the datasheet with the alarms
+// running late by differing amounts, and the GUI must never wait on it.
+
+#include "test.h"
+#include "transmitter.h"
+#include "gui.h"
+
+#include <string>
+#include <vector>
+
+typedef LcdPins<LCD_D4, LCD_D5, LCD_D6, LCD_D7, LCD_RS, LCD_E> Pins;
+
+typedef struct
+{
+    uint64_t rise_ps; // E up
+    uint64_t fall_ps; // E down, the display latches the nibble
+    bool rs;
+    uint8_t nibble;
+    bool steady; // RS and data held while E was high
+} BusNibble;
+
+// Nibbles on the bus from trace entry `from` on
+std::vector<BusNibble> bus_nibbles(size_t from)
+{
+    std::vector<BusNibble> nibbles;
+    uint32_t levels = 0;
+    uint64_t rise_ps = 0;
+    bool steady = true;
+
+    for (size_t i = 0; i < sim_gpio_writes.size(); i++)
+    {
+        const SimGpioWrite *write = &sim_gpio_writes[i];
+        uint32_t before = levels;
+        levels = (levels & ~write->mask) | write->levels;
+
+        bool e_before = before >> LCD_E & 1;
+        bool e_now = levels >> LCD_E & 1;
+        if (!e_before && e_now)
+        {
+            rise_ps = write->time_ps;
+            steady = true;
+        }
+        else if (e_before && e_now && ((before ^ levels) & Pins::bus))
+        {
+            steady = false;
+        }
+
+        if (e_before && !e_now && i >= from)
+        {
+            uint8_t nibble = (levels >> LCD_D4 & 1) | (levels >> LCD_D5 & 1) << 1 | (levels >> LCD_D6 & 1) << 2 |
+                             (levels >> LCD_D7 & 1) << 3;
+            nibbles.push_back({rise_ps, write->time_ps, (bool)(levels >> LCD_RS & 1), nibble, steady});
+        }
+    }
+
+    return nibbles;
+}
+
+// A command or data write as the display took it, one nibble in 8 bit mode
+typedef struct
+{
+    uint64_t rise_ps; // First E up
+    uint64_t fall_ps; // Last E down
+    bool rs;
+    uint8_t byte;
+    bool eight_bit;
+} BusOp;
+
+// HD44780 in as much detail as the driver uses: 8 bit mode after power
+// up, function set to 4 bits, set DDRAM address, clear and data writes
+typedef struct
+{
+    std::vector<BusOp> ops;
+    bool four_bit;
+    bool have_upper;
+    uint8_t upper;
+    uint64_t upper_rise_ps;
+    uint8_t address;
+    uint8_t ddram[0x80];
+    uint32_t clears;
+} Hd44780;
+
+Hd44780 display;
+
+void hd44780_reset(Hd44780 *lcd)
+{
+    lcd->ops.clear();
+    lcd->four_bit = false;
+    lcd->have_upper = false;
+    lcd->address = 0;
+    lcd->clears = 0;
+    memset(lcd->ddram, 0, sizeof(lcd->ddram));
+}
+
+void hd44780_execute(Hd44780 *lcd, bool rs, uint8_t byte)
+{
+    if (rs)
+    {
+        lcd->ddram[lcd->address] = byte;
+
+        // Two line addressing, the first line runs on into the second
+        if (lcd->address == 0x27)
+            lcd->address = 0x40;
+        else if (lcd->address == 0x67)
+            lcd->address = 0;
+        else
+            lcd->address++;
+    }
+    else if (byte & 0x80)
+    {
+        lcd->address = byte & 0x7F;
+    }
+    else if (byte == 0x01)
+    {
+        memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+        lcd->address = 0;
+        lcd->clears++;
+    }
+    else if ((byte & 0xF0) == 0x20)
+    {
+        lcd->four_bit = true;
+    }
+}
+
+void hd44780_nibble(Hd44780 *lcd, const BusNibble *nibble)
+{
+    // D0-D3 are not wired, in 8 bit mode they read as low
+    if (!lcd->four_bit)
+    {
+        lcd->ops.push_back({nibble->rise_ps, nibble->fall_ps, nibble->rs, (uint8_t)(nibble->nibble << 4), true});
+        hd44780_execute(lcd, nibble->rs, nibble->nibble << 4);
+        return;
+    }
+
+    if (!lcd->have_upper)
+    {
+        lcd->upper = nibble->nibble;
+        lcd->upper_rise_ps = nibble->rise_ps;
+        lcd->have_upper = true;
+        return;
+    }
+
+    lcd->have_upper = false;
+    uint8_t byte = lcd->upper << 4 | nibble->nibble;
+    lcd->ops.push_back({lcd->upper_rise_ps, nibble->fall_ps, nibble->rs, byte, false});
+    hd44780_execute(lcd, nibble->rs, byte);
+}
+
+// DDRAM address of a cell on a 20x4 display
+uint8_t screen_address(int col, int row)
+{
+    const uint8_t rows[] = {0x00, 0x40, 0x14, 0x54};
+    return rows[row] + col;
+}
+
+typedef struct
+{
+    char cells[LCD_ROWS][LCD_COLS + 1];
+} Screen;
+
+Screen blank_screen()
+{
+    Screen screen;
+    for (int row = 0; row < LCD_ROWS; row++)
+    {
+        memset(screen.cells[row], ' ', LCD_COLS);
+        screen.cells[row][LCD_COLS] = 0;
+    }
+    return screen;
+}
+
+void screen_put(Screen *screen, int col, int row, const char *text)
+{
+    for (; *text != 0 && col < LCD_COLS; text++)
+        screen->cells[row][col++] = *text;
+}
+
+void check_screen(const Screen *expected, const char *name)
+{
+    for (int cell = 0; cell < LCD_ROWS * LCD_COLS; cell++)
+    {
+        int row = cell / LCD_COLS;
+        int col = cell % LCD_COLS;
+        char shown = (char)display.ddram[screen_address(col, row)];
+        if (shown != expected->cells[row][col] || cell == LCD_ROWS * LCD_COLS - 1)
+        {
+            CHECK_MSG(shown == expected->cells[row][col], "%s: row %d col %d shows 0x%02x, not 0x%02x", name, row,
+                      col, (uint8_t)shown, (uint8_t)expected->cells[row][col]);
+            return;
+        }
+    }
+}
+
+GUI gui;
+size_t trace_at = 0;
+std::vector<BusNibble> bus_history;
+uint64_t init_ps; // When the GUI started the display
+
+// Lets the transport run the queue out and feeds the display what went
+// over the bus. Returns the nibbles sent.
+size_t run_bus(uint64_t *bus_ps)
+{
+    uint64_t start_ps = sim_now_ps;
+    while (lcd.busy())
+        sim_advance_us(10);
+
+    std::vector<BusNibble> nibbles = bus_nibbles(trace_at);
+    trace_at = sim_gpio_writes.size();
+    for (const BusNibble &nibble : nibbles)
+        hd44780_nibble(&display, &nibble);
+    bus_history.insert(bus_history.end(), nibbles.begin(), nibbles.end());
+
+    if (bus_ps != NULL)
+        *bus_ps = sim_now_ps - start_ps;
+    return nibbles.size();
+}
+
+// Bar of a pot value as setDuty and setFreq draw it
+const char *bar(uint16_t pot)
+{
+    static char text[19];
+    int cells = map(pot, 0, 4095, 1, 18);
+    memset(text, ' ', 18);
+    memset(text, '\xff', cells);
+    text[18] = 0;
+    return text;
+}
+
+Screen control_screen(bool burst, uint16_t duty, uint16_t frequency)
+{
+    Screen screen = blank_screen();
+    screen_put(&screen, burst ? 4 : 6, 0, burst ? "Burst Length" : "Frequency");
+    screen_put(&screen, 0, 1, "[");
+    screen_put(&screen, 1, 1, bar(duty));
+    screen_put(&screen, 19, 1, "]");
+    screen_put(&screen, 5, 2, burst ? "Burst Rate" : "Pulse Width");
+    screen_put(&screen, 0, 3, "[");
+    screen_put(&screen, 1, 3, bar(frequency));
+    screen_put(&screen, 19, 3, "]");
+    return screen;
+}
+
+// What the driver before the shadow sent for a control frame, every pass:
+// an address command for each goto_pos and every character of each string
+uint32_t unbuffered_nibbles(bool burst)
+{
+    const char *strings[] = {burst ? "Burst Length" : "Frequency", "[", "]", burst ? "Burst Rate" : "Pulse Width",
+                             "[", "]", bar(0), bar(0)};
+    uint32_t nibbles = 0;
+    for (const char *text : strings)
+        nibbles += 2 * (1 + strlen(text));
+    return nibbles;
+}
+
+// It waited 100 us on each E edge
+const uint64_t unbuffered_nibble_us = 200;
+
+// One pass of the control mode loop redrawing the controls, flushed
+size_t control_frame(bool burst, uint16_t duty, uint16_t frequency, uint64_t *bus_ps)
+{
+    gui.printControls(burst);
+    gui.setDuty(duty);
+    gui.setFreq(frequency);
+    lcd.flush();
+    return run_bus(bus_ps);
+}
+
+// Alarm callbacks run latency_us late, plus up to jitter_us
+void start_test(uint64_t latency_us, uint64_t jitter_us)
+{
+    sim_reset();
+    sim_irq_latency_ps = latency_us * SIM_PS_PER_US;
+    sim_irq_jitter_ps = jitter_us * SIM_PS_PER_US;
+    sim_gpio_trace = true;
+    trace_at = 0;
+    bus_history.clear();
+    hd44780_reset(&display);
+
+    // Queued, the 40 ms power up and the reset sequence go out later
+    init_ps = sim_now_ps;
+    gui.init();
+    lcd.flush();
+    CHECK_EQ(sim_now_ps, init_ps);
+    run_bus(NULL);
+
+    CHECK(display.four_bit);
+    CHECK_EQ(display.clears, 1);
+    Screen blank = blank_screen();
+    check_screen(&blank, "after init");
+}
+
+void benchmark_frames()
+{
+    start_test(0, 0);
+
+    uint64_t bus_ps;
+    uint32_t unbuffered = unbuffered_nibbles(false);
+    size_t first = control_frame(false, 2000, 1000, &bus_ps);
+    Screen expected = control_screen(false, 2000, 1000);
+    check_screen(&expected, "first frame");
+    printf("first frame: %zu nibbles, %.2f ms on the bus (before: %u nibbles, %.2f ms every frame)\n", first,
+           bus_ps / 1e9, unbuffered, unbuffered * unbuffered_nibble_us / 1e3);
+    CHECK(first <= unbuffered);
+
+    // The pots left alone, nothing to send
+    size_t steady = 0;
+    for (int i = 0; i < 100; i++)
+        steady += control_frame(false, 2000, 1000, NULL);
+    printf("unchanged frame: %zu nibbles\n", steady / 100);
+    CHECK_EQ(steady, 0);
+
+    // The duty pot turned a bar cell at a time, up and down: an address
+    // command and the cell
+    control_frame(false, 0, 1000, NULL);
+    size_t most = 0;
+    size_t total = 0;
+    int frames = 0;
+    for (int cells = 1; cells < 34; cells++)
+    {
+        int step = cells < 17 ? cells : 34 - cells;
+        uint16_t duty = (step * 4095 + 16) / 17;
+        size_t nibbles = control_frame(false, duty, 1000, NULL);
+        expected = control_screen(false, duty, 1000);
+        check_screen(&expected, "duty step");
+
+        total += nibbles;
+        frames++;
+        if (nibbles > most)
+            most = nibbles;
+    }
+    printf("bar moving a cell: up to %zu nibbles, %.1f on average\n", most, (double)total / frames);
+    CHECK(most <= 4);
+    CHECK(most * 10 <= unbuffered);
+
+    // Burst mode toggled: cleared and drawn again with the other labels,
+    // only the labels that differ go out and the display is never cleared
+    lcd.clear();
+    size_t toggle = control_frame(true, 2000, 1000, &bus_ps);
+    expected = control_screen(true, 2000, 1000);
+    check_screen(&expected, "burst mode");
+    printf("burst mode toggled: %zu nibbles, %.2f ms on the bus (before: %u nibbles and a clear)\n", toggle,
+           bus_ps / 1e9, unbuffered_nibbles(true));
+    CHECK(toggle < unbuffered_nibbles(true));
+    CHECK_EQ(display.clears, 1);
+
+    lcd.clear();
+    control_frame(false, 2000, 1000, NULL);
+    expected = control_screen(false, 2000, 1000);
+    check_screen(&expected, "back from burst mode");
+}
+
+// HD44780U datasheet minimums, in us
+const uint64_t datasheet_power_on_us = 40000;
+const uint64_t datasheet_reset_us = 4100;
+const uint64_t datasheet_reset_2_us = 100;
+const uint64_t datasheet_command_us = 37;
+const uint64_t datasheet_clear_us = 1520;
+const uint64_t enable_us = 1; // E high and E low, well over PW_EH and t_cycE
+
+// Wait a write needs before the next, the function sets of the reset
+// sequence are the 8 bit ones
+uint64_t op_wait_us(const BusOp *op, int eight_bit_index)
+{
+    if (op->eight_bit && eight_bit_index == 0)
+        return datasheet_reset_us;
+    if (op->eight_bit && eight_bit_index == 1)
+        return datasheet_reset_2_us;
+    if (!op->rs && op->byte == 0x01)
+        return datasheet_clear_us;
+    return datasheet_command_us;
+}
+
+// Every E pulse, the gap between the nibbles of a byte and the wait after
+// each write against the datasheet. Returns the shortest E high and the
+// shortest wait over what was needed, in ps.
+void check_bus_timing(const char *name, uint64_t *shortest_high, int64_t *shortest_spare)
+{
+    *shortest_high = UINT64_MAX;
+    *shortest_spare = INT64_MAX;
+
+    for (size_t i = 0; i < bus_history.size(); i++)
+    {
+        const BusNibble *nibble = &bus_history[i];
+        uint64_t high = nibble->fall_ps - nibble->rise_ps;
+        if (high < *shortest_high)
+            *shortest_high = high;
+
+        CHECK_MSG(high >= enable_us * SIM_PS_PER_US, "%s: nibble %zu E high for %llu ps", name, i,
+                  (unsigned long long)high);
+        CHECK_MSG(nibble->steady, "%s: nibble %zu changed while E was high", name, i);
+    }
+
+    // The nibbles of a byte sit E low apart
+    for (size_t i = 0; i + 1 < bus_history.size(); i++)
+    {
+        uint64_t low = bus_history[i + 1].rise_ps - bus_history[i].fall_ps;
+        CHECK_MSG(low >= enable_us * SIM_PS_PER_US, "%s: E low for %llu ps after nibble %zu", name,
+                  (unsigned long long)low, i);
+    }
+
+    const std::vector<BusOp> &ops = display.ops;
+    CHECK(!ops.empty());
+    CHECK_MSG(ops.size() > 0 && ops[0].rise_ps >= init_ps + datasheet_power_on_us * SIM_PS_PER_US,
+              "%s: first write before the power up wait", name);
+
+    int eight_bit = 0;
+    for (size_t i = 0; i + 1 < ops.size(); i++)
+    {
+        uint64_t needed = op_wait_us(&ops[i], eight_bit) * SIM_PS_PER_US;
+        if (ops[i].eight_bit)
+            eight_bit++;
+
+        int64_t spare = (int64_t)(ops[i + 1].rise_ps - ops[i].fall_ps) - (int64_t)needed;
+        if (spare < *shortest_spare)
+            *shortest_spare = spare;
+        CHECK_MSG(spare >= 0, "%s: write %zu (0x%02x) only waited %lld ps of %llu", name, i, ops[i].byte,
+                  (long long)(spare + needed), (unsigned long long)needed);
+    }
+}
+
+// The reset sequence, the setup and the clear go out as the datasheet
+// has them for 4 bit mode on a 4 line display
+void test_init_sequence()
+{
+    start_test(0, 0);
+
+    const BusOp expected[] = {{0, 0, false, 0x30, true},  {0, 0, false, 0x30, true},  {0, 0, false, 0x30, true},
+                              {0, 0, false, 0x20, true},  {0, 0, false, 0x28, false}, {0, 0, false, 0x06, false},
+                              {0, 0, false, 0x0C, false}, {0, 0, false, 0x01, false}};
+    const std::vector<BusOp> &ops = display.ops;
+    CHECK_EQ(ops.size(), sizeof(expected) / sizeof(expected[0]));
+    for (size_t i = 0; i < ops.size() && i < sizeof(expected) / sizeof(expected[0]); i++)
+    {
+        CHECK_MSG(ops[i].rs == expected[i].rs && ops[i].byte == expected[i].byte &&
+                      ops[i].eight_bit == expected[i].eight_bit,
+                  "write %zu: %s 0x%02x", i, ops[i].rs ? "data" : "command", ops[i].byte);
+    }
+
+    // 4 single nibbles, then two per byte
+    CHECK_EQ(bus_history.size(), 4 + 2 * 4);
+}
+
+// Init and a run of frames with the alarms late by differing amounts. The
+// screen still comes out right and no E pulse or wait gets short.
+void test_bus_timing(uint64_t latency_us, uint64_t jitter_us)
+{
+    start_test(latency_us, jitter_us);
+
+    bool was_burst = false;
+    for (int i = 0; i < 20; i++)
+    {
+        bool burst = i % 5 == 4;
+        uint16_t duty = (i * 211) % 4096;
+        uint16_t frequency = 4095 - (i * 97) % 4096;
+
+        // As the main loop does on toggling burst mode
+        if (burst != was_burst)
+            lcd.clear();
+        was_burst = burst;
+
+        // Drawing and flushing only queue
+        uint64_t start_ps = sim_now_ps;
+        gui.printControls(burst);
+        gui.setDuty(duty);
+        gui.setFreq(frequency);
+        lcd.flush();
+        CHECK_EQ(sim_now_ps, start_ps);
+
+        run_bus(NULL);
+        Screen expected = control_screen(burst, duty, frequency);
+        check_screen(&expected, "late alarms");
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "alarms %llu+%llu us late", (unsigned long long)latency_us,
+             (unsigned long long)jitter_us);
+
+    uint64_t shortest_high;
+    int64_t shortest_spare;
+    check_bus_timing(name, &shortest_high, &shortest_spare);
+    printf("%s: %zu nibbles, E high at least %.2f us, waits at least %.2f us over the datasheet\n", name,
+           bus_history.size(), shortest_high / 1e6, shortest_spare / 1e6);
+}
+
+int main()
+{
+    test_init_sequence();
+    test_bus_timing(0, 0);
+    test_bus_timing(3, 0);
+    test_bus_timing(2, 40);
+
+    benchmark_frames();
+
+    return test_result();
+}
@@ -0,0 +1,234 @@
+// Work per character of turning a byte into LCD pin levels, before and
+// after the compile time nibble masks. The old path, which spread every
+// byte into an array of bits and built each mask from a 32 entry array,
+// runs here on counting integer types, as does the table lookup of the
+// transport. Loads, stores, ALU operations and compares are what the
+// Cortex-M0+ would spend instructions on. Both paths must give the same pin
+// levels for every nibble, and the new one is also timed on the host next
+// to the old one.
+
+#include "test.h"
+#include "transmitter.h"
+#include "gui.h"
+
+#include <chrono>
+
+typedef LcdPins<LCD_D4, LCD_D5, LCD_D6, LCD_D7, LCD_RS, LCD_E> Pins;
+
+typedef struct
+{
+    uint32_t load;
+    uint32_t store;
+    uint32_t alu;
+    uint32_t compare;
+} OpCount;
+
+OpCount op_count;
+
+uint32_t op_total()
+{
+    return op_count.load + op_count.store + op_count.alu + op_count.compare;
+}
+
+// An integer in a register, every operation on it is counted
+struct Op
+{
+    uint32_t v;
+
+    Op(uint32_t value) : v(value) {}
+
+    Op operator+(Op b) const { op_count.alu++; return Op(v + b.v); }
+    Op operator-(Op b) const { op_count.alu++; return Op(v - b.v); }
+    Op operator%(Op b) const { op_count.alu++; return Op(v % b.v); }
+    Op operator&(Op b) const { op_count.alu++; return Op(v & b.v); }
+    Op operator|(Op b) const { op_count.alu++; return Op(v | b.v); }
+    Op operator<<(Op b) const { op_count.alu++; return Op(v << b.v); }
+    Op operator>>(Op b) const { op_count.alu++; return Op(v >> b.v); }
+    bool operator<(Op b) const { op_count.compare++; return v < b.v; }
+    bool operator!=(Op b) const { op_count.compare++; return v != b.v; }
+    Op &operator++(int) { op_count.alu++; v++; return *this; }
+};
+
+// An array in memory, every element read or written is counted
+template <size_t N>
+struct OpArray
+{
+    uint32_t v[N];
+
+    struct Ref
+    {
+        uint32_t *at;
+        operator Op() const { op_count.load++; return Op(*at); }
+        Ref &operator=(Op value) { op_count.store++; *at = value.v; return *this; }
+        Ref &operator=(const Ref &other) { op_count.load++; op_count.store++; *at = *other.at; return *this; }
+    };
+
+    Ref operator[](Op i) { return Ref{&v[i.v]}; }
+};
+
+// The old LCD class, its pin array in D7, D6, D5, D4, RS, E order
+OpArray<6> old_pins = {{LCD_D7, LCD_D6, LCD_D5, LCD_D4, LCD_RS, LCD_E}};
+
+Op old_pin_values_to_mask(OpArray<5> &raw_bits, Op length)
+{
+    Op result = 0;
+    OpArray<32> pin_array;
+    for (Op i = 0; i < 32; i++)
+        pin_array[i] = 0;
+    for (Op i = 0; i < length; i++)
+        pin_array[old_pins[i]] = raw_bits[i];
+    for (Op i = 0; i < 32; i++)
+    {
+        result = result << 1;
+        result = result + pin_array[Op(31) - i];
+    }
+    return result;
+}
+
+void old_uint_into_8bits(OpArray<8> &raw_bits, Op one_byte)
+{
+    for (Op i = 0; i < 8; i++)
+    {
+        raw_bits[Op(7) - i] = one_byte % 2;
+        one_byte = one_byte >> 1;
+    }
+}
+
+// send_full_byte without the pin writes and sleeps, the two masks it
+// put on the pins
+void old_send_full_byte(Op rs, OpArray<8> &databits, uint32_t masks[2])
+{
+    OpArray<5> rawbits;
+    rawbits[4] = rs;
+    for (Op i = 0; i < 4; i++)
+        rawbits[i] = databits[i];
+    masks[0] = old_pin_values_to_mask(rawbits, 5).v;
+    for (Op i = 0; i < 4; i++)
+        rawbits[i] = databits[i + Op(4)];
+    masks[1] = old_pin_values_to_mask(rawbits, 5).v;
+}
+
+// print() for one character
+void old_character(uint8_t c, uint32_t masks[2])
+{
+    OpArray<8> eight_bits;
+    old_uint_into_8bits(eight_bits, c);
+    old_send_full_byte(DATA, eight_bits, masks);
+}
+
+// The lookups of LCD::transport for the two nibbles of a data entry
+OpArray<32> table = [] {
+    OpArray<32> copy;
+    for (int i = 0; i < 32; i++)
+        copy.v[i] = Pins::nibbles[i];
+    return copy;
+}();
+
+void new_character(uint8_t c, uint32_t masks[2])
+{
+    Op rs = DATA;
+    Op data = c;
+    masks[0] = Op(table[rs << 4 | data >> 4]).v;
+    masks[1] = Op(table[rs << 4 | (data & 0x0F)]).v;
+}
+
+void test_same_levels()
+{
+    // Every nibble with RS low and high, the old path sends commands the
+    // same way with RS 0
+    for (int c = 0; c < 256; c++)
+    {
+        for (uint rs = 0; rs < 2; rs++)
+        {
+            OpArray<8> bits;
+            old_uint_into_8bits(bits, c);
+            uint32_t old_masks[2];
+            old_send_full_byte(rs, bits, old_masks);
+
+            uint32_t new_masks[2] = {Pins::nibbles[rs << 4 | c >> 4], Pins::nibbles[rs << 4 | (c & 0x0F)]};
+            CHECK_MSG(old_masks[0] == new_masks[0] && old_masks[1] == new_masks[1],
+                      "0x%02x rs %u: %08x %08x, not %08x %08x", c, rs, new_masks[0], new_masks[1], old_masks[0],
+                      old_masks[1]);
+        }
+    }
+
+    // Only the bus pins, E is clocked on its own
+    for (int i = 0; i < 32; i++)
+        CHECK_EQ(Pins::nibbles[i] & ~Pins::bus, 0);
+    CHECK_EQ(Pins::all, Pins::bus | 1u << LCD_E);
+}
+
+void benchmark()
+{
+    const char *text = "Pulse Width";
+    size_t length = strlen(text);
+    uint32_t masks[2];
+
+    op_count = {0, 0, 0, 0};
+    for (size_t i = 0; i < length; i++)
+        old_character(text[i], masks);
+    OpCount old_ops = op_count;
+    uint32_t old_total = op_total() / length;
+
+    op_count = {0, 0, 0, 0};
+    for (size_t i = 0; i < length; i++)
+        new_character(text[i], masks);
+    OpCount new_ops = op_count;
+    uint32_t new_total = op_total() / length;
+
+    printf("per character before: %u operations (%u loads, %u stores, %u alu, %u compares)\n", old_total,
+           old_ops.load / (uint32_t)length, old_ops.store / (uint32_t)length, old_ops.alu / (uint32_t)length,
+           old_ops.compare / (uint32_t)length);
+    printf("per character after: %u operations (%u loads, %u stores, %u alu, %u compares)\n", new_total,
+           new_ops.load / (uint32_t)length, new_ops.store / (uint32_t)length, new_ops.alu / (uint32_t)length,
+           new_ops.compare / (uint32_t)length);
+    CHECK(new_total * 20 < old_total);
+
+    // Host time for the same work without counting, on plain integers
+    const int rounds = 200000;
+    uint32_t sink = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++)
+    {
+        uint32_t c = (uint8_t)text[r % length];
+        uint bits[8];
+        for (int i = 0; i < 8; i++)
+        {
+            bits[7 - i] = c % 2;
+            c >>= 1;
+        }
+        for (int half = 0; half < 2; half++)
+        {
+            uint raw[5] = {bits[half * 4], bits[half * 4 + 1], bits[half * 4 + 2], bits[half * 4 + 3], DATA};
+            volatile uint pin_array[32];
+            for (int i = 0; i < 32; i++)
+                pin_array[i] = 0;
+            for (int i = 0; i < 5; i++)
+                pin_array[old_pins.v[i]] = raw[i];
+            uint32_t result = 0;
+            for (int i = 0; i < 32; i++)
+                result = (result << 1) + pin_array[31 - i];
+            sink += result;
+        }
+    }
+    auto middle = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++)
+    {
+        volatile uint8_t c = text[r % length];
+        sink += Pins::nibbles[DATA << 4 | c >> 4] + Pins::nibbles[DATA << 4 | (c & 0x0F)];
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double old_ns = std::chrono::duration<double, std::nano>(middle - start).count() / rounds;
+    double new_ns = std::chrono::duration<double, std::nano>(end - middle).count() / rounds;
+    printf("host time per character: %.1f ns before, %.1f ns after (%u)\n", old_ns, new_ns, sink & 1);
+}
+
+int main()
+{
+    test_same_levels();
+    benchmark();
+
+    return test_result();
+}
@@ -0,0 +1,265 @@
+// Pitch modulation of the monophonic output on the simulated slice. Glides
+// over two octaves and a bend down with full vibrato go well past the two
+// semitones the note table leaves free in the counter. Every period of the
+// TX pin is checked against the period the modulation engine asked for,
+// and the multipliers it asked for against the reference curves.
+
+#include "test.h"
+#include "modulation.h"
+
+#include <cmath>
+#include <vector>
+
+typedef struct
+{
+    uint64_t time_ps;
+    uint32_t scale;
+} ScaleChange;
+
+// Multipliers handed to output 0, with when they were handed over
+std::vector<ScaleChange> scales;
+
+// One update plus the polling step, how far a recorded change can be off
+const uint64_t uncertain_ps = 150 * SIM_PS_PER_US;
+
+void start_test()
+{
+    sim_reset();
+    sim_register_ps = 24000;
+    sim_irq_latency_ps = 2 * SIM_PS_PER_US;
+    transmitter_init();
+    synth_init();
+    modulation_init();
+    sim_pwm[tx_outputs[0].slice].trace = true;
+
+    for (int i = 0; i < 2; i++)
+    {
+        DutyWindow *window = &tx_outputs[0].governor[i];
+        for (uint16_t j = 0; j < window->bucket_count; j++)
+            window->buckets[j] = 0;
+        window->total = 0;
+    }
+
+    scales.clear();
+    scales.push_back({sim_now_ps, mod_outputs[0].scale});
+}
+
+// Moves time on in 50 us steps, noting every multiplier change
+void run_us(uint64_t us)
+{
+    uint64_t end = sim_now_ps + us * SIM_PS_PER_US;
+
+    while (sim_now_ps < end)
+    {
+        sim_advance_us(50);
+        if (mod_outputs[0].scale != scales.back().scale)
+            scales.push_back({sim_now_ps, mod_outputs[0].scale});
+    }
+}
+
+void play(uint8_t note)
+{
+    modulation_mono_note(0, 0, note);
+    transmitt_music(0, note, 127, ENVELOPE_FLAT);
+}
+
+std::vector<uint64_t> rises()
+{
+    std::vector<uint64_t> times;
+    const std::vector<SimEdge> &edges = sim_pwm[tx_outputs[0].slice].edges[pwm_gpio_to_channel(tx_outputs[0].pin)];
+
+    for (size_t i = 0; i < edges.size(); i++)
+    {
+        if (edges[i].level)
+            times.push_back(edges[i].time_ps);
+    }
+
+    return times;
+}
+
+// Period of a note in ps, from its frequency rather than the PWM table
+double note_period_ps(uint8_t note)
+{
+    return 1e15 / note_millihz_table[note];
+}
+
+// Every period starting after `from` against the note period stretched by
+// the multiplier in force at its start. Periods starting too close to a
+// change are skipped, the change may or may not have made that wrap.
+// Returns the longest and shortest period relative to the note period.
+void check_periods(uint8_t note, uint64_t from, const char *name, double *longest, double *shortest)
+{
+    std::vector<uint64_t> times = rises();
+    uint32_t checked = 0;
+    uint32_t wrong = 0;
+
+    *longest = 0;
+    *shortest = 1e9;
+
+    for (size_t i = 0; i + 1 < times.size(); i++)
+    {
+        if (times[i] < from)
+            continue;
+
+        size_t change = 0;
+        bool near = false;
+        for (size_t j = 0; j < scales.size(); j++)
+        {
+            if (scales[j].time_ps <= times[i])
+                change = j;
+            if (scales[j].time_ps + uncertain_ps > times[i] && scales[j].time_ps < times[i] + uncertain_ps)
+                near = true;
+        }
+        if (near)
+            continue;
+
+        double period = times[i + 1] - times[i];
+        double expected = note_period_ps(note) * scales[change].scale / 65536.0;
+
+        // The table's own rounding, a tick of the coarsest divider and the
+        // register accesses of a retune
+        double tolerance = expected * 0.0002 + 3.0 * SIM_PS_PER_US;
+        if (fabs(period - expected) > tolerance && wrong++ < 10)
+            printf("%s: period %.1f us at %llu us, expected %.1f us\n", name, period / SIM_PS_PER_US,
+                   (unsigned long long)(times[i] / SIM_PS_PER_US), expected / SIM_PS_PER_US);
+
+        double ratio = period / note_period_ps(note);
+        if (ratio > *longest)
+            *longest = ratio;
+        if (ratio < *shortest)
+            *shortest = ratio;
+        checked++;
+    }
+
+    printf("%s: %u periods checked, %u scales\n", name, checked, (uint32_t)scales.size());
+    CHECK(checked > 20);
+    CHECK_EQ(wrong, 0);
+}
+
+// The multipliers of a glide follow a straight line in cents from the old
+// note to the new one over the glide time, then stay at 1
+void check_glide_curve(int32_t cents, uint32_t glide_ms, uint64_t start_ps, const char *name)
+{
+    uint32_t off = 0;
+    uint64_t done_ps = 0;
+
+    for (size_t i = 1; i < scales.size(); i++)
+    {
+        if (scales[i].time_ps < start_ps)
+            continue;
+
+        // Updates run every MOD_UPDATE_MS from when the timer started
+        double elapsed_ms = (double)(scales[i].time_ps - start_ps) / (SIM_PS_PER_US * 1000.0);
+        double left = cents * (1.0 - elapsed_ms / glide_ms);
+        if ((cents > 0) != (left > 0))
+            left = 0;
+
+        double expected = 65536.0 * pow(2.0, -left / 1200.0);
+        double step = fabs((double)cents) * MOD_UPDATE_MS / glide_ms;
+
+        // Within one update of the line either way
+        double tolerance = expected * (pow(2.0, (step + 1.0) / 1200.0) - 1.0);
+        if (fabs(scales[i].scale - expected) > tolerance && off++ < 10)
+            printf("%s: scale %u at %.1f ms, expected %.0f\n", name, scales[i].scale, elapsed_ms, expected);
+
+        if (scales[i].scale == 1u << 16 && done_ps == 0)
+            done_ps = scales[i].time_ps;
+    }
+
+    CHECK_EQ(off, 0);
+
+    double took_ms = (double)(done_ps - start_ps) / (SIM_PS_PER_US * 1000.0);
+    CHECK_MSG(done_ps > 0 && fabs(took_ms - glide_ms) <= 2 * MOD_UPDATE_MS, "%s: glide took %.1f ms", name, took_ms);
+}
+
+void test_glide(uint8_t from, uint8_t to, const char *name)
+{
+    start_test();
+
+    // Glide on, 50 steps of CC5 is 500 ms
+    const uint32_t glide_ms = 50 * MOD_GLIDE_STEP_MS;
+    modulation_control(0, MIDI_CC_PORTAMENTO, 127);
+    modulation_control(0, MIDI_CC_PORTAMENTO_TIME, 50);
+
+    play(from);
+    run_us(200000);
+
+    uint64_t start = sim_now_ps;
+    play(to);
+    run_us(glide_ms * 1000 + 300000);
+
+    double longest;
+    double shortest;
+    check_periods(to, start, name, &longest, &shortest);
+
+    // The whole way between the two notes is heard, nothing clamped. The
+    // first period checked is already a little into the glide.
+    double wide = pow(2.0, ((int32_t)to - from) / 12.0);
+    double lo = wide < 1 ? wide : 1;
+    double hi = wide < 1 ? 1 : wide;
+    CHECK_MSG(longest <= hi * 1.01 && longest >= hi * 0.93, "%s: longest period %.4f of the note", name, longest);
+    CHECK_MSG(shortest >= lo * 0.99 && shortest <= lo * 1.07, "%s: shortest period %.4f of the note", name, shortest);
+
+    check_glide_curve(((int32_t)from - to) * 100, glide_ms, start, name);
+
+    transmitt_off();
+    modulation_reset();
+    run_us(10000);
+}
+
+// Pitch wheel fully down and full vibrato, 150 to 250 cents below the note
+void test_bend_vibrato(uint8_t note)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "bend and vibrato %u", note);
+    start_test();
+
+    play(note);
+    modulation_pitch_bend(0, 0);
+    modulation_control(0, MIDI_CC_MODULATION, 127);
+    run_us(100000);
+
+    uint64_t start = sim_now_ps;
+    run_us(2000000);
+
+    double longest;
+    double shortest;
+    check_periods(note, start, name, &longest, &shortest);
+
+    // The multipliers reach both ends of the vibrato
+    uint32_t most = 0;
+    uint32_t least = UINT32_MAX;
+    for (size_t i = 0; i < scales.size(); i++)
+    {
+        if (scales[i].time_ps < start)
+            continue;
+        most = scales[i].scale > most ? scales[i].scale : most;
+        least = scales[i].scale < least ? scales[i].scale : least;
+    }
+
+    double deepest = 65536.0 * pow(2.0, (MOD_BEND_CENTS + MOD_VIBRATO_CENTS) / 1200.0);
+    double highest = 65536.0 * pow(2.0, (MOD_BEND_CENTS - MOD_VIBRATO_CENTS) / 1200.0);
+    CHECK_MSG(fabs(most - deepest) < deepest * 0.003, "%s: deepest scale %u, expected %.0f", name, most, deepest);
+    CHECK_MSG(fabs(least - highest) < highest * 0.003, "%s: highest scale %u, expected %.0f", name, least, highest);
+
+    // And so do the periods, the counter is not clamped at 250 cents
+    CHECK_MSG(longest >= deepest / 65536.0 * 0.997, "%s: longest period %.4f of the note", name, longest);
+    CHECK_MSG(shortest <= highest / 65536.0 * 1.003, "%s: shortest period %.4f of the note", name, shortest);
+
+    transmitt_off();
+    modulation_reset();
+    run_us(10000);
+}
+
+int main()
+{
+    test_glide(48, 72, "glide C3 to C5");
+    test_glide(72, 48, "glide C5 to C3");
+    test_glide(24, 36, "glide C1 to C2");
+
+    test_bend_vibrato(24);
+    test_bend_vibrato(60);
+    test_bend_vibrato(83);
+
+    return test_result();
+}
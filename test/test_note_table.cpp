@@ -0,0 +1,156 @@
+// Note tables against f = 440 * 2^((n - 69) / 12) worked out with pow(),
+// for all 128 MIDI notes and several system clocks. The PWM settings of
+// note_table_init, their tick rates and the synth's periods each have to
+// land within their own rounding of the formula. The worst cents error over
+// the playable range is reported next to what the solver before
+// pwm_solve gave.
+
+#include "test.h"
+#include "transmitter.h"
+
+#include <cmath>
+
+const uint32_t clocks[] = {48000000, 125000000, 133000000, 200000000, 250000000};
+
+double formula_hz(int note)
+{
+    return 440.0 * pow(2.0, (note - 69) / 12.0);
+}
+
+double cents(double hz, double reference)
+{
+    return 1200.0 * log2(hz / reference);
+}
+
+// Frequency a slice runs at with a setting
+double setting_hz(uint32_t clock, const PwmSetting *setting)
+{
+    return (double)clock * 16 / ((double)setting->divider16 * (setting->wrap + 1));
+}
+
+void test_pwm_table(uint32_t clock)
+{
+    note_table_init(clock);
+    double worst = 0;
+    int unreachable = 0;
+
+    for (int note = 0; note < 128; note++)
+    {
+        const PwmSetting *setting = &note_pwm_table[note];
+        double reference = formula_hz(note);
+
+        // Longer than the slowest divider and the counter range allow: the
+        // table holds the longest period there is
+        double longest = (double)clock * 16 / (4095.0 * NOTE_MAX_COUNTS);
+        if (reference < longest)
+        {
+            unreachable++;
+            CHECK_MSG(setting->divider16 == 4095 && setting->wrap + 1 == NOTE_MAX_COUNTS, "%lu Hz note %d: %u/%u",
+                      (unsigned long)clock, note, setting->divider16, setting->wrap);
+            continue;
+        }
+
+        CHECK_MSG(setting->divider16 >= 16 && setting->divider16 <= 4095, "%lu Hz note %d: divider %u",
+                  (unsigned long)clock, note, setting->divider16);
+        CHECK_MSG(setting->wrap + 1u <= NOTE_MAX_COUNTS, "%lu Hz note %d: wrap %u", (unsigned long)clock, note,
+                  setting->wrap);
+
+        // Half a counter step of the period, and the mHz the frequencies
+        // are kept in
+        double error = fabs(cents(setting_hz(clock, setting), reference));
+        double allowed = cents(1.0 + 0.5 / (setting->wrap + 1), 1.0) + cents(reference + 0.0005, reference);
+        CHECK_MSG(error <= allowed, "%lu Hz note %d: %.4f cents off, %.4f allowed", (unsigned long)clock, note, error,
+                  allowed);
+        if (error > worst)
+            worst = error;
+
+        // Counter ticks per us for the pulse widths
+        double ticks = (double)clock * 16 / setting->divider16 / 1e6;
+        CHECK_MSG(fabs(setting->ticks_q16 / 65536.0 - ticks) <= 1.0 / 65536, "%lu Hz note %d: %u ticks_q16",
+                  (unsigned long)clock, note, setting->ticks_q16);
+    }
+
+    printf("%3lu MHz: worst %.4f cents, %d notes below the slowest setting\n", (unsigned long)(clock / 1000000), worst,
+           unreachable);
+
+    // The playable range always fits
+    for (int note = 24; note < 84; note++)
+        CHECK_MSG(fabs(cents(setting_hz(clock, &note_pwm_table[note]), formula_hz(note))) < 0.05,
+                  "%lu Hz note %d off", (unsigned long)clock, note);
+}
+
+// The solver pwm_solve replaced: the note rounded down to whole Hz, the
+// smallest divider for the full counter, a wrap rounded down and the clock
+// taken to be 125 MHz whatever it was
+PwmSetting old_solve(int note)
+{
+    uint32_t clock = 125000000;
+    uint32_t f = 440 * powf(2, ((float)note - 69.0) / 12.0);
+    uint32_t divider16 = clock / f / 4096 + (clock % (f * 4096) != 0);
+
+    if (divider16 / 16 == 0)
+        divider16 = 16;
+
+    uint32_t wrap = clock * 16 / divider16 / f - 1;
+    return {(uint16_t)divider16, (uint16_t)wrap, 0};
+}
+
+// Worst cents error from C1 to B5, before and after
+void benchmark_cents()
+{
+    printf("worst cents error, notes 24-83:\n");
+
+    for (uint32_t clock : clocks)
+    {
+        note_table_init(clock);
+        double before = 0;
+        double after = 0;
+        int before_note = 0;
+        int after_note = 0;
+
+        for (int note = 24; note < 84; note++)
+        {
+            PwmSetting old = old_solve(note);
+            double old_error = fabs(cents(setting_hz(clock, &old), formula_hz(note)));
+            double new_error = fabs(cents(setting_hz(clock, &note_pwm_table[note]), formula_hz(note)));
+
+            if (old_error > before)
+            {
+                before = old_error;
+                before_note = note;
+            }
+            if (new_error > after)
+            {
+                after = new_error;
+                after_note = note;
+            }
+        }
+
+        printf("  %3lu MHz: before %8.3f (note %d), after %.4f (note %d)\n", (unsigned long)(clock / 1000000), before,
+               before_note, after, after_note);
+        CHECK(after < before);
+        CHECK(after < 0.05);
+    }
+}
+
+// Synth periods in 1/16 us, within their rounding
+void test_period_table()
+{
+    for (int note = 0; note < 128; note++)
+    {
+        double period = 16000000.0 / formula_hz(note);
+        CHECK_MSG(fabs(note_period_table[note] - period) <= 0.5 + 1e-6, "note %d: period %u for %.2f", note,
+                  note_period_table[note], period);
+    }
+}
+
+int main()
+{
+    for (uint32_t clock : clocks)
+        test_pwm_table(clock);
+
+    test_period_table();
+    benchmark_cents();
+
+    return test_result();
+}
@@ -0,0 +1,360 @@
+// Two outputs built with TX_OUTPUTS=2. A song with a channel for each coil
+// goes through the player as one merged event stream, then each TX pin must
+// carry only the notes routed to it, with the status LED following it. The
+// outputs also keep their own duty governors, and the synth plans and sends
+// separate blocks for each.
+
+#include "test.h"
+#include "player.h"
+#include "tc_pulse_model.h"
+
+#include <string>
+#include <vector>
+
+static_assert(TX_OUTPUTS == 2, "Built for two outputs");
+
+Player player;
+
+void put_u16(std::string *out, uint16_t value)
+{
+    out->push_back(value >> 8);
+    out->push_back(value & 0xFF);
+}
+
+void put_u32(std::string *out, uint32_t value)
+{
+    put_u16(out, value >> 16);
+    put_u16(out, value & 0xFFFF);
+}
+
+// Format 1 file at one tick per ms, track n on channel n. Each track holds
+// its first note for a second, then its second note for another.
+std::string make_song(const uint8_t notes[2][2])
+{
+    std::string song = "MThd";
+    put_u32(&song, 6);
+    put_u16(&song, 1);
+    put_u16(&song, 2);
+    put_u16(&song, 96);
+
+    for (uint8_t track = 0; track < 2; track++)
+    {
+        std::string events;
+        if (track == 0)
+            events += std::string("\x00\xFF\x51\x03\x01\x77\x00", 7); // 96000 us per quarter
+
+        for (int i = 0; i < 2; i++)
+        {
+            // 1000 ticks as a variable length delta
+            events += std::string("\x00", 1);
+            events.push_back(MIDI_NOTE_ON | track);
+            events.push_back(notes[track][i]);
+            events.push_back(127);
+            events += std::string("\x87\x68", 2);
+            events.push_back(MIDI_NOTE_OFF | track);
+            events.push_back(notes[track][i]);
+            events.push_back(0);
+        }
+        events += std::string("\x00\xFF\x2F\x00", 4);
+
+        song += "MTrk";
+        put_u32(&song, events.size());
+        song += events;
+    }
+
+    return song;
+}
+
+typedef struct
+{
+    uint64_t rise; // ps
+    uint64_t fall; // ps
+} TracedPulse;
+
+std::vector<TracedPulse> traced_pulses(uint8_t pin)
+{
+    std::vector<TracedPulse> pulses;
+    const std::vector<SimEdge> &edges = sim_pwm[pwm_gpio_to_slice_num(pin)].edges[pwm_gpio_to_channel(pin)];
+
+    for (size_t i = 0; i + 1 < edges.size(); i++)
+    {
+        if (edges[i].level && !edges[i + 1].level)
+            pulses.push_back({edges[i].time_ps, edges[i + 1].time_ps});
+    }
+
+    return pulses;
+}
+
+void reset_governor(TxOutput *output)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        DutyWindow *window = &output->governor[i];
+        for (uint16_t j = 0; j < window->bucket_count; j++)
+            window->buckets[j] = 0;
+        window->total = 0;
+        window->current = 0;
+        window->current_end = 0;
+    }
+}
+
+void start_pwm_test()
+{
+    sim_reset();
+    transmitter_init();
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        reset_governor(&tx_outputs[i]);
+        sim_pwm[tx_outputs[i].slice].trace = true;
+    }
+    sim_advance_us(1000);
+}
+
+// Period of a note in ps
+uint64_t note_period_ps(uint8_t note)
+{
+    return 1000000000ull * SIM_PS_PER_US / note_millihz_table[note];
+}
+
+// Every pulse of an output belongs to one of its own notes: the time from
+// each rise to the next is that note's period, or longer where one note
+// hands over to the next or the song ends
+void check_output_notes(int index, const uint8_t own[2], const uint8_t other[2])
+{
+    const TxOutput *output = &tx_outputs[index];
+    std::vector<TracedPulse> pulses = traced_pulses(output->pin);
+    CHECK_MSG(pulses.size() > 100, "output %d: %zu pulses", index, pulses.size());
+
+    uint32_t matched[2] = {0, 0};
+    for (size_t i = 0; i + 1 < pulses.size(); i++)
+    {
+        uint64_t period = pulses[i + 1].rise - pulses[i].rise;
+        bool found = false;
+
+        for (int n = 0; n < 2; n++)
+        {
+            uint64_t expected = note_period_ps(own[n]);
+            if (period + SIM_PS_PER_US >= expected && period <= expected + SIM_PS_PER_US)
+            {
+                matched[n]++;
+                found = true;
+            }
+
+            // Never the period of a note sent to the other coil
+            uint64_t foreign = note_period_ps(other[n]);
+            CHECK_MSG(period + SIM_PS_PER_US < foreign || period > foreign + SIM_PS_PER_US,
+                      "output %d: pulse %zu at the period of note %u", index, i, other[n]);
+        }
+
+        // Hand overs and retunes only lengthen the gap
+        if (!found)
+            CHECK_MSG(period >= MIN_PULSE_GAP * SIM_PS_PER_US, "output %d: pulse %zu %llu ps after the last", index,
+                      i, (unsigned long long)period);
+    }
+
+    // A second of each, give or take the hand over
+    for (int n = 0; n < 2; n++)
+    {
+        uint64_t expected = 1000 * SIM_PS_PER_US * 1000 / note_period_ps(own[n]);
+        CHECK_MSG(matched[n] + 3 >= expected && matched[n] <= expected + 1, "output %d note %u: %u periods for %llu",
+                  index, own[n], matched[n], (unsigned long long)expected);
+    }
+
+    // The status LED sits on the other channel of the slice and blinks along
+    std::vector<TracedPulse> led = traced_pulses(output->led);
+    CHECK_EQ(led.size(), pulses.size());
+    for (size_t i = 0; i < led.size() && i < pulses.size(); i++)
+    {
+        if (led[i].rise != pulses[i].rise || led[i].fall != pulses[i].fall)
+        {
+            CHECK_MSG(false, "output %d: LED pulse %zu does not follow TX", index, i);
+            break;
+        }
+    }
+}
+
+// Channel 0 to the first coil and channel 1 to the second, as
+// transmitter_init deals them out, then swapped with transmitter_route
+void test_song(bool swapped)
+{
+    const uint8_t notes[2][2] = {{69, 72}, {48, 55}};
+
+    start_pwm_test();
+    sim_files.clear();
+    sim_files["song.mid"] = make_song(notes);
+    sim_sd_read_us = 0;
+    sim_sd_write_protected = true;
+
+    if (swapped)
+    {
+        transmitter_route(0, 1);
+        transmitter_route(1, 0);
+    }
+
+    player.polyphonic = false;
+    player.play = true;
+    player.play_midi_file("song.mid");
+    sim_advance_us(100000);
+
+    int first = swapped ? 1 : 0;
+    check_output_notes(first, notes[0], notes[1]);
+    check_output_notes(first ^ 1, notes[1], notes[0]);
+
+    // Both went quiet with their note offs
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        size_t pulses = traced_pulses(tx_outputs[i].pin).size();
+        sim_advance_us(500000);
+        CHECK_EQ(traced_pulses(tx_outputs[i].pin).size(), pulses);
+    }
+}
+
+// B5 on the first coil runs over the long window's budget, C2 on the second
+// stays far under it. Only the first is cut back, the second keeps every
+// pulse at full width.
+void test_governors()
+{
+    start_pwm_test();
+    transmitt_music(0, 83, 127, ENVELOPE_FLAT);
+    transmitt_music(1, 36, 127, ENVELOPE_FLAT);
+    sim_advance_us(20 * 1000000ull);
+
+    std::vector<TracedPulse> busy = traced_pulses(tx_outputs[0].pin);
+    std::vector<TracedPulse> quiet = traced_pulses(tx_outputs[1].pin);
+
+    uint32_t shortened = 0;
+    for (const TracedPulse &pulse : busy)
+    {
+        if (pulse.fall - pulse.rise + SIM_PS_PER_US < MAX_PULSE_WIDTH * SIM_PS_PER_US)
+            shortened++;
+    }
+
+    // Most on time of the busy coil in any long window
+    uint64_t window_ps = (uint64_t)GOVERNOR_LONG_BUCKETS * GOVERNOR_LONG_BUCKET_US * SIM_PS_PER_US;
+    uint64_t most = 0;
+    uint64_t sum = 0;
+    size_t first = 0;
+    for (size_t i = 0; i < busy.size(); i++)
+    {
+        sum += busy[i].fall - busy[i].rise;
+        while (busy[i].fall - busy[first].rise > window_ps)
+        {
+            sum -= busy[first].fall - busy[first].rise;
+            first++;
+        }
+        if (sum > most)
+            most = sum;
+    }
+
+    uint64_t limit = window_ps * GOVERNOR_LONG_PERMILLE / 1000 + GOVERNOR_LONG_BUCKET_US * SIM_PS_PER_US / 10;
+    printf("B5 on output 0: %u of %zu pulses shortened, %llu us in 10 s; C2 on output 1: %zu pulses\n", shortened,
+           busy.size(), (unsigned long long)(most / SIM_PS_PER_US), quiet.size());
+    CHECK(shortened > 0);
+    CHECK(most <= limit);
+
+    CHECK(quiet.size() >= 65 * 20 - 1);
+    for (size_t i = 0; i < quiet.size(); i++)
+    {
+        uint64_t width = quiet[i].fall - quiet[i].rise;
+        CHECK_MSG(width + SIM_PS_PER_US >= MAX_PULSE_WIDTH * SIM_PS_PER_US && width <= MAX_PULSE_WIDTH * SIM_PS_PER_US,
+                  "output 1 pulse %zu: %llu ps", i, (unsigned long long)width);
+    }
+}
+
+// A chord on each synth output. One DMA interrupt serves both outputs, and
+// each output's pulses stay on the grids of its own notes.
+void test_synth_outputs()
+{
+    sim_reset();
+    transmitter_init();
+    for (int i = 0; i < TX_OUTPUTS; i++)
+        reset_governor(&tx_outputs[i]);
+    synth_init();
+    synth_start();
+
+    const uint8_t notes[2][2] = {{60, 64}, {61, 67}};
+    uint64_t start[2];
+    std::vector<Pulse> pulses[2];
+
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        SynthOutput *output = &synth_outputs[i];
+        CHECK(output->sm != synth_outputs[i ^ 1].sm);
+        CHECK(output->dma != synth_outputs[i ^ 1].dma);
+        start[i] = output->cursor - 2 * ((uint64_t)SYNTH_BLOCK_US << SYNTH_FRAC_BITS);
+
+        for (int n = 0; n < 2; n++)
+            synth_note_on(i, i, notes[i][n], 100, ENVELOPE_FLAT);
+    }
+
+    uint64_t phase[2][2];
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        for (int n = 0; n < 2; n++)
+            phase[i][n] = synth_outputs[i].voices[n].next;
+    }
+
+    for (int block = 0; block < 400; block++)
+    {
+        for (int i = 0; i < TX_OUTPUTS; i++)
+        {
+            SynthOutput *output = &synth_outputs[i];
+            uint8_t index = output->playing_block;
+            tc_pulse_decode(output->blocks[index], output->block_words[index], &start[i], &pulses[i]);
+            sim_dma[output->dma].irq1_status = true;
+        }
+
+        synth_dma_irq_handler();
+        for (int i = 0; i < TX_OUTPUTS; i++)
+            CHECK(!sim_dma[synth_outputs[i].dma].irq1_status);
+        sim_advance_us(SYNTH_BLOCK_US);
+    }
+
+    // Each pulse lands on a period of one of the output's own notes, late
+    // by at most the rise of a request or the slip allowed to keep the gap
+    // after the pulse before it
+    uint64_t late = TC_PULSE_RISE + ((uint64_t)SYNTH_MAX_SLIP_US << SYNTH_FRAC_BITS);
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        CHECK_MSG(pulses[i].size() > 100, "output %d: %zu pulses", i, pulses[i].size());
+        uint32_t off_grid = 0;
+
+        for (const Pulse &pulse : pulses[i])
+        {
+            bool own = false;
+            for (int n = 0; n < 2; n++)
+            {
+                uint32_t period = note_period_table[notes[i][n]];
+                if (pulse.rise < phase[i][n])
+                    continue;
+                if ((pulse.rise - phase[i][n]) % period <= late)
+                    own = true;
+            }
+            if (!own)
+                off_grid++;
+        }
+
+        CHECK_MSG(off_grid == 0, "output %d: %u pulses off its notes", i, off_grid);
+
+        // Every period of both notes up to where the decoded blocks ended,
+        // fewer where pulses of the chord were dropped for slipping too far
+        uint64_t expected = 0;
+        for (int n = 0; n < 2; n++)
+            expected += (start[i] - phase[i][n]) / note_period_table[notes[i][n]] + 1;
+        printf("synth output %d: %zu pulses, %llu due\n", i, pulses[i].size(), (unsigned long long)expected);
+        CHECK(pulses[i].size() <= expected);
+        CHECK(pulses[i].size() * 10 >= expected * 9);
+    }
+
+    synth_stop();
+}
+
+int main()
+{
+    test_song(false);
+    test_song(true);
+    test_governors();
+    test_synth_outputs();
+
+    return test_result();
+}
@@ -0,0 +1,216 @@
+// Pot filtering on noisy ADC sample traces. The traces carry what the
+// RP2040 ADC gives on a pot: a few counts of white noise, mains hum, the
+// missing codes around 512, 1536, 2560 and 3584 where readings jump, and
+// now and then a spike. A timer stands in for the DMA and writes them into
+// the ring the ADC round robin fills. Pots left alone must never change
+// value, moving ones must follow to their ends, and the count of changes is
+// reported next to what reading the raw ADC each pass gave.
+
+#include "test.h"
+#include "inputs.h"
+
+#include <cmath>
+#include <random>
+
+const uint32_t sample_us = 1000000 / POT_SAMPLE_HZ;
+
+typedef struct
+{
+    double from;
+    double to;
+    uint64_t start_us; // The pot moves from `from` to `to` between these
+    uint64_t end_us;
+} PotMove;
+
+typedef struct
+{
+    PotMove moves[POT_COUNT];
+    std::mt19937 random;
+    uint32_t next; // Ring index the next sample goes to
+    uint16_t last[POT_COUNT];
+} AdcTrace;
+
+AdcTrace trace;
+
+double pot_position(const PotMove *move, uint64_t now_us)
+{
+    if (now_us <= move->start_us)
+        return move->from;
+    if (now_us >= move->end_us)
+        return move->to;
+    return move->from + (move->to - move->from) * (now_us - move->start_us) / (move->end_us - move->start_us);
+}
+
+// One conversion of an input at the pot's position
+uint16_t adc_sample(int input, uint64_t now_us)
+{
+    std::normal_distribution<double> noise(0.0, 3.0);
+    double level = pot_position(&trace.moves[input], now_us) + noise(trace.random);
+
+    // 50 Hz hum picked up by the pot wiring
+    level += 2.0 * sin(2 * M_PI * 50 * now_us / 1e6);
+
+    // Readings near the DNL codes land several counts off
+    for (int code = 512; code < 4096; code += 1024)
+    {
+        if (fabs(level - code) < 8)
+            level += level < code ? -6 : 6;
+    }
+
+    // A spike every few hundred samples
+    if (trace.random() % 400 == 0)
+        level += (int)(trace.random() % 400) - 200;
+
+    if (level < 0)
+        level = 0;
+    if (level > POT_MAX)
+        level = POT_MAX;
+
+    return (uint16_t)lround(level);
+}
+
+// The DMA writing round robin conversions into the ring
+bool adc_dma(repeating_timer_t *)
+{
+    int input = trace.next & 1;
+    uint16_t sample = adc_sample(input, sim_now_us());
+    pot_samples[trace.next % POT_RING_SAMPLES] = sample;
+    trace.last[input] = sample;
+    trace.next++;
+    return true;
+}
+
+repeating_timer_t adc_timer;
+
+void start_test(Inputs *inputs, double duty, double frequency)
+{
+    sim_reset();
+    sim_dma_claimed = 0;
+    trace.random.seed(21);
+    trace.next = 0;
+    trace.moves[POT_DUTY_INPUT] = {duty, duty, 0, 0};
+    trace.moves[POT_FREQ_INPUT] = {frequency, frequency, 0, 0};
+    for (int i = 0; i < POT_COUNT; i++)
+    {
+        pot_filters[i].filtered = 0;
+        pot_filters[i].value = 0;
+    }
+    pot_changes = 0;
+    inputs->pots_seen = 0;
+
+    add_repeating_timer_us(-(int64_t)sample_us, adc_dma, NULL, &adc_timer);
+    inputs->init_pots();
+}
+
+// Both pots left alone, at the ends, mid range and on the DNL codes, for
+// 10 s. The value moves at most while priming and stays within the band of
+// the position.
+void test_still(double duty, double frequency)
+{
+    Inputs inputs;
+    start_test(&inputs, duty, frequency);
+    inputs.pots_changed();
+
+    uint16_t duty_value = inputs.read_dutycycle();
+    uint16_t frequency_value = inputs.read_frequency();
+
+    // The raw ADC read every 10 ms, as the main loop did, counts a retune
+    // whenever the reading differed from the one before
+    uint32_t raw_changes = 0;
+    uint32_t changes = 0;
+    uint16_t raw[POT_COUNT] = {trace.last[0], trace.last[1]};
+
+    for (int pass = 0; pass < 1000; pass++)
+    {
+        sim_advance_us(POT_UPDATE_MS * 1000);
+        if (trace.last[0] != raw[0] || trace.last[1] != raw[1])
+            raw_changes++;
+        raw[0] = trace.last[0];
+        raw[1] = trace.last[1];
+
+        if (inputs.pots_changed())
+            changes++;
+    }
+
+    printf("still at %4.0f/%4.0f: %u raw changes, %u filtered\n", duty, frequency, raw_changes, changes);
+    CHECK_MSG(changes == 0, "%.0f/%.0f: %u changes", duty, frequency, changes);
+    CHECK_EQ(inputs.read_dutycycle(), duty_value);
+    CHECK_EQ(inputs.read_frequency(), frequency_value);
+
+    // Close to where the pots are, the ends exactly
+    const double positions[POT_COUNT] = {duty, frequency};
+    const uint16_t values[POT_COUNT] = {duty_value, frequency_value};
+    for (int i = 0; i < POT_COUNT; i++)
+    {
+        if (positions[i] == 0 || positions[i] == POT_MAX)
+            CHECK_EQ(values[i], positions[i]);
+        else
+            CHECK_MSG(fabs(values[i] - positions[i]) <= POT_HYSTERESIS, "pot %d at %.0f reads %u", i, positions[i],
+                      values[i]);
+    }
+}
+
+// The frequency pot turned all the way up over a second and back down over
+// another, the duty pot left alone. The value follows in steps, never
+// backwards, reaches both ends and the duty pot never changes.
+void test_sweep()
+{
+    Inputs inputs;
+    start_test(&inputs, 2000, 0);
+    uint16_t duty_value = inputs.read_dutycycle();
+    uint64_t now_us = sim_now_us();
+
+    trace.moves[POT_FREQ_INPUT] = {0, POT_MAX, now_us + 100000, now_us + 1100000};
+
+    uint32_t changes = 0;
+    uint16_t value = inputs.read_frequency();
+    double worst_lag = 0;
+    for (int pass = 0; pass < 150; pass++)
+    {
+        sim_advance_us(POT_UPDATE_MS * 1000);
+        uint16_t now_value = inputs.read_frequency();
+        CHECK_MSG(now_value >= value, "frequency went back from %u to %u", value, now_value);
+
+        if (inputs.pots_changed())
+            changes++;
+
+        // Behind the pot by the ring, the IIR filter and the band
+        double lag = pot_position(&trace.moves[POT_FREQ_INPUT], sim_now_us()) - now_value;
+        if (lag > worst_lag)
+            worst_lag = lag;
+        value = now_value;
+    }
+    CHECK_EQ(inputs.read_frequency(), POT_MAX);
+
+    trace.moves[POT_FREQ_INPUT] = {POT_MAX, 0, sim_now_us(), sim_now_us() + 1000000};
+    for (int pass = 0; pass < 150; pass++)
+    {
+        sim_advance_us(POT_UPDATE_MS * 1000);
+        uint16_t now_value = inputs.read_frequency();
+        CHECK_MSG(now_value <= value, "frequency went back from %u to %u", value, now_value);
+
+        if (inputs.pots_changed())
+            changes++;
+        value = now_value;
+    }
+    CHECK_EQ(inputs.read_frequency(), 0);
+    CHECK_EQ(inputs.read_dutycycle(), duty_value);
+
+    // 4096 counts up and down in steps of at least the band
+    printf("sweep: %u changes, up to %.0f counts behind\n", changes, worst_lag);
+    CHECK(changes > 20);
+    CHECK(changes <= 2 * POT_MAX / POT_HYSTERESIS);
+    CHECK(worst_lag < 300);
+}
+
+int main()
+{
+    const double positions[] = {0, 37, 512, 1536, 2047, 2560, 3584, 4060, POT_MAX};
+
+    for (int i = 0; i < 9; i++)
+        test_still(positions[i], positions[8 - i]);
+
+    test_sweep();
+
+    return test_result();
+}
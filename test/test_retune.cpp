@@ -0,0 +1,182 @@
+// Retune timing of the PWM paths. Random note ons and offs with every
+// envelope, pot moves, pitch bends and offs are thrown at output 0 at
+// random times, and every pulse the TX pin gives is checked: none shorter
+// than MIN_PULSE_WIDTH (a runt), none longer than MAX_PULSE_WIDTH (a
+// stretched pulse) and none closer than MIN_PULSE_GAP to the one before.
+// Register accesses take time, so a retune can race a wrap, which the
+// directed test makes sure of.
+
+#include "test.h"
+#include "transmitter.h"
+
+#include <random>
+#include <vector>
+
+// One counter tick of the slowest setting, the rounding a width can get
+const uint64_t tolerance_ps = 1100000;
+const uint64_t register_ps = 24000; // Three clk_sys cycles
+
+typedef struct
+{
+    uint32_t runts;
+    uint32_t stretched;
+    uint32_t close;
+    uint32_t pulses;
+} TrainCheck;
+
+TrainCheck check_trace(const char *name)
+{
+    TrainCheck result = {0, 0, 0, 0};
+    const std::vector<SimEdge> &edges = sim_pwm[tx_outputs[0].slice].edges[pwm_gpio_to_channel(tx_outputs[0].pin)];
+    uint64_t last_fall = 0;
+
+    for (size_t i = 0; i + 1 < edges.size(); i++)
+    {
+        if (!edges[i].level || edges[i + 1].level)
+            continue;
+
+        uint64_t rise = edges[i].time_ps;
+        uint64_t width = edges[i + 1].time_ps - rise;
+        result.pulses++;
+
+        if (width + tolerance_ps < MIN_PULSE_WIDTH * SIM_PS_PER_US)
+        {
+            result.runts++;
+            printf("%s: runt of %llu ps at %llu us\n", name, (unsigned long long)width, (unsigned long long)(rise / SIM_PS_PER_US));
+        }
+        if (width > MAX_PULSE_WIDTH * SIM_PS_PER_US + tolerance_ps)
+        {
+            result.stretched++;
+            printf("%s: %llu ps pulse at %llu us\n", name, (unsigned long long)width, (unsigned long long)(rise / SIM_PS_PER_US));
+        }
+        if (last_fall > 0 && rise - last_fall + tolerance_ps < MIN_PULSE_GAP * SIM_PS_PER_US)
+        {
+            result.close++;
+            printf("%s: %llu ps gap at %llu us\n", name, (unsigned long long)(rise - last_fall), (unsigned long long)(rise / SIM_PS_PER_US));
+        }
+
+        last_fall = edges[i + 1].time_ps;
+    }
+
+    return result;
+}
+
+void start_test()
+{
+    sim_reset();
+    sim_register_ps = register_ps;
+    for (int i = 0; i < 2; i++)
+    {
+        tx_outputs[0].queues[i].head = 0;
+        tx_outputs[0].queues[i].tail = 0;
+    }
+    transmitter_init();
+    sim_pwm[tx_outputs[0].slice].trace = true;
+
+    // Governor windows start empty, as at power on
+    for (int i = 0; i < 2; i++)
+    {
+        DutyWindow *window = &tx_outputs[0].governor[i];
+        for (uint16_t j = 0; j < window->bucket_count; j++)
+            window->buckets[j] = 0;
+    }
+
+    previous_pot_freq = POT_UNSET;
+    previous_pot_duty = POT_UNSET;
+    sim_advance_us(1000);
+}
+
+// Random commands for seconds of simulated time
+void fuzz(uint32_t seed, uint32_t seconds)
+{
+    std::mt19937 random(seed);
+    start_test();
+
+    uint8_t note = 0;
+    uint64_t end = sim_now_ps + (uint64_t)seconds * 1000000 * SIM_PS_PER_US;
+
+    while (sim_now_ps < end)
+    {
+        // Anything from back to back commands to a held note, at ps
+        // resolution so commands land anywhere in a period
+        sim_advance_to(sim_now_ps + random() % (40000 * SIM_PS_PER_US));
+
+        switch (random() % 8)
+        {
+        case 0:
+        case 1:
+        case 2:
+            note = 24 + random() % 60;
+            transmitt_music(0, note, 1 + random() % 127, random() % ENVELOPE_COUNT);
+            break;
+        case 3:
+            transmitt_music(0, note, 0, 0);
+            break;
+        case 4:
+        case 5:
+            set_transmitter(random() % 4096, random() % 4096);
+            break;
+        case 6:
+            // An octave up to two down, most of them need another divider
+            transmitter_modulate(0, 0x8000 + random() % (0x40000 - 0x8000));
+            break;
+        default:
+            transmitt_off();
+            break;
+        }
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "seed %u", seed);
+    TrainCheck result = check_trace(name);
+
+    CHECK(result.pulses > 1000);
+    CHECK_EQ(result.runts, 0);
+    CHECK_EQ(result.stretched, 0);
+    CHECK_EQ(result.close, 0);
+}
+
+// Time of the next wrap of a running slice
+uint64_t next_wrap_ps(uint slice)
+{
+    SimPwmSlice *s = &sim_pwm[slice];
+    sim_pwm_sync(s);
+    uint32_t steps = s->counter > s->top ? 0x10000 - s->counter : s->top + 1 - s->counter;
+    return s->counter_ps + steps * sim_pwm_tick_ps(s);
+}
+
+// Note ons, which retune at once instead of at a wrap, at every register
+// access worth of time before a wrap of the note already playing
+void test_note_on_at_wrap()
+{
+    uint32_t pulses = 0;
+
+    for (uint64_t before = 0; before < 40 * register_ps; before += register_ps / 3)
+    {
+        start_test();
+        transmitt_music(0, 69, 127, ENVELOPE_FLAT);
+        sim_advance_us(20000);
+
+        sim_advance_to(next_wrap_ps(tx_outputs[0].slice) - before);
+        transmitt_music(0, 71, 127, ENVELOPE_FLAT);
+        sim_advance_us(20000);
+
+        TrainCheck result = check_trace("note on at wrap");
+        CHECK_EQ(result.runts, 0);
+        CHECK_EQ(result.stretched, 0);
+        CHECK_EQ(result.close, 0);
+        pulses += result.pulses;
+    }
+
+    CHECK(pulses > 0);
+}
+
+int main()
+{
+    test_note_on_at_wrap();
+
+    for (uint32_t seed = 1; seed <= 8; seed++)
+        fuzz(seed, 60);
+
+    return test_result();
+}
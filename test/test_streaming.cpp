@@ -0,0 +1,116 @@
+// Multi-MB songs streamed off a slow simulated card. Every sector read takes
+// a millisecond, events come in chords of eight at the same tick with 8 ms
+// between chords. Both the merged tracks and the event cache must play
+// every chord on time, which only works when the card is read in the rests
+// and not right before a chord note, and must read every sector once.
+
+#include "test.h"
+#include "player.h"
+
+#include <string>
+
+const uint32_t chord_ticks = 8;
+const uint32_t sd_read_us = 1000;
+
+Player player;
+
+void put_u16(std::string *out, uint16_t value)
+{
+    out->push_back(value >> 8);
+    out->push_back(value & 0xFF);
+}
+
+void put_u32(std::string *out, uint32_t value)
+{
+    put_u16(out, value >> 16);
+    put_u16(out, value & 0xFFFF);
+}
+
+// Format 1 file at one tick per ms. Track 0 has the tempo, both tracks then
+// carry `chords` chords of four CC1 events on their own channel, started
+// with a note off so the index keeps the second track.
+std::string make_song(uint32_t chords)
+{
+    std::string song = "MThd";
+    put_u32(&song, 6);
+    put_u16(&song, 1);
+    put_u16(&song, 2);
+    put_u16(&song, 96);
+
+    for (uint8_t track = 0; track < 2; track++)
+    {
+        std::string events;
+        if (track == 0)
+            events += std::string("\x00\xFF\x51\x03\x01\x77\x00", 7); // 96000 us per quarter
+        else
+            events += std::string("\x00\x81\x3C\x00", 4);
+
+        for (uint32_t chord = 0; chord < chords; chord++)
+        {
+            events.push_back(chord == 0 ? 0 : chord_ticks);
+            events.push_back(MIDI_CONTROL_CHANGE | track);
+            events.push_back(MIDI_CC_MODULATION);
+            events.push_back(chord & 0x7F);
+
+            // Running status for the rest of the chord
+            for (int i = 1; i < 4; i++)
+            {
+                events.push_back(0);
+                events.push_back(MIDI_CC_MODULATION);
+                events.push_back((chord + i) & 0x7F);
+            }
+        }
+        events += std::string("\x00\xFF\x2F\x00", 4);
+
+        song += "MTrk";
+        put_u32(&song, events.size());
+        song += events;
+    }
+
+    return song;
+}
+
+void play_song(const char *name, uint32_t chords, bool cached)
+{
+    sim_reset();
+    sim_files.clear();
+    sim_files["song.mid"] = make_song(chords);
+    sim_sd_read_us = sd_read_us;
+    sim_sd_reads = 0;
+    sim_sd_write_protected = !cached;
+    transmitter_init();
+
+    size_t song_size = sim_files["song.mid"].size();
+
+    player.polyphonic = false;
+    player.play = true;
+    player.play_midi_file("song.mid");
+
+    // Everything got through, the last chord ends on 3 in both tracks
+    uint8_t last = (chords - 1 + 3) & 0x7F;
+    CHECK_EQ(mod_channels[0].vibrato, last);
+    CHECK_EQ(mod_channels[1].vibrato, last);
+
+    // Every chord on time, a card read would show up as 1 ms
+    printf("%s: %zu bytes, %llu sectors read, up to %u us late\n", name, song_size,
+           (unsigned long long)sim_sd_reads, player.late_us);
+    CHECK_MSG(player.late_us < 100, "%s: %u us late", name, player.late_us);
+
+    // Each stream goes through its chunk once, the cache twice: written
+    // from the source, then read back
+    size_t read_bytes = song_size;
+    if (cached)
+        read_bytes += sim_files["song.mid.tcev"].size();
+    uint64_t sectors = read_bytes / TRACK_STREAM_BLOCK_SIZE;
+    CHECK_MSG(sim_sd_reads <= sectors + 16, "%s: %llu sectors read for %llu", name, (unsigned long long)sim_sd_reads,
+              (unsigned long long)sectors);
+}
+
+int main()
+{
+    // 80000 chords, a little over 2 MB of events and 10 minutes of song
+    play_song("merged tracks", 80000, false);
+    play_song("event cache", 80000, true);
+
+    return test_result();
+}
@@ -0,0 +1,177 @@
+// Merged pulse train of the polyphonic synth. The blocks synth_fill plans
+// are decoded with the tc_pulse model into the pulses the coil would get,
+// then checked for the off time between pulses and for every voice keeping
+// its own period.
+
+#include "test.h"
+#include "synth.h"
+#include "tc_pulse_model.h"
+
+#include <vector>
+
+void decode_block(const SynthOutput *output, uint8_t index, uint64_t *start, std::vector<Pulse> *pulses)
+{
+    tc_pulse_decode(output->blocks[index], output->block_words[index], start, pulses);
+}
+
+// Plays the synth for `blocks` blocks, handing every block to the decoder
+// in the order the DMA would send them
+std::vector<Pulse> play_blocks(SynthOutput *output, uint64_t *start, int blocks)
+{
+    std::vector<Pulse> pulses;
+
+    for (int i = 0; i < blocks; i++)
+    {
+        uint8_t index = output->playing_block;
+        decode_block(output, index, start, &pulses);
+
+        sim_dma[output->dma].irq1_status = true;
+        synth_dma_irq_handler();
+        sim_advance_us(SYNTH_BLOCK_US);
+    }
+
+    return pulses;
+}
+
+void check_block_length(SynthOutput *output, uint64_t start)
+{
+    // The requests of a block add up to exactly the block, so the state
+    // machine timeline and the planning cursor never drift apart
+    for (uint8_t index = 0; index < 2; index++)
+    {
+        uint64_t at = start;
+        std::vector<Pulse> pulses;
+        decode_block(output, index, &at, &pulses);
+        CHECK(output->block_words[index] <= SYNTH_BLOCK_REQUESTS * 2);
+        start = at;
+    }
+    CHECK_EQ(start, output->cursor);
+}
+
+// One voice on its own stays on its grid of whole periods. A pulse due in
+// the first TC_PULSE_RISE cycles of a block can only rise once the request
+// of the new block got there, which is the only jitter allowed.
+void test_single_voice()
+{
+    synth_start();
+    SynthOutput *output = &synth_outputs[0];
+    uint64_t start = output->cursor - 2 * ((uint64_t)SYNTH_BLOCK_US << SYNTH_FRAC_BITS);
+
+    synth_note_on(0, 0, 69, 100, ENVELOPE_FLAT);
+    uint64_t phase = output->voices[0].next;
+    check_block_length(output, start);
+
+    std::vector<Pulse> pulses = play_blocks(output, &start, 400);
+    CHECK(pulses.size() > 100);
+
+    uint32_t on = ((velocity_width(100) << SYNTH_FRAC_BITS) - TC_PULSE_HIGH) / 2;
+
+    for (size_t i = 0; i < pulses.size(); i++)
+    {
+        uint64_t grid = phase + i * note_period_table[69];
+        CHECK_MSG(pulses[i].rise >= grid && pulses[i].rise - grid <= TC_PULSE_RISE, "pulse %zu %llu cycles off", i,
+                  (unsigned long long)(pulses[i].rise - grid));
+        CHECK_EQ(pulses[i].fall - pulses[i].rise, 2 * on + TC_PULSE_HIGH);
+    }
+
+    synth_stop();
+}
+
+// A chord: the merged train keeps SYNTH_MIN_GAP_US between pulses, and
+// every pulse belongs to one voice, at most SYNTH_MAX_SLIP_US behind a
+// point of that voice's own grid
+void test_chord(const uint8_t *notes, int count, uint8_t velocity)
+{
+    synth_start();
+    SynthOutput *output = &synth_outputs[0];
+    uint64_t start = output->cursor - 2 * ((uint64_t)SYNTH_BLOCK_US << SYNTH_FRAC_BITS);
+
+    uint64_t phases[SYNTH_VOICES];
+    for (int i = 0; i < count; i++)
+    {
+        synth_note_on(0, 0, notes[i], velocity, ENVELOPE_FLAT);
+        phases[i] = output->voices[i].next;
+    }
+
+    std::vector<Pulse> pulses = play_blocks(output, &start, 2000);
+    CHECK(!pulses.empty());
+
+    const uint64_t min_gap = (uint64_t)SYNTH_MIN_GAP_US << SYNTH_FRAC_BITS;
+    const uint64_t max_slip = (uint64_t)SYNTH_MAX_SLIP_US << SYNTH_FRAC_BITS;
+    uint32_t voice_pulses[SYNTH_VOICES] = {0};
+    uint64_t last_grid[SYNTH_VOICES];
+
+    for (int i = 0; i < count; i++)
+        last_grid[i] = UINT64_MAX;
+
+    for (size_t i = 0; i < pulses.size(); i++)
+    {
+        if (i > 0)
+            CHECK_MSG(pulses[i].rise - pulses[i - 1].fall >= min_gap, "gap %llu at pulse %zu",
+                      (unsigned long long)(pulses[i].rise - pulses[i - 1].fall), i);
+
+        // Grid point of each voice at or before the rise that has not been
+        // played yet, the pulse goes to the one due first like in
+        // synth_next_voice
+        int voice = -1;
+        uint64_t behind = 0;
+        uint64_t grid = 0;
+        for (int v = 0; v < count; v++)
+        {
+            uint32_t period = note_period_table[notes[v]];
+            if (pulses[i].rise < phases[v])
+                continue;
+
+            uint64_t point = phases[v] + (pulses[i].rise - phases[v]) / period * period;
+            if (point == last_grid[v] || pulses[i].rise - point > max_slip)
+                continue;
+
+            if (voice < 0 || pulses[i].rise - point > behind)
+            {
+                voice = v;
+                behind = pulses[i].rise - point;
+                grid = point;
+            }
+        }
+
+        CHECK_MSG(voice >= 0, "pulse %zu at %llu off every grid", i,
+                  (unsigned long long)pulses[i].rise);
+        if (voice >= 0)
+        {
+            last_grid[voice] = grid;
+            voice_pulses[voice]++;
+        }
+    }
+
+    // Each voice is heard at its own rate, less what collisions and the
+    // governor dropped
+    double seconds = (double)(pulses.back().fall - pulses.front().rise) / SYNTH_SM_HZ;
+    for (int v = 0; v < count; v++)
+    {
+        double expected = seconds * SYNTH_SM_HZ / note_period_table[notes[v]];
+        printf("note %d: %u of %.0f pulses\n", notes[v], voice_pulses[v], expected);
+        CHECK(voice_pulses[v] > 0);
+        CHECK(voice_pulses[v] <= expected + 1);
+    }
+
+    synth_stop();
+}
+
+int main()
+{
+    transmitter_init();
+    synth_init();
+
+    test_single_voice();
+
+    const uint8_t triad[] = {48, 52, 55};
+    test_chord(triad, 3, 40);
+
+    const uint8_t cluster[] = {60, 61, 62, 63};
+    test_chord(cluster, 4, 40);
+
+    const uint8_t full[] = {36, 48, 60, 67, 76, 83};
+    test_chord(full, 6, 127);
+
+    return test_result();
+}
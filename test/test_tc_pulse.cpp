@@ -0,0 +1,513 @@
+// tc_pulse.pio against tc_pulse_model.h. The program is read from the
+// firmware source and stepped one state machine cycle at a time by a small
+// PIO emulator that knows the instructions the program uses. Random
+// requests and the blocks the synth plans for a chord go through both, and
+// every edge of the pins has to be where the model puts it.
+
+#include "test.h"
+#include "synth.h"
+#include "tc_pulse_model.h"
+
+#include <deque>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+typedef enum
+{
+    PIO_JMP,
+    PIO_PULL,
+    PIO_MOV,
+    PIO_SET
+} PioOp;
+
+typedef enum
+{
+    PIO_ALWAYS,
+    PIO_NOT_X,
+    PIO_X_DEC,
+    PIO_NOT_Y,
+    PIO_Y_DEC
+} PioCondition;
+
+typedef enum
+{
+    PIO_X,
+    PIO_Y,
+    PIO_ISR,
+    PIO_OSR,
+    PIO_PINS,
+    PIO_NULL
+} PioRegister;
+
+typedef struct
+{
+    PioOp op;
+    PioCondition condition; // jmp
+    int target;             // jmp
+    bool block;             // pull
+    PioRegister destination; // mov, set
+    PioRegister source;      // mov
+    uint32_t value;          // set
+    uint32_t delay;
+    std::string text;
+} PioInstruction;
+
+typedef struct
+{
+    std::vector<PioInstruction> program;
+    int wrap_target = 0;
+    int wrap = -1;
+    bool parsed = true;
+} PioProgram;
+
+std::string trim(const std::string &text)
+{
+    size_t first = text.find_first_not_of(" \t\r");
+    size_t last = text.find_last_not_of(" \t\r");
+    return first == std::string::npos ? "" : text.substr(first, last - first + 1);
+}
+
+PioRegister pio_register(const std::string &name, bool *ok)
+{
+    static const std::map<std::string, PioRegister> names = {
+        {"x", PIO_X}, {"y", PIO_Y}, {"isr", PIO_ISR}, {"osr", PIO_OSR}, {"pins", PIO_PINS}, {"null", PIO_NULL}};
+
+    auto found = names.find(name);
+    if (found == names.end())
+    {
+        *ok = false;
+        return PIO_NULL;
+    }
+    return found->second;
+}
+
+// The .program part of a pio file: labels, .wrap_target and .wrap, and the
+// jmp, pull, mov and set forms tc_pulse uses, with [delay]
+PioProgram parse_pio(const char *path)
+{
+    PioProgram pio;
+    std::ifstream file(path);
+    std::map<std::string, int> labels;
+    std::vector<std::string> targets;
+    std::string line;
+    bool in_sdk_block = false;
+
+    if (!file)
+    {
+        printf("cannot read %s\n", path);
+        pio.parsed = false;
+        return pio;
+    }
+
+    while (std::getline(file, line))
+    {
+        line = trim(line.substr(0, line.find(';')));
+        if (line.rfind("%", 0) == 0)
+            in_sdk_block = line.find('{') != std::string::npos;
+        if (in_sdk_block || line.empty() || line.rfind("%", 0) == 0 || line.rfind(".program", 0) == 0)
+            continue;
+
+        if (line == ".wrap_target")
+        {
+            pio.wrap_target = pio.program.size();
+            continue;
+        }
+        if (line == ".wrap")
+        {
+            pio.wrap = (int)pio.program.size() - 1;
+            continue;
+        }
+        if (line.back() == ':')
+        {
+            std::string label = line.substr(0, line.size() - 1);
+            if (label.rfind("public ", 0) == 0)
+                label = trim(label.substr(7));
+            labels[label] = pio.program.size();
+            continue;
+        }
+
+        PioInstruction instruction = {};
+        instruction.text = line;
+
+        size_t bracket = line.find('[');
+        if (bracket != std::string::npos)
+        {
+            instruction.delay = std::stoul(line.substr(bracket + 1));
+            line = trim(line.substr(0, bracket));
+        }
+
+        std::istringstream words(line);
+        std::string op;
+        words >> op;
+        std::string rest = trim(line.substr(op.size()));
+        bool ok = true;
+
+        if (op == "jmp")
+        {
+            instruction.op = PIO_JMP;
+            std::string target = rest;
+            size_t space = rest.find(' ');
+            if (space != std::string::npos)
+            {
+                std::string condition = rest.substr(0, space);
+                target = trim(rest.substr(space));
+                if (condition == "!x")
+                    instruction.condition = PIO_NOT_X;
+                else if (condition == "x--")
+                    instruction.condition = PIO_X_DEC;
+                else if (condition == "!y")
+                    instruction.condition = PIO_NOT_Y;
+                else if (condition == "y--")
+                    instruction.condition = PIO_Y_DEC;
+                else
+                    ok = false;
+            }
+            instruction.target = targets.size();
+            targets.push_back(target);
+        }
+        else if (op == "pull")
+        {
+            instruction.op = PIO_PULL;
+            instruction.block = rest != "noblock";
+        }
+        else if (op == "mov" || op == "set")
+        {
+            size_t comma = rest.find(',');
+            ok = comma != std::string::npos;
+            if (ok)
+            {
+                instruction.destination = pio_register(trim(rest.substr(0, comma)), &ok);
+                std::string source = trim(rest.substr(comma + 1));
+                if (op == "mov")
+                {
+                    instruction.op = PIO_MOV;
+                    instruction.source = pio_register(source, &ok);
+                }
+                else
+                {
+                    instruction.op = PIO_SET;
+                    instruction.value = std::stoul(source, nullptr, 0);
+                }
+            }
+        }
+        else
+        {
+            ok = false;
+        }
+
+        if (!ok)
+        {
+            printf("%s: cannot run '%s'\n", path, instruction.text.c_str());
+            pio.parsed = false;
+        }
+        pio.program.push_back(instruction);
+    }
+
+    // Jump targets once all labels are known
+    for (PioInstruction &instruction : pio.program)
+    {
+        if (instruction.op != PIO_JMP)
+            continue;
+
+        auto label = labels.find(targets[instruction.target]);
+        if (label == labels.end())
+        {
+            printf("%s: no label %s\n", path, targets[instruction.target].c_str());
+            pio.parsed = false;
+            instruction.target = 0;
+        }
+        else
+        {
+            instruction.target = label->second;
+        }
+    }
+
+    if (pio.wrap < 0)
+        pio.wrap = (int)pio.program.size() - 1;
+
+    return pio;
+}
+
+typedef struct
+{
+    uint64_t cycle;
+    uint32_t pins;
+} PinEdge;
+
+// One state machine. Every instruction takes a cycle plus its delay, a
+// blocking pull on an empty FIFO stalls, which is where a run ends.
+class PioMachine
+{
+public:
+    const PioProgram *pio;
+    int pc = 0;
+    uint32_t x = 0, y = 0, isr = 0, osr = 0;
+    uint32_t pins = 0;
+    uint64_t cycle = 0;
+    std::deque<uint32_t> fifo;
+    std::vector<PinEdge> edges;
+
+    // Runs until a pull finds the FIFO empty
+    void run()
+    {
+        while (true)
+        {
+            const PioInstruction *instruction = &pio->program[pc];
+            int next = pc == pio->wrap ? pio->wrap_target : pc + 1;
+
+            switch (instruction->op)
+            {
+            case PIO_PULL:
+                if (fifo.empty())
+                {
+                    if (instruction->block)
+                        return;
+                    osr = x;
+                }
+                else
+                {
+                    osr = fifo.front();
+                    fifo.pop_front();
+                }
+                break;
+            case PIO_MOV:
+                write(instruction->destination, read(instruction->source));
+                break;
+            case PIO_SET:
+                write(instruction->destination, instruction->value);
+                break;
+            case PIO_JMP:
+                if (condition(instruction->condition))
+                    next = instruction->target;
+                break;
+            }
+
+            pc = next;
+            cycle += 1 + instruction->delay;
+        }
+    }
+
+private:
+    bool condition(PioCondition condition)
+    {
+        switch (condition)
+        {
+        case PIO_NOT_X:
+            return x == 0;
+        case PIO_X_DEC:
+            return x-- != 0;
+        case PIO_NOT_Y:
+            return y == 0;
+        case PIO_Y_DEC:
+            return y-- != 0;
+        default:
+            return true;
+        }
+    }
+
+    uint32_t read(PioRegister source)
+    {
+        switch (source)
+        {
+        case PIO_X:
+            return x;
+        case PIO_Y:
+            return y;
+        case PIO_ISR:
+            return isr;
+        case PIO_OSR:
+            return osr;
+        case PIO_PINS:
+            return pins;
+        default:
+            return 0;
+        }
+    }
+
+    void write(PioRegister destination, uint32_t value)
+    {
+        switch (destination)
+        {
+        case PIO_X:
+            x = value;
+            break;
+        case PIO_Y:
+            y = value;
+            break;
+        case PIO_ISR:
+            isr = value;
+            break;
+        case PIO_OSR:
+            osr = value;
+            break;
+        case PIO_PINS:
+            // Edges are at the cycle the instruction runs in, like the
+            // request starts are at the cycle of their pull
+            if (value != pins)
+                edges.push_back({cycle, value});
+            pins = value;
+            break;
+        default:
+            break;
+        }
+    }
+};
+
+// Pulses of the TX pin, bit 0 of the set pins
+std::vector<Pulse> machine_pulses(const PioMachine *machine)
+{
+    std::vector<Pulse> pulses;
+    uint64_t rise = 0;
+    bool on = false;
+
+    for (const PinEdge &edge : machine->edges)
+    {
+        CHECK_MSG(edge.pins == 0 || edge.pins == 3, "TX and status LED apart at cycle %llu",
+                  (unsigned long long)edge.cycle);
+        if (!on && (edge.pins & 1))
+            rise = edge.cycle;
+        if (on && !(edge.pins & 1))
+            pulses.push_back({rise, edge.cycle});
+        on = edge.pins & 1;
+    }
+
+    return pulses;
+}
+
+// Same words through the program and the model: same pulses, and the
+// machine waits for the next request exactly where the model's timeline is
+void compare(const PioProgram *pio, const std::vector<uint32_t> &words, const char *name)
+{
+    PioMachine machine;
+    machine.pio = pio;
+    machine.isr = SYNTH_ON_CEILING; // What tc_pulse_program_init leaves in ISR
+    machine.fifo.assign(words.begin(), words.end());
+    machine.run();
+
+    std::vector<Pulse> expected;
+    uint64_t end = 0;
+    tc_pulse_decode(words.data(), words.size(), &end, &expected);
+
+    std::vector<Pulse> pulses = machine_pulses(&machine);
+    CHECK_MSG(pulses.size() == expected.size(), "%s: %zu pulses, the model has %zu", name, pulses.size(),
+              expected.size());
+
+    uint32_t wrong = 0;
+    for (size_t i = 0; i < pulses.size() && i < expected.size(); i++)
+    {
+        if ((pulses[i].rise != expected[i].rise || pulses[i].fall != expected[i].fall) && wrong++ < 10)
+            printf("%s: pulse %zu %llu-%llu, the model has %llu-%llu\n", name, i, (unsigned long long)pulses[i].rise,
+                   (unsigned long long)pulses[i].fall, (unsigned long long)expected[i].rise,
+                   (unsigned long long)expected[i].fall);
+    }
+    CHECK_EQ(wrong, 0);
+
+    // The pull that stalls is the start of the request that never came
+    CHECK_MSG(machine.cycle == end, "%s: next request at %llu, the model has %llu", name,
+              (unsigned long long)machine.cycle, (unsigned long long)end);
+}
+
+// The documented counts one request at a time
+void test_counts(const PioProgram *pio)
+{
+    const uint32_t offs[] = {0, 1, 2, 100, 1600};
+    const uint32_t ons[] = {0, 1, 2, 50, SYNTH_ON_CEILING - 1, SYNTH_ON_CEILING, SYNTH_ON_CEILING + 1, 100000};
+
+    for (uint32_t off : offs)
+    {
+        for (uint32_t on : ons)
+        {
+            PioMachine machine;
+            machine.pio = pio;
+            machine.isr = SYNTH_ON_CEILING;
+            machine.fifo = {off, on};
+            machine.run();
+
+            std::vector<Pulse> pulses = machine_pulses(&machine);
+            if (on == 0)
+            {
+                CHECK_MSG(pulses.empty(), "off %u on 0 pulsed", off);
+                CHECK_MSG(machine.cycle == off + TC_PULSE_RISE, "off %u on 0 waited %llu", off,
+                          (unsigned long long)machine.cycle);
+                continue;
+            }
+
+            uint32_t limited = on < SYNTH_ON_CEILING ? on : SYNTH_ON_CEILING;
+            CHECK_EQ(pulses.size(), 1);
+            if (pulses.size() != 1)
+                continue;
+            CHECK_MSG(pulses[0].rise == off + TC_PULSE_RISE, "off %u on %u rose at %llu", off, on,
+                      (unsigned long long)pulses[0].rise);
+            CHECK_MSG(pulses[0].fall - pulses[0].rise == 2 * limited + TC_PULSE_HIGH, "off %u on %u high for %llu",
+                      off, on, (unsigned long long)(pulses[0].fall - pulses[0].rise));
+            CHECK_MSG(machine.cycle == pulses[0].fall + 1, "off %u on %u next request at %llu", off, on,
+                      (unsigned long long)machine.cycle);
+        }
+    }
+
+    // The ceiling is MAX_PULSE_WIDTH at most, in state machine cycles
+    CHECK(2 * SYNTH_ON_CEILING + TC_PULSE_HIGH <= MAX_PULSE_WIDTH * (SYNTH_SM_HZ / 1000000));
+}
+
+void test_random(const PioProgram *pio)
+{
+    std::mt19937 random(13);
+
+    for (int run = 0; run < 200; run++)
+    {
+        std::vector<uint32_t> words;
+        for (int i = 0; i < 64; i++)
+        {
+            words.push_back(random() % 3 == 0 ? random() % 8 : random() % 20000);
+            uint32_t on = random() % 4;
+            words.push_back(on == 0 ? 0 : on == 1 ? SYNTH_ON_CEILING + random() % 1000 : random() % SYNTH_ON_CEILING);
+        }
+        compare(pio, words, "random");
+    }
+}
+
+// The words the synth sends for a full chord, block after block
+void test_synth_blocks(const PioProgram *pio)
+{
+    transmitter_init();
+    synth_init();
+    synth_start();
+    SynthOutput *output = &synth_outputs[0];
+
+    const uint8_t notes[] = {36, 48, 60, 67, 76, 83};
+    for (int i = 0; i < 6; i++)
+        synth_note_on(0, 0, notes[i], 127, ENVELOPE_PIANO);
+
+    std::vector<uint32_t> words;
+    for (int block = 0; block < 2000; block++)
+    {
+        uint8_t index = output->playing_block;
+        words.insert(words.end(), output->blocks[index], output->blocks[index] + output->block_words[index]);
+
+        sim_dma[output->dma].irq1_status = true;
+        synth_dma_irq_handler();
+        sim_advance_us(SYNTH_BLOCK_US);
+    }
+    synth_stop();
+
+    compare(pio, words, "synth chord");
+}
+
+int main()
+{
+    PioProgram pio = parse_pio(FIRMWARE_DIR "/tc_pulse.pio");
+    CHECK(pio.parsed);
+    CHECK(!pio.program.empty());
+    if (!pio.parsed || pio.program.empty())
+        return test_result();
+
+    test_counts(&pio);
+    test_random(&pio);
+    test_synth_blocks(&pio);
+
+    return test_result();
+}
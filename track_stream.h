@@ -0,0 +1,185 @@
+#ifndef TRACK_STREAM_H
+#define TRACK_STREAM_H
+
+#include <stdio.h>
+#include <string.h>
+#include <pico/stdlib.h>
+#include "ff.h"
+#include "log.h"
+
+// Size of each of the two blocks buffered per stream (one SD sector)
+#define TRACK_STREAM_BLOCK_SIZE 512
+
+// Reads a chunk of a file in fixed-size blocks so that memory use does not
+// depend on the size of the chunk. One block is consumed by the cursor while
+// the other one is topped up by refill(), which the player calls while it is
+// waiting for the next event and has the time for a read. Several streams may share one FIL since
+// every refill seeks to its own position first.
+class TrackStream
+{
+private:
+    FIL *fil = nullptr;
+    uint32_t next_offset = 0; // File position of the next block to fetch
+    uint32_t remaining = 0;   // Chunk bytes not yet fetched from the card
+    uint32_t consumed = 0;    // Chunk bytes handed out by read()
+    bool error = false;
+
+    uint8_t blocks[2][TRACK_STREAM_BLOCK_SIZE];
+    uint16_t fill[2] = {0, 0}; // Valid bytes in each block, 0 if empty
+    uint8_t active = 0;        // Block the cursor is in
+    uint16_t cursor = 0;
+
+    bool load_block(uint8_t);
+    bool advance_block();
+
+public:
+    bool open(FIL *, uint32_t, uint32_t);
+    void close();
+    bool refill();
+    bool read(uint8_t *);
+    bool read_bytes(void *, uint32_t);
+    bool peek(uint8_t *);
+    bool eof();
+    bool failed();
+    uint32_t position();
+};
+
+bool TrackStream::open(FIL *file, uint32_t offset, uint32_t length)
+{
+    fil = file;
+    next_offset = offset;
+    remaining = length;
+    consumed = 0;
+    error = false;
+
+    fill[0] = 0;
+    fill[1] = 0;
+    active = 0;
+    cursor = 0;
+
+    // Prime both blocks so playback starts with a full block of lookahead
+    if (!load_block(0))
+        return false;
+    load_block(1);
+
+    return !error;
+}
+
+void TrackStream::close()
+{
+    fil = nullptr;
+    remaining = 0;
+    fill[0] = 0;
+    fill[1] = 0;
+    cursor = 0;
+}
+
+bool TrackStream::load_block(uint8_t block)
+{
+    if (remaining == 0 || fil == nullptr || error)
+        return false;
+
+    UINT to_read = remaining < TRACK_STREAM_BLOCK_SIZE ? remaining : TRACK_STREAM_BLOCK_SIZE;
+    UINT bytes_read = 0;
+
+    if (f_tell(fil) != next_offset && f_lseek(fil, next_offset) != FR_OK)
+    {
+        error = true;
+        return false;
+    }
+
+    if (f_read(fil, blocks[block], to_read, &bytes_read) != FR_OK || bytes_read != to_read)
+    {
+        LOG_ERROR("Track stream read %u of %u bytes at %lu\n", bytes_read, to_read, next_offset);
+        error = true;
+        return false;
+    }
+
+    fill[block] = to_read;
+    next_offset += to_read;
+    remaining -= to_read;
+
+    return true;
+}
+
+bool TrackStream::advance_block()
+{
+    // Release the block we just finished and move over to the other one
+    fill[active] = 0;
+    active ^= 1;
+    cursor = 0;
+
+    // Lookahead should already be there, this only happens if refill() was
+    // not called in time
+    if (fill[active] == 0 && !load_block(active))
+        return false;
+
+    return true;
+}
+
+// Loads the block the cursor is not in if it is empty, returns whether a
+// block was read
+bool TrackStream::refill()
+{
+    uint8_t idle = active ^ 1;
+
+    return fill[idle] == 0 && load_block(idle);
+}
+
+bool TrackStream::peek(uint8_t *value)
+{
+    if (cursor >= fill[active] && !advance_block())
+        return false;
+
+    *value = blocks[active][cursor];
+    return true;
+}
+
+bool TrackStream::read(uint8_t *value)
+{
+    if (!peek(value))
+        return false;
+
+    cursor++;
+    consumed++;
+    return true;
+}
+
+bool TrackStream::read_bytes(void *destination, uint32_t length)
+{
+    uint8_t *out = (uint8_t *)destination;
+
+    while (length > 0)
+    {
+        if (cursor >= fill[active] && !advance_block())
+            return false;
+
+        uint32_t available = fill[active] - cursor;
+        uint32_t count = length < available ? length : available;
+
+        memcpy(out, &blocks[active][cursor], count);
+        out += count;
+        cursor += count;
+        consumed += count;
+        length -= count;
+    }
+
+    return true;
+}
+
+bool TrackStream::eof()
+{
+    return cursor >= fill[active] && fill[active ^ 1] == 0 && remaining == 0;
+}
+
+bool TrackStream::failed()
+{
+    return error;
+}
+
+uint32_t TrackStream::position()
+{
+    return consumed;
+}
+
+#endif
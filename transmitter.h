@@ -5,40 +5,178 @@
 #include <pico/float.h>
 #include <hardware/pwm.h>
 #include <hardware/irq.h>
+#include <hardware/sync.h>
+#include <hardware/clocks.h>
 #include <math.h>
 #include "util.h"
 
 #define TC_TX 24
 #define STATUS_LED 25
 
-#define MAX_PULSE_WIDTH 100.f // us
-#define MIN_PULSE_WIDTH 30.f  // us
+// Second coil, used when built with TX_OUTPUTS 2
+#define TC_TX_2 2
+#define STATUS_LED_2 3
 
-volatile bool pwm_off = false;
-volatile bool pwm_music = false;
-volatile bool pwm_set = false;
+// Coils driven from one merged event stream, each with its own pins,
+// command queues, envelope and duty governor. MIDI channels are spread
+// over them by tx_channel_outputs.
+#ifndef TX_OUTPUTS
+#define TX_OUTPUTS 1
+#endif
 
-volatile uint8_t note_tx;
-volatile uint8_t velocity_tx;
+#define MAX_PULSE_WIDTH 100 // us
+#define MIN_PULSE_WIDTH 30  // us
+#define MIN_PULSE_GAP 100     // us, off time before the first pulse of a restarted note
 
-volatile uint16_t freq_input;
-volatile uint16_t duty_input;
+#include "note_table.h"
+#include "envelope.h"
 
-uint16_t previous_pot_freq, previous_pot_duty;
+// Commands for pwm_irq_handler are queued per producing core: the player on
+// core1 and the pot controls on core0 each own one ring, the handler is the
+// only consumer. Every command is complete before it is published, so note
+// and velocity always arrive together and nothing queued in the same PWM
+// period gets overwritten.
+#define TX_QUEUE_SIZE 16 // Commands per core, must be a power of two
+
+#define POT_UNSET 0xFFFF // Forces the next pot reading to be applied
+
+typedef enum
+{
+    TX_COMMAND_OFF,
+    TX_COMMAND_NOTE,
+    TX_COMMAND_POTS
+} TxCommandType;
+
+typedef struct
+{
+    uint8_t type;
+    uint8_t note;
+    uint8_t velocity;
+    uint8_t frequency_index; // Into frequency_table, pot control only
+    uint16_t width_us;       // Pot control only
+    uint8_t envelope;        // Profile of a note on
+} TxCommand;
+
+typedef struct
+{
+    TxCommand commands[TX_QUEUE_SIZE];
+    volatile uint32_t head; // Written by the producing core only
+    volatile uint32_t tail; // Written by pwm_irq_handler only
+} TxQueue;
+
+volatile uint16_t previous_pot_freq = POT_UNSET;
+volatile uint16_t previous_pot_duty = POT_UNSET;
+
+// Duty governor: on time is summed over a short and a long sliding window,
+// each a ring of buckets so recording a pulse is O(1). Once a window has
+// used GOVERNOR_KNEE_PERCENT of its budget, pulses are shrunk in proportion
+// to what is left, and pulses that would end up shorter than
+// MIN_PULSE_WIDTH are dropped altogether. Every pulse goes through it: the
+// synth asks per planned pulse, the PWM paths (notes and pots) on every
+// wrap for the pulse of the next period.
+#define GOVERNOR_SHORT_BUCKETS 10
+#define GOVERNOR_SHORT_BUCKET_US 10000 // 100ms window
+#define GOVERNOR_SHORT_PERMILLE 150    // Highest duty over the short window
+#define GOVERNOR_LONG_BUCKETS 100
+#define GOVERNOR_LONG_BUCKET_US 100000 // 10s window
+#define GOVERNOR_LONG_PERMILLE 80      // Highest duty over the long window
+#define GOVERNOR_KNEE_PERCENT 75
+
+typedef struct
+{
+    uint32_t *buckets;    // On time per bucket, us
+    uint16_t bucket_count;
+    uint32_t bucket_us;
+    uint32_t budget;      // On time allowed over the whole window, us
+    uint32_t total;       // Sum of all buckets
+    uint16_t current;
+    uint64_t current_end; // End of the current bucket, us since boot
+} DutyWindow;
+
+// Everything that belongs to one coil. The fibre driver and its status LED
+// are channels A and B of the same slice, and consecutive pins so the synth
+// can drive both from one state machine.
+typedef struct
+{
+    uint8_t pin;
+    uint8_t led;
+    uint slice;
+
+    TxQueue queues[2]; // One per producing core
+
+    // Sounding MIDI note and the period multiplier (16.16) the modulation
+    // engine asks for. All of these are only used on core0, by
+    // pwm_irq_handler and the modulation timer, which do not preempt each
+    // other.
+    const PwmSetting *note_setting;
+    uint32_t period_scale;
+
+    // What the slice runs: the pot setting, or the note setting with its
+    // period scaled. A scaled period that needs another divider waits in
+    // `resolved` for the next wrap.
+    PwmSetting running;
+    PwmSetting resolved;
+    bool resolve_pending;
+
+    // Envelope of the sounding MIDI note, stepped by pwm_irq_handler on
+    // every wrap. Core0 only as well.
+    Envelope envelope;
+    bool envelope_on;
+    uint16_t note_width; // Velocity width, us
+
+    // Pot setting while the pots are in control, else nullptr
+    const PwmSetting *pot_setting;
+    uint16_t pot_width; // us
+
+    uint32_t governor_short_buckets[GOVERNOR_SHORT_BUCKETS];
+    uint32_t governor_long_buckets[GOVERNOR_LONG_BUCKETS];
+    DutyWindow governor[2];
+} TxOutput;
+
+const uint8_t tx_output_pins[][2] = {{TC_TX, STATUS_LED}, {TC_TX_2, STATUS_LED_2}};
+
+static_assert(TX_OUTPUTS >= 1 && TX_OUTPUTS <= sizeof(tx_output_pins) / sizeof(tx_output_pins[0]), "Pins for every output");
+static_assert(TC_TX % 2 == 0 && STATUS_LED == TC_TX + 1, "TC_TX and STATUS_LED share a slice");
+static_assert(TC_TX_2 % 2 == 0 && STATUS_LED_2 == TC_TX_2 + 1, "TC_TX_2 and STATUS_LED_2 share a slice");
+
+TxOutput tx_outputs[TX_OUTPUTS];
+
+// Routing table, output of every MIDI channel
+uint8_t tx_channel_outputs[16];
+
+uint32_t transmitter_clock = NOTE_TABLE_CLOCK; // clk_sys, read in transmitter_init
 
 // Store Range of frequencies supported by Tesla Coil
 const uint16_t frequency_table[18] = {
     15, 20, 25, 30, 35, 40, 45, 50, 100, 200, 300, 400, 500, 600, 700, 800, 900, 1000};
 
+// PWM settings for frequency_table, solved in transmitter_init
+PwmSetting frequency_pwm_table[18];
+
 // Utility
 int map(int, int, int, int, int);
 
-uint32_t set_transmitter_freq_duty(uint, uint, uint32_t, int);
-uint32_t set_transmitter_freq_duty(uint, uint, uint32_t, float);
+uint16_t velocity_width(uint8_t);
+void transmitter_pulse(TxOutput *, const PwmSetting *, uint32_t, bool);
+PwmSetting transmitter_scaled_setting(const PwmSetting *, uint16_t, uint32_t);
+void transmitter_modulate(uint8_t, uint32_t);
 void transmitter_init();
+void transmitter_route(uint8_t, uint8_t);
+uint8_t transmitter_output(uint8_t);
 void pwm_irq_handler();
-void transmitt_music(uint16_t, uint16_t);
+void transmitter_push(TxOutput *, const TxCommand *);
+bool transmitter_pending(const TxOutput *);
+void transmitter_apply(TxOutput *, const TxCommand *);
+void transmitter_retune(TxOutput *, uint16_t, uint16_t, uint16_t, bool);
+uint32_t transmitter_envelope_width(const TxOutput *, uint32_t);
+bool transmitter_step(TxOutput *);
+void transmitter_serve(TxOutput *);
+void duty_window_advance(DutyWindow *, uint64_t);
+uint32_t governor_pulse(TxOutput *, uint64_t, uint32_t);
+void transmitt_music(uint8_t, uint8_t, uint8_t, uint8_t);
 void transmitt_off();
+uint8_t pot_frequency_index(uint16_t);
+uint16_t pot_width(uint16_t);
 void set_transmitter(uint16_t, uint16_t);
 void reset_transmitter(void);
 
@@ -49,168 +187,528 @@ int map(int v, int a1, int a2, int b1, int b2)
 
 void transmitter_init()
 {
-    gpio_set_function(TC_TX, GPIO_FUNC_PWM);
-    gpio_set_function(STATUS_LED, GPIO_FUNC_PWM);
-
-    uint slice_num = pwm_gpio_to_slice_num(TC_TX);
-    uint slice_num_stat = pwm_gpio_to_slice_num(STATUS_LED);
+    pwm_config config = pwm_get_default_config();
+    // pwm_config_set_clkdiv(&config, 16.0);
+    // pwm_config_set_wrap(&config, 1000);
 
-    pwm_clear_irq(slice_num);
-    pwm_clear_irq(slice_num_stat);
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        TxOutput *output = &tx_outputs[i];
+
+        output->pin = tx_output_pins[i][0];
+        output->led = tx_output_pins[i][1];
+        output->slice = pwm_gpio_to_slice_num(output->pin);
+        output->note_setting = nullptr;
+        output->period_scale = 1u << 16;
+        output->resolve_pending = false;
+        output->envelope_on = false;
+        output->pot_setting = nullptr;
+
+        output->governor[0] = {output->governor_short_buckets, GOVERNOR_SHORT_BUCKETS, GOVERNOR_SHORT_BUCKET_US,
+                               GOVERNOR_SHORT_BUCKETS * (GOVERNOR_SHORT_BUCKET_US / 1000) * GOVERNOR_SHORT_PERMILLE, 0, 0, 0};
+        output->governor[1] = {output->governor_long_buckets, GOVERNOR_LONG_BUCKETS, GOVERNOR_LONG_BUCKET_US,
+                               GOVERNOR_LONG_BUCKETS * (GOVERNOR_LONG_BUCKET_US / 1000) * GOVERNOR_LONG_PERMILLE, 0, 0, 0};
+
+        gpio_set_function(output->pin, GPIO_FUNC_PWM);
+        gpio_set_function(output->led, GPIO_FUNC_PWM);
+
+        // Both pins sit on the same slice. Its wrap interrupt stays off
+        // until a command is queued.
+        pwm_clear_irq(output->slice);
+        pwm_init(output->slice, &config, true);
+    }
 
-    pwm_set_irq_enabled(slice_num, true);
-    pwm_set_irq_enabled(slice_num_stat, true);
+    // Channels are dealt out over the outputs in turn
+    for (int channel = 0; channel < 16; channel++)
+        tx_channel_outputs[channel] = channel % TX_OUTPUTS;
 
+    // One interrupt for all slices, the handler sorts them out
     irq_set_exclusive_handler(PWM_IRQ_WRAP, pwm_irq_handler);
     irq_set_enabled(PWM_IRQ_WRAP, true);
 
-    pwm_config config = pwm_get_default_config();
-    // pwm_config_set_clkdiv(&config, 16.0);
-    // pwm_config_set_wrap(&config, 1000);
+    // Note settings are worked out for the clock the slices really run at
+    transmitter_clock = clock_get_hz(clk_sys);
+    note_table_init(transmitter_clock);
 
-    pwm_init(slice_num, &config, true);
-    pwm_init(slice_num_stat, &config, true);
+    for (int i = 0; i < 18; i++)
+        frequency_pwm_table[i] = pwm_solve(transmitter_clock, frequency_table[i] * 1000);
 }
 
-uint32_t set_transmitter_freq_duty(uint slice_num, uint chan, uint32_t f, int d)
+// Moves the window up to `now`, emptying the buckets that fell out of it.
+// Each bucket is passed once, after a long silence the window is cleared in
+// one go.
+void duty_window_advance(DutyWindow *window, uint64_t now)
 {
-    // Calculate best clock and wrap value for pwm
-    uint32_t clock = 125000000;
-    uint32_t divider16 = clock / f / 4096 + (clock % (f * 4096) != 0);
+    if (now >= window->current_end + (uint64_t)window->bucket_count * window->bucket_us)
+    {
+        for (uint16_t i = 0; i < window->bucket_count; i++)
+            window->buckets[i] = 0;
 
-    if (divider16 / 16 == 0)
-        divider16 = 16;
+        window->total = 0;
+        window->current_end = now + window->bucket_us;
+        return;
+    }
 
-    uint32_t wrap = clock * 16 / divider16 / f - 1;
-    uint32_t high_time = wrap * d / 100;
+    while (now >= window->current_end)
+    {
+        window->current = (window->current + 1) % window->bucket_count;
+        window->total -= window->buckets[window->current];
+        window->buckets[window->current] = 0;
+        window->current_end += window->bucket_us;
+    }
+}
 
-    pwm_set_clkdiv_int_frac(slice_num, divider16 / 16, divider16 & 0xF);
-    pwm_set_wrap(slice_num, wrap);
-    pwm_set_chan_level(slice_num, chan, high_time);
+// Sends a MIDI channel to an output
+void transmitter_route(uint8_t channel, uint8_t output)
+{
+    tx_channel_outputs[channel & 0x0F] = output < TX_OUTPUTS ? output : 0;
+}
 
-    return wrap;
+uint8_t transmitter_output(uint8_t channel)
+{
+    return tx_channel_outputs[channel & 0x0F];
 }
 
-uint32_t set_transmitter_freq_duty(uint slice_num, uint chan, uint32_t f, float d)
+// Asks the governor of an output for a pulse of on_us starting at `now` (us,
+// never going backwards). Returns the on time that may be used, which is
+// recorded, or 0 if the pulse has to be dropped.
+uint32_t governor_pulse(TxOutput *output, uint64_t now, uint32_t on_us)
 {
-    // Calculate best clock and wrap value for pwm
-    uint32_t clock = 125000000;
-    uint32_t divider16 = clock / f / 4096 + (clock % (f * 4096) != 0);
+    uint32_t scale = 256; // 8.8 fixed point
+
+    for (int i = 0; i < 2; i++)
+    {
+        DutyWindow *window = &output->governor[i];
+        duty_window_advance(window, now);
+
+        uint32_t knee = window->budget / 100 * GOVERNOR_KNEE_PERCENT;
+        uint32_t window_scale = 256;
 
-    if (divider16 / 16 == 0)
-        divider16 = 16;
+        if (window->total >= window->budget)
+            window_scale = 0;
+        else if (window->total > knee)
+            window_scale = (uint64_t)(window->budget - window->total) * 256 / (window->budget - knee);
 
-    uint32_t wrap = clock * 16 / divider16 / f - 1;
-    uint32_t high_time = (uint32_t)(wrap * d / 100.0); // If the duty % is a floating point value
+        if (window_scale < scale)
+            scale = window_scale;
+    }
+
+    uint32_t allowed = on_us * scale / 256;
+    if (allowed < MIN_PULSE_WIDTH)
+        return 0;
+
+    for (int i = 0; i < 2; i++)
+    {
+        DutyWindow *window = &output->governor[i];
+        window->buckets[window->current] += allowed;
+        window->total += allowed;
+    }
 
-    pwm_set_clkdiv_int_frac(slice_num, divider16 / 16, divider16 & 0xF);
-    pwm_set_wrap(slice_num, wrap);
-    pwm_set_chan_level(slice_num, chan, high_time);
+    return allowed;
+}
 
-    return wrap;
+// Pulse width for a MIDI velocity (1-127), shared by the mono and poly paths
+uint16_t velocity_width(uint8_t velocity)
+{
+    return MIN_PULSE_WIDTH + (MAX_PULSE_WIDTH - MIN_PULSE_WIDTH) * velocity / 127;
 }
 
-void transmitt_music(uint8_t note, uint8_t velocity)
+// Plays pulses of width_us with the given PWM setting. The pot and MIDI
+// paths both end up here, the level is a fixed point multiply so nothing in
+// the interrupt needs floats.
+void transmitter_pulse(TxOutput *output, const PwmSetting *setting, uint32_t width_us, bool start_now)
 {
-    pwm_music = true;
+    if (width_us > MAX_PULSE_WIDTH)
+        width_us = MAX_PULSE_WIDTH;
 
-    note_tx = note;
-    velocity_tx = velocity;
+    output->running = *setting;
+    transmitter_retune(output, setting->divider16, setting->wrap, pwm_width_level(setting, width_us), start_now);
 }
 
-void transmitt_off()
+// Setting for the period of a note setting multiplied by scale (16.16).
+// `divider16`, the divider the slice runs with, is kept while the period
+// fits the counter with at least half its range, so a bend or vibrato
+// going back and forth does not retune every time. Otherwise the note's
+// own divider is used if the period fits, or the smallest one that leaves
+// the counter NOTE_MAX_COUNTS.
+PwmSetting transmitter_scaled_setting(const PwmSetting *note, uint16_t divider16, uint32_t scale)
 {
-    pwm_off = true;
+    // In 1/16 clk_sys cycles, divider16 times the counts
+    uint64_t period = ((uint64_t)note->divider16 * (note->wrap + 1) * scale) >> 16;
+
+    PwmSetting setting = *note;
+    if (divider16 != note->divider16 && period <= (uint64_t)divider16 * 65536 && period >= (uint64_t)divider16 * 32768)
+        setting.divider16 = divider16;
+    else if (period > (uint64_t)note->divider16 * 65536)
+        setting.divider16 = (period + NOTE_MAX_COUNTS - 1) / NOTE_MAX_COUNTS;
+
+    if (setting.divider16 > 4095)
+        setting.divider16 = 4095;
+    if (setting.divider16 != note->divider16)
+        setting.ticks_q16 = pwm_ticks_q16(transmitter_clock, setting.divider16);
+
+    uint64_t counts = (period + setting.divider16 / 2) / setting.divider16;
+    if (counts > 65536)
+        counts = 65536;
+    if (counts < 2)
+        counts = 2;
+
+    setting.wrap = counts - 1;
+    return setting;
 }
 
-void set_transmitter(uint16_t frequency_pot, uint16_t duty_cycle_pot)
+// Bends the period of the note sounding on an output. While the divider
+// stays, only the wrap changes, it is double buffered so the new period
+// starts cleanly at the next wrap and the pulse width stays the same. A
+// period that needs another divider is retuned by pwm_irq_handler at the
+// next wrap. Must run on core0.
+void transmitter_modulate(uint8_t index, uint32_t scale)
 {
-    pwm_set = true;
+    TxOutput *output = &tx_outputs[index];
 
-    freq_input = frequency_pot;
-    duty_input = duty_cycle_pot;
+    output->period_scale = scale;
+    if (output->note_setting == nullptr)
+        return;
+
+    PwmSetting setting = transmitter_scaled_setting(output->note_setting, output->running.divider16, scale);
+    output->resolve_pending = setting.divider16 != output->running.divider16;
+
+    if (output->resolve_pending)
+    {
+        output->resolved = setting;
+        pwm_set_irq_enabled(output->slice, true);
+        return;
+    }
+
+    output->running = setting;
+    pwm_set_wrap(output->slice, setting.wrap);
 }
 
-void pwm_irq_handler()
+// Queues a command for an output from the calling core. Must not be called
+// from an interrupt on core0, the handler could not preempt it to make room.
+void transmitter_push(TxOutput *output, const TxCommand *command)
 {
-    uint16_t slice_num_tx = pwm_gpio_to_slice_num(TC_TX);
-    uint16_t slice_num_stat = pwm_gpio_to_slice_num(STATUS_LED);
+    TxQueue *queue = &output->queues[get_core_num()];
+    uint32_t head = queue->head;
+
+    // Only fills up when commands come faster than the PWM period, the
+    // handler empties the whole queue on the next wrap
+    while (head - queue->tail >= TX_QUEUE_SIZE)
+        tight_loop_contents();
 
-    uint16_t tx_channel = pwm_gpio_to_channel(TC_TX);
-    uint16_t stat_channel = pwm_gpio_to_channel(STATUS_LED);
+    queue->commands[head & (TX_QUEUE_SIZE - 1)] = *command;
 
-    pwm_clear_irq(slice_num_tx);
-    pwm_clear_irq(slice_num_stat);
+    // Command has to be complete before the handler can see it
+    __dmb();
+    queue->head = head + 1;
 
-    if (pwm_off == true)
+    // The wrap flag goes stale while the interrupt is off, clear it so the
+    // command lands on the next period boundary
+    if ((pwm_hw->inte & (1u << output->slice)) == 0)
     {
-        pwm_set_chan_level(slice_num_tx, tx_channel, 0);
-        pwm_set_chan_level(slice_num_stat, stat_channel, 0);
+        pwm_clear_irq(output->slice);
+        pwm_set_irq_enabled(output->slice, true);
+    }
+}
+
+bool transmitter_pending(const TxOutput *output)
+{
+    return output->queues[0].head != output->queues[0].tail || output->queues[1].head != output->queues[1].tail;
+}
+
+void transmitt_music(uint8_t index, uint8_t note, uint8_t velocity, uint8_t envelope)
+{
+    TxOutput *output = &tx_outputs[index];
+    TxCommand command = {TX_COMMAND_NOTE, note, velocity, 0, 0, envelope};
+    transmitter_push(output, &command);
+
+    // Note ons are not left waiting for the wrap, which can be 30ms away
+    // for the lowest notes
+    if (velocity > 0)
+        pwm_force_irq(output->slice);
+}
+
+// Silences every output
+void transmitt_off()
+{
+    TxCommand command = {TX_COMMAND_OFF, 0, 0, 0, 0, 0};
+    for (int i = 0; i < TX_OUTPUTS; i++)
+        transmitter_push(&tx_outputs[i], &command);
+
+    // Pots have to be applied again once they are back in control
+    previous_pot_freq = POT_UNSET;
+    previous_pot_duty = POT_UNSET;
+}
+
+// Map pot values to a frequency and a pulse width
+uint8_t pot_frequency_index(uint16_t duty_cycle_pot)
+{
+    return map(duty_cycle_pot, 0, 4095, 0, 17);
+}
+
+uint16_t pot_width(uint16_t frequency_pot)
+{
+    return MIN_PULSE_WIDTH + (MAX_PULSE_WIDTH - MIN_PULSE_WIDTH) * frequency_pot / 4095;
+}
+
+void set_transmitter(uint16_t frequency_pot, uint16_t duty_cycle_pot)
+{
+    // Called on every pass of the UI loop, only changes are queued
+    if (frequency_pot == previous_pot_freq && duty_cycle_pot == previous_pot_duty)
+        return;
+
+    previous_pot_freq = frequency_pot;
+    previous_pot_duty = duty_cycle_pot;
 
-        pwm_off = false;
+    uint8_t index = pot_frequency_index(duty_cycle_pot);
+    uint16_t width_us = pot_width(frequency_pot);
+
+    // Every coil plays the pot setting
+    TxCommand command = {TX_COMMAND_POTS, 0, 0, index, width_us, 0};
+    for (int i = 0; i < TX_OUTPUTS; i++)
+        transmitter_push(&tx_outputs[i], &command);
+}
+
+void transmitter_apply(TxOutput *output, const TxCommand *command)
+{
+    uint16_t tx_channel = pwm_gpio_to_channel(output->pin);
+    uint16_t stat_channel = pwm_gpio_to_channel(output->led);
+
+    const PwmSetting *sounding = output->note_setting;
+    output->note_setting = nullptr;
+    output->envelope_on = false;
+    output->pot_setting = nullptr;
+    output->resolve_pending = false;
+
+    if (command->type == TX_COMMAND_OFF)
+    {
+        pwm_set_chan_level(output->slice, tx_channel, 0);
+        pwm_set_chan_level(output->slice, stat_channel, 0);
     }
-    if (pwm_music == true)
+    else if (command->type == TX_COMMAND_NOTE)
     {
+        uint8_t note = command->note;
+        uint8_t velocity = command->velocity;
+
         // Make it only register notes C1-B5 so coil doesn't overload
         // In otherwords, limit frequencies from 32.70Hz to 987.77Hz
-        if (note_tx > 23 && note_tx < 84 && velocity_tx < 128 && velocity_tx > 0)
+        if (note > 23 && note < 84 && velocity < 128 && velocity > 0)
         {
-            // Map midi values to frequencies and duty cycles
-            // Map to frequencies with formula: f=440*2^((n-69)/12)) - tuned A4 at 440Hz
-            uint32_t frequency = 440 * pow(2, ((float)note_tx - 69.0) / 12.0);
-            float pulse_width = MIN_PULSE_WIDTH + ((MAX_PULSE_WIDTH - MIN_PULSE_WIDTH) * (float)velocity_tx) / 127.0;
-            float duty_cycle = ((pulse_width / 1000000.f) / (1.f / (float)frequency)) * 100.f;
-
-            set_transmitter_freq_duty(slice_num_tx, tx_channel, frequency, duty_cycle);
-            set_transmitter_freq_duty(slice_num_stat, stat_channel, frequency, duty_cycle);
+            // Divider and wrap come from the note table, the period
+            // stretched by whatever pitch modulation is going on
+            PwmSetting setting = transmitter_scaled_setting(&note_pwm_table[note], note_pwm_table[note].divider16,
+                                                            output->period_scale);
+
+            uint32_t now = time_us_32();
+            envelope_start(&output->envelope, command->envelope, now);
+            output->note_width = velocity_width(velocity);
+
+            transmitter_pulse(output, &setting, transmitter_envelope_width(output, now), true);
+            output->note_setting = &note_pwm_table[note];
+            output->envelope_on = true;
+        }
+        else if (velocity == 0 && sounding != nullptr && envelope_profiles[output->envelope.profile].release_us > 0)
+        {
+            // Note off fades out over the release, same pitch
+            envelope_release(&output->envelope, time_us_32());
+            output->note_setting = sounding;
+            output->envelope_on = true;
         }
         else
         {
-            pwm_set_chan_level(slice_num_tx, tx_channel, 0);
-            pwm_set_chan_level(slice_num_stat, stat_channel, 0);
+            pwm_set_chan_level(output->slice, tx_channel, 0);
+            pwm_set_chan_level(output->slice, stat_channel, 0);
         }
+    }
+    else if (command->type == TX_COMMAND_POTS)
+    {
+        transmitter_pulse(output, &frequency_pwm_table[command->frequency_index], command->width_us, false);
+        output->pot_setting = &frequency_pwm_table[command->frequency_index];
+        output->pot_width = command->width_us < MAX_PULSE_WIDTH ? command->width_us : MAX_PULSE_WIDTH;
+    }
+}
+
+// Changes divider, wrap and level of an output and its status LED. The
+// divider is not double buffered like wrap and level, so writing it to a
+// running slice would stretch or shrink the pulse of the current period.
+// Instead a pulse that is still on may finish, then the slice is stopped,
+// where all writes take effect immediately, and started again:
+//  - start_now: just below the wrap, the first pulse begins after
+//    MIN_PULSE_GAP (note ons)
+//  - otherwise: from the level, the rest of the period is off time and the
+//    first pulse with the new settings starts at the wrap
+// Either way the pin stays low from the end of the old pulse to the first
+// full pulse of the new settings.
+void transmitter_retune(TxOutput *output, uint16_t divider16, uint16_t wrap, uint16_t level, bool start_now)
+{
+    uint slice = output->slice;
+    uint tx_channel = pwm_gpio_to_channel(output->pin);
+    uint stat_channel = pwm_gpio_to_channel(output->led);
+
+    // Cutting the pulse short would give the coil a runt, waiting is
+    // bounded by two of the longest pulses. The pin is read because a level
+    // queued for the next wrap does not tell whether the output is on right
+    // now. A wrap between the read and the stop starts a pulse, which is
+    // then let run as well.
+    uint32_t start = time_us_32();
+    while (true)
+    {
+        while (gpio_get(output->pin) && time_us_32() - start < 2 * MAX_PULSE_WIDTH)
+            tight_loop_contents();
+
+        pwm_set_enabled(slice, false);
+        if (!gpio_get(output->pin) || time_us_32() - start >= 2 * MAX_PULSE_WIDTH)
+            break;
 
-        pwm_music = false;
+        pwm_set_enabled(slice, true);
     }
-    if (pwm_set == true)
+
+    // Levels go to 0 first and come back once the counter is past them, so
+    // no intermediate counter and level pair turns the output on
+    pwm_set_chan_level(slice, tx_channel, 0);
+    pwm_set_chan_level(slice, stat_channel, 0);
+
+    pwm_set_clkdiv_int_frac(slice, divider16 >> 4, divider16 & 0xF);
+    pwm_set_wrap(slice, wrap);
+
+    uint16_t counter = level;
+    if (start_now)
+    {
+        uint32_t gap = pwm_ticks(transmitter_clock, divider16, MIN_PULSE_GAP);
+        if (gap < (uint32_t)(wrap - level))
+            counter = wrap - gap;
+    }
+    pwm_set_counter(slice, counter);
+
+    pwm_set_chan_level(slice, tx_channel, level);
+    pwm_set_chan_level(slice, stat_channel, level);
+    pwm_set_enabled(slice, true);
+}
+
+// Pulse width of the sounding note at `now`, 0 once the envelope has
+// brought it below MIN_PULSE_WIDTH
+uint32_t transmitter_envelope_width(const TxOutput *output, uint32_t now)
+{
+    uint32_t width_us = output->note_width * envelope_level(&output->envelope, now) / ENVELOPE_FULL;
+    return width_us < MIN_PULSE_WIDTH ? 0 : width_us;
+}
+
+// Sets the compare level for the pulse of the next period: the envelope
+// width of the sounding note, or the pot width, as far as the duty governor
+// allows. Levels are double buffered and a retune starts the counter past
+// the level, so every pulse of the PWM paths is one asked for here. Returns
+// whether the output is still playing and the wrap interrupt has to stay
+// on.
+bool transmitter_step(TxOutput *output)
+{
+    uint32_t now = time_us_32();
+    const PwmSetting *setting = output->pot_setting;
+    uint32_t width_us = output->pot_width;
+
+    if (output->envelope_on)
     {
-        if (previous_pot_duty != freq_input || previous_pot_freq != duty_input)
+        setting = nullptr;
+        if (envelope_done(&output->envelope, now))
         {
-            // Map pot values to frequencies and duty cycles
-            uint8_t index = map(duty_input, 0, 4095, 0, 17);
-            uint32_t frequency = frequency_table[index];
+            // The last level stays latched and keeps firing every period
+            // until something writes 0
+            output->envelope_on = false;
+            output->note_setting = nullptr;
+            pwm_set_chan_level(output->slice, pwm_gpio_to_channel(output->pin), 0);
+            pwm_set_chan_level(output->slice, pwm_gpio_to_channel(output->led), 0);
+        }
+        else
+        {
+            setting = output->note_setting;
+            width_us = transmitter_envelope_width(output, now);
+        }
+    }
+
+    if (setting == nullptr)
+        return false;
+
+    // A bend that left the counter range of the divider: the slice is
+    // retuned now, at the wrap, with the counter past the level so the
+    // rest of this period stays off
+    if (output->resolve_pending && output->envelope_on)
+    {
+        output->resolve_pending = false;
+        output->running = output->resolved;
+        transmitter_retune(output, output->running.divider16, output->running.wrap,
+                           pwm_width_level(&output->running, width_us), false);
+    }
 
-            float pulse_width = MIN_PULSE_WIDTH + ((MAX_PULSE_WIDTH - MIN_PULSE_WIDTH) * freq_input) / 4095.0;
-            float duty_cycle = ((pulse_width / 1000000.f) / (1.f / (float)frequency)) * 100.f;
+    // The level is in ticks of what the slice runs, bent or not
+    uint16_t level = 0;
+    if (width_us > 0)
+        level = pwm_width_level(&output->running, governor_pulse(output, time_us_64(), width_us));
 
-            set_transmitter_freq_duty(slice_num_tx, tx_channel, frequency, duty_cycle);
-            set_transmitter_freq_duty(slice_num_stat, stat_channel, frequency, duty_cycle);
+    pwm_set_chan_level(output->slice, pwm_gpio_to_channel(output->pin), level);
+    pwm_set_chan_level(output->slice, pwm_gpio_to_channel(output->led), level);
+
+    return true;
+}
+
+// Applies everything pending for one output, in the order each core queued
+// it. Called on the wrap after a command was queued, or right away for note
+// ons, and on every wrap while the output is playing.
+void transmitter_serve(TxOutput *output)
+{
+    pwm_clear_irq(output->slice);
+    hw_clear_bits(&pwm_hw->intf, 1u << output->slice);
+
+    for (int core = 0; core < 2; core++)
+    {
+        TxQueue *queue = &output->queues[core];
+
+        while (queue->tail != queue->head)
+        {
+            __dmb();
+            transmitter_apply(output, &queue->commands[queue->tail & (TX_QUEUE_SIZE - 1)]);
+
+            __dmb();
+            queue->tail = queue->tail + 1;
         }
-        previous_pot_duty = duty_input;
-        previous_pot_freq = freq_input;
+    }
 
-        pwm_set = false;
+    if (transmitter_step(output))
+    {
+        pwm_set_irq_enabled(output->slice, true);
+        return;
     }
+
+    // Nothing left, stop taking wrap interrupts. A command published just
+    // before the disable is caught by looking again afterwards.
+    pwm_set_irq_enabled(output->slice, false);
+    __dmb();
+    if (transmitter_pending(output))
+        pwm_set_irq_enabled(output->slice, true);
 }
 
-void reset_transmitter(void)
+// All slices share the wrap interrupt, only the outputs that raised it are
+// served
+void pwm_irq_handler()
 {
-    pwm_off = false;
-    pwm_music = false;
-    pwm_set = false;
+    uint32_t status = pwm_hw->ints;
 
-    note_tx = 0;
-    velocity_tx = 0;
-    freq_input = 0;
-    duty_input = 0;
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        if (status & (1u << tx_outputs[i].slice))
+            transmitter_serve(&tx_outputs[i]);
+    }
+}
 
-    previous_pot_freq = 0;
-    previous_pot_duty = 0;
+void reset_transmitter(void)
+{
+    // Queued commands are still applied in order, the off goes in last
+    transmitt_off();
 
-    uint16_t slice_num_tx = pwm_gpio_to_slice_num(TC_TX);
-    uint16_t slice_num_stat = pwm_gpio_to_slice_num(STATUS_LED);
-    pwm_set_chan_level(slice_num_tx, pwm_gpio_to_channel(TC_TX), 0);
-    pwm_set_chan_level(slice_num_stat, pwm_gpio_to_channel(STATUS_LED), 0);
+    for (int i = 0; i < TX_OUTPUTS; i++)
+    {
+        TxOutput *output = &tx_outputs[i];
+        pwm_set_chan_level(output->slice, pwm_gpio_to_channel(output->pin), 0);
+        pwm_set_chan_level(output->slice, pwm_gpio_to_channel(output->led), 0);
+    }
 }
 
-#endif
\ No newline at end of file
+#endif